@@ -1,5 +1,6 @@
 #include <sys/types.h>
 #include <stdint.h>
+#include <pthread.h>
 
 #ifndef _FMUX_H_
 #define _FMUX_H_
@@ -17,12 +18,95 @@ extern "C" {
 typedef int fmux_chantype;
 
 struct timeval;
+struct iovec;
 
 #define FMUX_CHANTYPE_TEXT 1
 #define FMUX_CHANTYPE_BIN 2
 
 #define FMUX_RECOMMENDED_CHANS 32
 
+//Outbound frame size limits (see fmux_set_max_frame)
+#define FMUX_MIN_FRAME 1
+#define FMUX_DEFAULT_FRAME 65536
+#define FMUX_MAX_FRAME (16 * 1024 * 1024)
+
+//Most iovecs handed to a single writev when sending many frames at once
+#define FMUX_BATCH_IOV 64
+
+//Frame header versions (see fmux_open_v2), and the longest header either
+//writes
+#define FMUX_PROTO_V1 1
+#define FMUX_PROTO_V2 2
+#define FMUX_HEADER_MAX 10
+//fmux_open_v2 negotiates over this channel, which is never delivered or
+//opened. Peers on plain fmux_open drop its frames like any unopened channel's.
+#define FMUX_PROTO_CHANNEL UINT32_MAX
+
+//Most fds a handle can send over, its own included (see fmux_add_link)
+#define FMUX_MAX_LINKS 16
+
+//Size of each handle's receive buffer
+#define FMUX_RX_BUFFER 65536
+
+//Smallest payload fmux_set_splice moves without copying
+#define FMUX_SPLICE_MIN 16384
+
+//Shared memory ring capacity bounds (see fmux_set_shm), rounded up to a power
+//of two
+#define FMUX_SHM_MIN 65536
+#define FMUX_SHM_DEFAULT (4 * 1024 * 1024)
+#define FMUX_SHM_MAX (1 << 30)
+
+//Largest message on a message channel (see fmux_open_msg_channel)
+#define FMUX_MSG_MAX 65536
+
+//Message pool size classes (64 bytes to 64KiB of payload) and how many
+//free buffers each class keeps around
+#define FMUX_POOL_CLASSES 11
+#define FMUX_POOL_DEPTH 64
+
+//Ring channel capacity bounds (rounded up to a power of two) and flags
+#define FMUX_RING_MIN 4096
+#define FMUX_RING_DEFAULT 262144
+#define FMUX_RING_EVENTFD 1 //fmux_channel_read_fd returns a readiness eventfd
+
+//Flow control (see fmux_set_flow_control). Channel 0 carries control frames
+//once it is on.
+#define FMUX_CONTROL_CHANNEL 0
+#define FMUX_MIN_WINDOW 1024
+#define FMUX_MAX_WINDOW (1 << 30)
+
+//Outbound scheduling (see fmux_channel_set_priority)
+#define FMUX_PRIORITY_LEVELS 8
+#define FMUX_PRIORITY_DEFAULT 0
+#define FMUX_MAX_WEIGHT 1024
+#define FMUX_QUANTUM 65536 //Bytes per turn for each unit of weight
+
+//Capture files (see fmux_set_capture): FMUX_CAPTURE_MAGIC, then for every
+//frame a fmux_capture_record followed by its payload, in host byte order
+//and packed (records aren't aligned). nbytes has FMUX_CAPTURE_OUT set for
+//frames sent rather than received.
+#define FMUX_CAPTURE_MAGIC "FMUXCAP1"
+#define FMUX_CAPTURE_MAGIC_LEN 8
+#define FMUX_CAPTURE_OUT 0x80000000u
+#define FMUX_CAPTURE_LEN 0x7fffffffu //Mask for the payload length in nbytes
+
+//Buckets in latency histograms (see fmux_get_stats): bucket 0 counts waits
+//of under a microsecond, bucket i those of 2^(i-1) up to 2^i microseconds,
+//and the last one anything longer
+#define FMUX_LATENCY_BUCKETS 32
+
+//Maximum number of epoll events the pump handles per wakeup
+#define FMUX_PUMP_EVENTS 64
+
+//What a pump waits with (see fmux_pump_init_engine). Build with URING=1 to
+//make io_uring the default.
+#define FMUX_ENGINE_EPOLL 1
+#define FMUX_ENGINE_URING 2
+#ifndef FMUX_DEFAULT_ENGINE
+#define FMUX_DEFAULT_ENGINE FMUX_ENGINE_EPOLL
+#endif
+
 struct _fmux_channel;
 typedef struct _fmux_channel fmux_channel;
 
@@ -32,11 +116,28 @@ typedef struct _fmux_handle fmux_handle;
 struct _fmux_handle_link;
 typedef struct _fmux_handle_link fmux_handle_link;
 
+struct _fmux_pump_pool;
+typedef struct _fmux_pump_pool fmux_pump_pool;
+
+struct _fmux_uring;
+
 typedef struct _fmux_pump {
     int run;
     int length;
     pthread_mutex_t lock;
     fmux_handle_link* head;
+    int epfd;   //epoll set holding every handle's fd
+    int wakefd; //eventfd used to kick the pump out of epoll_wait
+    unsigned int generation; //Bumped whenever a handle is removed
+    unsigned int batches; //Batches of epoll events handled so far
+    fmux_pump_pool* pool; //Set for pumps owned by an fmux_pump_pool
+    int idle; //Blocked in epoll_wait; siblings wake us to steal work
+    fmux_handle** runq; //Ready handles waiting to be serviced
+    int runq_head;
+    int runq_len;
+    int runq_cap;
+    int engine; //FMUX_ENGINE_*
+    struct _fmux_uring* uring; //io_uring state for FMUX_ENGINE_URING
 } fmux_pump;
 
 typedef struct {
@@ -45,16 +146,124 @@ typedef struct {
     char data[1];
 } fmux_message;
 
+//Record header in a capture file, followed by nbytes & FMUX_CAPTURE_LEN bytes of payload
+typedef struct {
+    uint64_t ns; //CLOCK_MONOTONIC, when it was sent or received
+    uint32_t channel_id;
+    uint32_t nbytes; //FMUX_CAPTURE_OUT set for frames we sent
+} fmux_capture_record;
+
+//Counters since the handle was opened, followed by a snapshot of its queues
+typedef struct {
+    uint64_t frames_in; //Including control frames and dropped ones
+    uint64_t bytes_in; //Payload bytes
+    uint64_t frames_out;
+    uint64_t bytes_out;
+    uint64_t frames_dropped; //For channels that weren't open
+    uint64_t bytes_dropped;
+    uint64_t reads; //read()s on the fd, or receives an io_uring pump completed
+    uint64_t writes; //write()s and writev()s on the fd
+    uint64_t deliveries; //writev()s of demuxed data into socket channels
+    uint64_t latency[FMUX_LATENCY_BUCKETS]; //Every channel's, added up
+    uint64_t channels; //Open
+    uint64_t backlogged; //Channels holding back data they had no room for
+    uint64_t tx_queued; //Channels waiting for their turn on the link
+    uint64_t rx_queued; //Bytes an io_uring pump received that aren't demuxed yet
+} fmux_stats;
+
+typedef struct {
+    uint64_t frames_in;
+    uint64_t bytes_in;
+    uint64_t frames_out;
+    uint64_t bytes_out;
+    uint64_t reads; //fmux_read calls that returned data
+    uint64_t bytes_read;
+    //How long frames waited between the demuxer finishing them and
+    //fmux_read returning their last byte (see fmux_set_latency_tracking)
+    uint64_t latency[FMUX_LATENCY_BUCKETS];
+    uint64_t rx_queued; //Bytes received that haven't been read yet
+    uint64_t rx_backlog; //...of which held back in the library
+    uint64_t tx_queued; //Bytes written to the channel fd, not sent yet
+    int64_t tx_credit; //What the peer will still take, with flow control on
+} fmux_channel_stats;
+
 /* Housekeeping */
 
+//max_channels is the most channels that may be open at once; channel ids
+//can be anything a uint32_t holds, as on the wire
 fmux_handle*
 fmux_open(int fd, int max_channels);
 
+//Like fmux_open, but offers the peer compact v2 frame headers (a varint
+//channel id and length: 2 bytes for a small frame on a low channel, against
+//8) on FMUX_PROTO_CHANNEL. Each direction switches once both sides have
+//offered, at a marker frame, so a peer that offers later still gets v2.
+//Waits up to timeout_ms for the peer's offer, so frames can be v2 from the
+//start; 0 doesn't wait at all. A peer on plain fmux_open never offers and
+//never sees ours, and the link stays v1.
+fmux_handle*
+fmux_open_v2(int fd, int max_channels, int timeout_ms);
+
+//FMUX_PROTO_V2 once this side's headers are v2, else FMUX_PROTO_V1
+int
+fmux_get_protocol(fmux_handle* handle);
+
+//Bonds fd (a connection to the same peer) to handle as another link, so one
+//handle can fill several connections. Each channel's frames go out over one
+//link, picked by channel id modulo the number of links when it is opened (see
+//fmux_channel_set_link); frames from any link go to the handle's channels.
+//The peer bonds its ends of the connections the same way, in any order. Add
+//links before the handle goes on a pump; they go on (and come off) the pump
+//with it, and are closed with it. Not with flow control, shared memory,
+//non-blocking, splice or cork mode, or fmux_open_v2. Returns the link's
+//index (the handle's own fd is 0), or -1.
+int
+fmux_add_link(fmux_handle* handle, int fd);
+
+//The handle for a link, for fmux_pop and fmux_get_stats on it (don't close
+//it), or NULL. fmux_pop on the handle itself only reads link 0.
+fmux_handle*
+fmux_get_link(fmux_handle* handle, int link);
+
+//Sends the channel's frames over another link from now on. Only while the
+//handle is off its pump, and best before anything was sent, since frames
+//still on their way over the old link may arrive after newer ones.
+int
+fmux_channel_set_link(fmux_channel* channel, int link);
+
 void
 fmux_close(fmux_handle* handle);
 
 fmux_channel*
-fmux_open_channel(fmux_handle* handle, int channel_id);
+fmux_open_channel(fmux_handle* handle, uint32_t channel_id);
+
+//An in-process channel: inbound data goes into a lock-free ring in memory
+//instead of a socketpair, so fmux_read is a single memcpy and uses no fds
+//(besides an optional eventfd). One reader at a time; no write fd.
+fmux_channel*
+fmux_open_ring_channel(fmux_handle* handle, uint32_t channel_id, size_t capacity, int flags);
+
+//A message channel (FMUX_CHANTYPE_BIN): every message sent goes out as one
+//frame, and every frame received comes out as one message, so applications
+//don't need framing of their own. Its fd is a SOCK_SEQPACKET socket, where
+//each read() or write() is one whole message. Messages are 1 to FMUX_MSG_MAX
+//bytes; anything else that arrives is dropped. With flow control on, read it
+//through fmux_recv_msg, since that's what credit is given back for; messages
+//its socket has no room for wait in the library meanwhile. Returns NULL
+//(EEXIST) if channel_id is open already as another kind of channel.
+fmux_channel*
+fmux_open_msg_channel(fmux_handle* handle, uint32_t channel_id);
+
+//Sends buf as a single message, waiting for credit for all of it. Returns
+//nbyte, or -1 (EMSGSIZE if it's too big, or bigger than the window).
+int
+fmux_send_msg(fmux_channel* channel, const void* buf, size_t nbyte);
+
+//Receives the next message, like recv(MSG_TRUNC): returns its full length,
+//which may be more than nbyte if the end was cut off, or 0 once the channel
+//is closed
+int
+fmux_recv_msg(fmux_channel* channel, void* buf, size_t nbyte);
 
 int
 fmux_channel_read_fd(fmux_channel* channel);
@@ -62,25 +271,158 @@ fmux_channel_read_fd(fmux_channel* channel);
 int
 fmux_channel_write_fd(fmux_channel* channel);
 
+//How a channel shares the link with the others. Data from channels at a
+//higher priority (up to FMUX_PRIORITY_LEVELS - 1) always goes out first;
+//channels at the same priority take turns, each sending weight *
+//FMUX_QUANTUM bytes per turn (weight from 1 to FMUX_MAX_WEIGHT). Channels
+//start out at FMUX_PRIORITY_DEFAULT with a weight of 1. Returns 0 or -1.
+int
+fmux_channel_set_priority(fmux_channel* channel, int priority, uint32_t weight);
+
 /* Reading */
 
+//Blocks until a whole frame has arrived and returns it in *message, which
+//is realloc'd to fit. Returns 1 on success, 0 at EOF and -1 on error.
 int
 fmux_pop(fmux_handle* handle, fmux_message** message);
 
+//Like fmux_pop, but *message comes from (and, if it is too small, goes back
+//to) the handle's message pool. *message must be NULL or a pooled message;
+//hand it back with fmux_message_release instead of free.
+int
+fmux_pop_pooled(fmux_handle* handle, fmux_message** message);
+
+//Pooled messages. Released messages are reused by later allocations on the
+//same handle; they may be released after the handle is closed.
+fmux_message*
+fmux_message_alloc(fmux_handle* handle, uint32_t nbytes);
+
+void
+fmux_message_release(fmux_message* message);
+
+//Waits (up to timeout, or forever if it's NULL) for channels with data to
+//read and puts them in ready, in channel order; ready needs room for every
+//open channel. Returns how many there are, or -1. Channels are registered
+//once, so this costs as much as the number of ready channels.
 int
-fmux_select(fmux_handle* handle, fmux_channel** ready, struct timeval *restrict timeout);
+fmux_select(fmux_handle* handle, fmux_channel** ready, struct timeval* timeout);
 
 int
 fmux_read(fmux_channel* channel, void* buf, size_t nbyte);
 
 /* Writing */
 
+//Sends message as a single frame. Pushers don't wait on each other's
+//syscalls: whoever gets to the link first writes out every frame waiting.
 int
 fmux_push(fmux_handle* handle, fmux_message* message);
 
 int
 fmux_write(fmux_channel* channel, const void* buf, size_t nbyte);
 
+//Sends the buffers straight from the caller's memory, as a single frame or,
+//past the handle's maximum frame size, as several
+int
+fmux_writev(fmux_channel* channel, const struct iovec* iov, int iovcnt);
+
+//Largest payload put in a single outbound frame, between FMUX_MIN_FRAME and
+//FMUX_MAX_FRAME. Frames of any size are accepted on the receiving end.
+int
+fmux_set_max_frame(fmux_handle* handle, uint32_t nbytes);
+
+uint32_t
+fmux_get_max_frame(fmux_handle* handle);
+
+//Cork mode, for lots of small writes: frames of up to the maximum frame size,
+//from every channel, are packed into one buffer instead of each getting a
+//syscall of its own. The buffer goes out once it holds limit bytes, once its
+//oldest frame has waited delay_us microseconds (0 for no deadline), or on
+//fmux_flush. The deadline is kept by the pump; without one it is only checked
+//on the next write, so call fmux_flush when done writing. Control frames
+//never wait. A limit of 0 turns it off (the default). Returns 0 or -1.
+int
+fmux_set_cork(fmux_handle* handle, size_t limit, uint32_t delay_us);
+
+//Sends whatever cork mode is holding back, and in non-blocking mode as much
+//of the queue as the fd takes. Returns 0, or -1 (EAGAIN if some is still
+//queued).
+int
+fmux_flush(fmux_handle* handle);
+
+//Non-blocking mode: writers never wait on a slow peer. Whatever the fd (a
+//socket) won't take right away is queued in the handle and sent as the fd
+//becomes writable, by the pump, which watches for that, or else by the next
+//write or fmux_flush. Once high_water bytes are queued, fmux_write(v) and
+//fmux_push fail with EAGAIN and the pump leaves data in the channel fds; so
+//do writes that would wait for flow control credit. A high_water of 0 turns
+//it off, once the queue has been sent. Returns 0, or -1 if the fd isn't a
+//socket.
+int
+fmux_set_nonblocking(fmux_handle* handle, size_t high_water);
+
+//Zero-copy forwarding (Linux): frames of at least FMUX_SPLICE_MIN bytes move
+//between socket channels and the fd with splice(2), through a pipe, so only
+//their headers pass through user space. Meant for applications that use the
+//channel fds to move bulk data. Frames for ring channels, or received by an
+//io_uring pump or with flow control on, are still copied. While it's on, reads
+//from the fd stop at FMUX_SPLICE_MIN bytes, so that large payloads are seen
+//coming before they're read. Returns 0, or -1 if the fd isn't a socket, pipe
+//or file.
+int
+fmux_set_splice(fmux_handle* handle, int on);
+
+//Shared memory transport, for peers on the same host: each end hands the
+//other a memfd-backed ring of capacity bytes (0 for FMUX_SHM_DEFAULT) over the
+//fd, which has to be an AF_UNIX socket, and frames go through the rings
+//instead. The fd is left carrying one-byte doorbells for an idle reader, so
+//pumps and polling work as before. Both ends have to call it, before anything
+//is sent and before adding the handle to a pump; it blocks until the peer
+//has. Turns off fmux_set_splice. Returns 0, or -1 (EPROTO if the peer didn't
+//answer in kind, in which case the link is unusable).
+int
+fmux_set_shm(fmux_handle* handle, size_t capacity);
+
+//Credit-based flow control. Each channel may have at most window bytes in
+//flight that the receiving application hasn't read yet; the receiver hands
+//credit back over FMUX_CONTROL_CHANNEL as it is read, and writers wait for it
+//instead of stalling the whole link behind one slow reader. Both ends have to
+//turn it on, with the same window, before any data is sent. fmux_push and
+//fmux_pop work on raw frames and bypass it. Returns 0 or -1.
+int
+fmux_set_flow_control(fmux_handle* handle, uint32_t window);
+
+//The window, or 0 if flow control is off
+uint32_t
+fmux_get_flow_control(fmux_handle* handle);
+
+/* Statistics. Counters are relaxed atomics bumped along the way, so reading
+ * them never waits on the link; the queue sizes are read as the call is made.
+ */
+
+//Returns 0, or -1 if handle is NULL
+int
+fmux_get_stats(fmux_handle* handle, fmux_stats* stats);
+
+//Returns 0, or -1 if the channel has been closed
+int
+fmux_channel_get_stats(fmux_channel* channel, fmux_channel_stats* stats);
+
+//Time-stamps frames as they are demuxed, for the latency histograms. Only
+//data read through fmux_read is timed; frames are skipped while too many are
+//waiting to be read. Off by default. Returns 0 or -1.
+int
+fmux_set_latency_tracking(fmux_handle* handle, int on);
+
+//Appends every frame the handle sends or receives from now on to fd (see
+//FMUX_CAPTURE_MAGIC), which should be opened with O_APPEND; the magic goes
+//first unless it's a regular file with something in it already. Records
+//are buffered until there are 64KiB of them, or capture is turned off (fd
+//-1) or the handle closed; the fd is never closed. A link (fmux_get_link) is
+//captured separately. Splicing is skipped while it's on, and frames over
+//FMUX_CAPTURE_LEN bytes are left out. Returns 0 or -1.
+int
+fmux_set_capture(fmux_handle* handle, int fd);
+
 /* A background process (optional) for continuously flushing the socket.
  * This DOES NOT spawn its own thread; YOU should do that part.
  */
@@ -88,6 +430,16 @@ fmux_write(fmux_channel* channel, const void* buf, size_t nbyte);
  void
  fmux_pump_init(fmux_pump* pump);
 
+//Like fmux_pump_init, but with a particular engine. fmux_pump_init uses the
+//FMUX_ENGINE environment variable ("epoll" or "uring") if it's set, and
+//FMUX_DEFAULT_ENGINE otherwise. With io_uring, the pump keeps a multishot
+//receive armed on every (socket) handle, into a ring of provided buffers that
+//are demuxed in place, so inbound data costs no read()s of its own; outbound
+//data is still written with write()/writev(). Falls back to epoll if io_uring
+//isn't available. Returns the engine the pump ended up with.
+int
+fmux_pump_init_engine(fmux_pump* pump, int engine);
+
 //Only returns when the pump is stopped.
 //Highly recommend NOT using malloc to allocate the pump, lest you create a
 //race condition between calling fmux_pump_stop and the thread you called
@@ -106,6 +458,27 @@ fmux_pump_remove_handle(fmux_pump* pump, fmux_handle* handle);
 int
 fmux_pump_stop(fmux_pump* pump_id);
 
+/* A pool of pumps that DOES spawn its own threads: one pump per thread, with
+ * handles sharded across them. A worker with nothing ready steals handles
+ * that are waiting on a busy sibling.
+ * cpus is either NULL or an array of nthreads CPU ids to pin the workers to.
+ * Returns NULL if memory or a worker thread can't be had; any workers that
+ * did start are stopped again first.
+ */
+
+fmux_pump_pool*
+fmux_pump_pool_create(int nthreads, const int* cpus);
+
+int
+fmux_pump_pool_add_handle(fmux_pump_pool* pool, fmux_handle* handle);
+
+int
+fmux_pump_pool_remove_handle(fmux_pump_pool* pool, fmux_handle* handle);
+
+//Stops and joins every worker, then frees the pool
+void
+fmux_pump_pool_destroy(fmux_pump_pool* pool);
+
 #ifdef __cplusplus
 }
 #endif //__cplusplus
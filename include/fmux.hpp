@@ -0,0 +1,673 @@
+#ifndef _FMUX_HPP_
+#define _FMUX_HPP_
+
+//C++20 front-end for libfmux: move-only handles and channels that clean up
+//after themselves, spans instead of pointer/length pairs, and coroutines that
+//read and write channels without a blocked thread per channel. Header-only;
+//link against libfmux as usual.
+//
+//    fmux::PumpPool pumps(1);
+//    fmux::Handle handle(fd);
+//    pumps.add(handle);
+//    fmux::Channel channel = handle.channel(1);
+//
+//    fmux::Task echo(fmux::Channel& channel) {
+//        std::byte buf[4096];
+//        while (size_t n = co_await channel.read(buf))
+//            co_await channel.write(std::span(buf, n));
+//    }
+//
+//    fmux::Loop loop;
+//    loop.spawn(echo(channel));
+//    loop.run();
+//
+//Coroutines wait on the channel fds, which only the pump fills and drains, so
+//handles they use have to be on a pump (or PumpPool).
+
+#include "fmux.h"
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#include <coroutine>
+#include <cstddef>
+#include <algorithm>
+#include <deque>
+#include <exception>
+#include <span>
+#include <stdexcept>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace fmux {
+
+[[noreturn]] inline void
+throw_errno(const char* what)
+{
+    throw std::system_error(errno, std::generic_category(), what);
+}
+
+class Channel;
+class Handle;
+class Loop;
+class PumpPool;
+
+/* Messages */
+
+//A message from the handle's pool (see fmux_message_alloc), given back to it
+//when this goes away. Empty after being moved from, or after fmux_pop hit EOF.
+class Message {
+public:
+    Message() = default;
+    explicit Message(fmux_message* message) : message_(message) {}
+    Message(Message&& other) noexcept : message_(std::exchange(other.message_, nullptr)) {}
+    Message& operator=(Message&& other) noexcept { std::swap(message_, other.message_); return *this; }
+    Message(const Message&) = delete;
+    Message& operator=(const Message&) = delete;
+    ~Message() { if (message_ != nullptr) fmux_message_release(message_); }
+
+    explicit operator bool() const { return message_ != nullptr; }
+    uint32_t channel_id() const { return message_->channel_id; }
+    void set_channel_id(uint32_t channel_id) { message_->channel_id = channel_id; }
+    std::span<std::byte> data() { return {reinterpret_cast<std::byte*>(message_->data), message_->nbytes}; }
+    std::span<const std::byte> data() const { return {reinterpret_cast<const std::byte*>(message_->data), message_->nbytes}; }
+    fmux_message* get() const { return message_; }
+
+private:
+    friend class Handle;
+    fmux_message* message_ = nullptr;
+};
+
+/* Coroutines. A Loop runs Tasks on the thread that calls Loop::run, parking
+ * them in epoll while the channel they're reading or writing isn't ready. */
+
+namespace detail {
+
+//Something suspended until an fd is ready
+struct Waiter {
+    std::coroutine_handle<> coroutine;
+    //Called once the fd is ready; false to keep waiting
+    virtual bool ready() { return true; }
+    virtual ~Waiter() = default;
+};
+
+} //namespace detail
+
+//A coroutine for Loop::spawn. It starts once the loop gets to it and frees
+//itself when it's done; an exception it lets out comes out of Loop::run.
+class Task {
+public:
+    struct promise_type {
+        Loop* loop = nullptr;
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception();
+    };
+
+    Task(Task&& other) noexcept : coroutine_(std::exchange(other.coroutine_, {})) {}
+    Task& operator=(Task&&) = delete;
+    ~Task() { if (coroutine_) coroutine_.destroy(); } //Never spawned
+
+private:
+    friend class Loop;
+    explicit Task(std::coroutine_handle<promise_type> coroutine) : coroutine_(coroutine) {}
+    std::coroutine_handle<promise_type> coroutine_;
+};
+
+class Loop {
+public:
+    Loop() : epfd_(epoll_create1(EPOLL_CLOEXEC)) { if (epfd_ < 0) throw_errno("epoll_create1"); }
+    Loop(const Loop&) = delete;
+    Loop& operator=(const Loop&) = delete;
+    ~Loop();
+
+    void spawn(Task task);
+
+    //Runs tasks until none are left (or stop is called, or one throws)
+    void run();
+
+    //Makes run return once the task calling it suspends
+    void stop() { stopping_ = true; }
+
+    //The loop running on this thread; throws outside of run
+    static Loop& current();
+
+    //Resumes waiter's coroutine once fd has events (EPOLLIN or EPOLLOUT) and
+    //waiter->ready() agrees. One waiter per fd and direction.
+    void wait(int fd, uint32_t events, detail::Waiter* waiter);
+
+private:
+    friend struct Task::promise_type;
+
+    struct Watch {
+        detail::Waiter* in = nullptr;
+        detail::Waiter* out = nullptr;
+    };
+
+    static Loop*& running() { static thread_local Loop* loop = nullptr; return loop; }
+    void arm(int fd, const Watch& watch);
+
+    int epfd_;
+    std::deque<std::coroutine_handle<>> ready_;
+    std::unordered_map<int, Watch> watches_;
+    std::size_t waiting_ = 0;
+    bool stopping_ = false;
+    std::exception_ptr error_;
+};
+
+inline void
+Task::promise_type::unhandled_exception()
+{
+    if (loop != nullptr && !loop->error_) loop->error_ = std::current_exception();
+}
+
+inline
+Loop::~Loop()
+{
+    //Tasks still parked here never finish; free them
+    std::vector<std::coroutine_handle<>> left(ready_.begin(), ready_.end());
+    for (auto& [fd, watch] : watches_) {
+        if (watch.in != nullptr) left.push_back(watch.in->coroutine);
+        if (watch.out != nullptr) left.push_back(watch.out->coroutine);
+    }
+    for (auto coroutine : left) coroutine.destroy();
+    close(epfd_);
+}
+
+inline void
+Loop::spawn(Task task)
+{
+    auto coroutine = std::exchange(task.coroutine_, {});
+    coroutine.promise().loop = this;
+    ready_.push_back(coroutine);
+}
+
+inline Loop&
+Loop::current()
+{
+    if (running() == nullptr) throw std::logic_error("fmux: co_await outside of Loop::run");
+    return *running();
+}
+
+inline void
+Loop::arm(int fd, const Watch& watch)
+{
+    //One-shot, so an fd nobody is waiting on stays quiet
+    epoll_event ev = {};
+    ev.events = EPOLLONESHOT;
+    if (watch.in != nullptr) ev.events |= EPOLLIN;
+    if (watch.out != nullptr) ev.events |= EPOLLOUT;
+    ev.data.fd = fd;
+    if (ev.events == EPOLLONESHOT) return;
+    if (epoll_ctl(epfd_, EPOLL_CTL_MOD, fd, &ev) < 0 &&
+        (errno != ENOENT || epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) < 0))
+        throw_errno("epoll_ctl");
+}
+
+inline void
+Loop::wait(int fd, uint32_t events, detail::Waiter* waiter)
+{
+    Watch& watch = watches_[fd];
+    detail::Waiter*& slot = (events & EPOLLOUT) ? watch.out : watch.in;
+    if (slot != nullptr) throw std::logic_error("fmux: two coroutines waiting on the same channel");
+    slot = waiter;
+    waiting_++;
+    arm(fd, watch);
+}
+
+inline void
+Loop::run()
+{
+    struct Running {
+        Loop* outer;
+        explicit Running(Loop* loop) : outer(std::exchange(running(), loop)) {}
+        ~Running() { running() = outer; }
+    } scope(this);
+
+    stopping_ = false;
+    epoll_event events[FMUX_PUMP_EVENTS];
+    while (!stopping_ && !error_) {
+        while (!ready_.empty() && !stopping_ && !error_) {
+            auto coroutine = ready_.front();
+            ready_.pop_front();
+            coroutine.resume();
+        }
+        if (stopping_ || error_ || waiting_ == 0) break;
+
+        int nready = epoll_wait(epfd_, events, FMUX_PUMP_EVENTS, -1);
+        if (nready < 0) {
+            if (errno == EINTR) continue;
+            throw_errno("epoll_wait");
+        }
+        for (int i = 0; i < nready; i++) {
+            auto found = watches_.find(events[i].data.fd);
+            if (found == watches_.end()) continue;
+            Watch& watch = found->second;
+            uint32_t ev = events[i].events;
+            if (watch.in != nullptr && (ev & (EPOLLIN | EPOLLHUP | EPOLLERR)) && watch.in->ready()) {
+                ready_.push_back(watch.in->coroutine);
+                watch.in = nullptr;
+                waiting_--;
+            }
+            if (watch.out != nullptr && (ev & (EPOLLOUT | EPOLLHUP | EPOLLERR)) && watch.out->ready()) {
+                ready_.push_back(watch.out->coroutine);
+                watch.out = nullptr;
+                waiting_--;
+            }
+            if (watch.in == nullptr && watch.out == nullptr) watches_.erase(found);
+            else arm(events[i].data.fd, watch);
+        }
+    }
+    if (error_) std::rethrow_exception(std::exchange(error_, nullptr));
+}
+
+//co_await channel.read(buf): bytes read, or 0 at EOF
+class ReadAwaitable : private detail::Waiter {
+public:
+    ReadAwaitable(fmux_channel* channel, std::span<std::byte> buf) : channel_(channel), buf_(buf) {}
+
+    bool await_ready()
+    {
+        //Ring channels opened without FMUX_RING_EVENTFD just block
+        fd_ = fmux_channel_read_fd(channel_);
+        if (fd_ < 0) return true;
+        pollfd pfd = {fd_, POLLIN, 0};
+        return poll(&pfd, 1, 0) == 1;
+    }
+
+    void await_suspend(std::coroutine_handle<> coroutine)
+    {
+        this->coroutine = coroutine;
+        Loop::current().wait(fd_, EPOLLIN, this);
+    }
+
+    std::size_t await_resume()
+    {
+        int n = fmux_read(channel_, buf_.data(), buf_.size());
+        if (n < 0) throw_errno("fmux_read");
+        return n;
+    }
+
+private:
+    fmux_channel* channel_;
+    std::span<std::byte> buf_;
+    int fd_ = -1;
+};
+
+//co_await channel.write(data): writes all of data into the channel fd, for
+//the pump to send, and returns its size. Ring channels have no fd; they
+//fmux_write instead, which may block.
+class WriteAwaitable : private detail::Waiter {
+public:
+    WriteAwaitable(fmux_channel* channel, std::span<const std::byte> data) : channel_(channel), data_(data) {}
+
+    bool await_ready()
+    {
+        fd_ = fmux_channel_write_fd(channel_);
+        return fd_ < 0 || ready();
+    }
+
+    void await_suspend(std::coroutine_handle<> coroutine)
+    {
+        this->coroutine = coroutine;
+        Loop::current().wait(fd_, EPOLLOUT, this);
+    }
+
+    std::size_t await_resume()
+    {
+        if (fd_ < 0) {
+            int n = fmux_write(channel_, data_.data(), data_.size());
+            if (n < 0) throw_errno("fmux_write");
+            return n;
+        }
+        if (error_ != 0) {
+            errno = error_;
+            throw_errno("send");
+        }
+        return written_;
+    }
+
+private:
+    bool ready() override
+    {
+        //As much as the fd takes; done once it's all in or it failed
+        while (written_ < data_.size()) {
+            ssize_t n = send(fd_, data_.data() + written_, data_.size() - written_, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n > 0) {
+                written_ += n;
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return false;
+            } else {
+                error_ = (n < 0) ? errno : EPIPE;
+                return true;
+            }
+        }
+        return true;
+    }
+
+    fmux_channel* channel_;
+    std::span<const std::byte> data_;
+    std::size_t written_ = 0;
+    int error_ = 0;
+    int fd_ = -1;
+};
+
+/* Handles and channels */
+
+//A channel belongs to its handle, which closes it; this just makes sure there
+//is one owner reading it at a time.
+class Channel {
+public:
+    Channel() = default;
+    Channel(Channel&& other) noexcept : channel_(std::exchange(other.channel_, nullptr)), id_(other.id_) {}
+    Channel& operator=(Channel&& other) noexcept
+    {
+        channel_ = std::exchange(other.channel_, nullptr);
+        id_ = other.id_;
+        return *this;
+    }
+    Channel(const Channel&) = delete;
+    Channel& operator=(const Channel&) = delete;
+
+    explicit operator bool() const { return channel_ != nullptr; }
+    uint32_t id() const { return id_; }
+    fmux_channel* get() const { return channel_; }
+
+    //Coroutine reads and writes; see ReadAwaitable and WriteAwaitable
+    ReadAwaitable read(std::span<std::byte> buf) { return ReadAwaitable(channel_, buf); }
+    WriteAwaitable write(std::span<const std::byte> data) { return WriteAwaitable(channel_, data); }
+
+    //Plain blocking calls, straight from and into the caller's buffers
+    std::size_t
+    read_blocking(std::span<std::byte> buf)
+    {
+        int n = fmux_read(channel_, buf.data(), buf.size());
+        if (n < 0) throw_errno("fmux_read");
+        return n;
+    }
+
+    std::size_t
+    write_blocking(std::span<const std::byte> data)
+    {
+        int n = fmux_write(channel_, data.data(), data.size());
+        if (n < 0) throw_errno("fmux_write");
+        return n;
+    }
+
+    //Message channels only: one whole message each
+    std::size_t
+    recv_msg(std::span<std::byte> buf)
+    {
+        int n = fmux_recv_msg(channel_, buf.data(), buf.size());
+        if (n < 0) throw_errno("fmux_recv_msg");
+        return n;
+    }
+
+    void
+    send_msg(std::span<const std::byte> data)
+    {
+        if (fmux_send_msg(channel_, data.data(), data.size()) < 0) throw_errno("fmux_send_msg");
+    }
+
+    std::size_t
+    writev_blocking(std::span<const std::span<const std::byte>> bufs)
+    {
+        std::vector<iovec> iov(bufs.size());
+        for (std::size_t i = 0; i < bufs.size(); i++)
+            iov[i] = {const_cast<std::byte*>(bufs[i].data()), bufs[i].size()};
+        int n = fmux_writev(channel_, iov.data(), iov.size());
+        if (n < 0) throw_errno("fmux_writev");
+        return n;
+    }
+
+    void
+    set_priority(int priority, uint32_t weight = 1)
+    {
+        if (fmux_channel_set_priority(channel_, priority, weight) != 0)
+            throw std::invalid_argument("fmux_channel_set_priority");
+    }
+
+    void
+    set_link(int link)
+    {
+        if (fmux_channel_set_link(channel_, link) != 0) throw std::invalid_argument("fmux_channel_set_link");
+    }
+
+    fmux_channel_stats
+    stats() const
+    {
+        fmux_channel_stats stats;
+        if (fmux_channel_get_stats(channel_, &stats) != 0) throw std::logic_error("fmux: channel is closed");
+        return stats;
+    }
+
+private:
+    friend class Handle;
+    Channel(fmux_channel* channel, uint32_t id) : channel_(channel), id_(id) {}
+
+    fmux_channel* channel_ = nullptr;
+    uint32_t id_ = 0;
+};
+
+//Owns an fmux_handle (and so the fd it was opened on): takes it off its pump
+//pool and closes it when it goes away
+class Handle {
+public:
+    explicit Handle(int fd, int max_channels = FMUX_RECOMMENDED_CHANS) : handle_(fmux_open(fd, max_channels))
+    {
+        if (handle_ == nullptr) throw_errno("fmux_open");
+    }
+    Handle(Handle&& other) noexcept;
+    Handle& operator=(Handle&& other) noexcept;
+    Handle(const Handle&) = delete;
+    Handle& operator=(const Handle&) = delete;
+    ~Handle();
+
+    fmux_handle* get() const { return handle_; }
+
+    Channel
+    channel(uint32_t channel_id)
+    {
+        fmux_channel* channel = fmux_open_channel(handle_, channel_id);
+        if (channel == nullptr) throw std::runtime_error("fmux_open_channel: already open, or too many channels");
+        return Channel(channel, channel_id);
+    }
+
+    Channel
+    msg_channel(uint32_t channel_id)
+    {
+        fmux_channel* channel = fmux_open_msg_channel(handle_, channel_id);
+        if (channel == nullptr) throw std::runtime_error("fmux_open_msg_channel: already open, or too many channels");
+        return Channel(channel, channel_id);
+    }
+
+    //Pass FMUX_RING_EVENTFD (the default) for coroutines to wait on it
+    Channel
+    ring_channel(uint32_t channel_id, std::size_t capacity = FMUX_RING_DEFAULT, int flags = FMUX_RING_EVENTFD)
+    {
+        fmux_channel* channel = fmux_open_ring_channel(handle_, channel_id, capacity, flags);
+        if (channel == nullptr) throw std::runtime_error("fmux_open_ring_channel: already open, or too many channels");
+        return Channel(channel, channel_id);
+    }
+
+    //Whole frames, in messages from the handle's pool
+    Message
+    alloc(uint32_t nbytes, uint32_t channel_id = 0)
+    {
+        Message message(fmux_message_alloc(handle_, nbytes));
+        if (!message) throw_errno("fmux_message_alloc");
+        message.set_channel_id(channel_id);
+        return message;
+    }
+
+    void
+    push(const Message& message)
+    {
+        if (fmux_push(handle_, message.get()) < 0) throw_errno("fmux_push");
+    }
+
+    //Empty at EOF
+    Message
+    pop()
+    {
+        Message message;
+        int err = fmux_pop_pooled(handle_, &message.message_);
+        if (err < 0) throw_errno("fmux_pop_pooled");
+        if (err == 0) return Message();
+        return message;
+    }
+
+    void
+    set_max_frame(uint32_t nbytes)
+    {
+        if (fmux_set_max_frame(handle_, nbytes) != 0) throw std::invalid_argument("fmux_set_max_frame");
+    }
+
+    void
+    set_flow_control(uint32_t window)
+    {
+        if (fmux_set_flow_control(handle_, window) != 0) throw std::invalid_argument("fmux_set_flow_control");
+    }
+
+    void
+    set_cork(std::size_t limit, uint32_t delay_us)
+    {
+        if (fmux_set_cork(handle_, limit, delay_us) != 0) throw_errno("fmux_set_cork");
+    }
+
+    void
+    set_splice(bool on)
+    {
+        if (fmux_set_splice(handle_, on) != 0) throw_errno("fmux_set_splice");
+    }
+
+    void
+    set_nonblocking(std::size_t high_water)
+    {
+        if (fmux_set_nonblocking(handle_, high_water) != 0) throw_errno("fmux_set_nonblocking");
+    }
+
+    void
+    set_shm(std::size_t capacity = 0)
+    {
+        if (fmux_set_shm(handle_, capacity) != 0) throw_errno("fmux_set_shm");
+    }
+
+    //Pass -1 to stop; the fd stays the caller's
+    void
+    set_capture(int fd)
+    {
+        if (fmux_set_capture(handle_, fd) != 0) throw_errno("fmux_set_capture");
+    }
+
+    int protocol() const { return fmux_get_protocol(handle_); }
+
+    //The fd is the link's from here on; it's closed with the handle
+    int
+    add_link(int fd)
+    {
+        int link = fmux_add_link(handle_, fd);
+        if (link < 0) throw_errno("fmux_add_link");
+        return link;
+    }
+
+    void
+    flush()
+    {
+        if (fmux_flush(handle_) != 0) throw_errno("fmux_flush");
+    }
+
+    fmux_stats
+    stats() const
+    {
+        fmux_stats stats;
+        fmux_get_stats(handle_, &stats);
+        return stats;
+    }
+
+private:
+    friend class PumpPool;
+    fmux_handle* handle_;
+    PumpPool* pool_ = nullptr;
+};
+
+//Owns an fmux_pump_pool. Handles still on it when it goes away are taken off.
+class PumpPool {
+public:
+    explicit PumpPool(int nthreads = 1, const int* cpus = nullptr) : pool_(fmux_pump_pool_create(nthreads, cpus))
+    {
+        if (pool_ == nullptr) throw_errno("fmux_pump_pool_create");
+    }
+    PumpPool(const PumpPool&) = delete;
+    PumpPool& operator=(const PumpPool&) = delete;
+
+    ~PumpPool()
+    {
+        while (!handles_.empty()) remove(*handles_.back());
+        fmux_pump_pool_destroy(pool_);
+    }
+
+    fmux_pump_pool* get() const { return pool_; }
+
+    void
+    add(Handle& handle)
+    {
+        if (handle.pool_ != nullptr) throw std::logic_error("fmux: handle is already on a pump");
+        if (fmux_pump_pool_add_handle(pool_, handle.handle_) != 0) throw_errno("fmux_pump_pool_add_handle");
+        handle.pool_ = this;
+        handles_.push_back(&handle);
+    }
+
+    void
+    remove(Handle& handle)
+    {
+        if (handle.pool_ != this) return;
+        fmux_pump_pool_remove_handle(pool_, handle.handle_);
+        handle.pool_ = nullptr;
+        std::erase(handles_, &handle);
+    }
+
+private:
+    friend class Handle;
+    fmux_pump_pool* pool_;
+    std::vector<Handle*> handles_;
+};
+
+inline
+Handle::Handle(Handle&& other) noexcept
+    : handle_(std::exchange(other.handle_, nullptr)), pool_(std::exchange(other.pool_, nullptr))
+{
+    if (pool_ != nullptr) std::replace(pool_->handles_.begin(), pool_->handles_.end(), &other, this);
+}
+
+inline Handle&
+Handle::operator=(Handle&& other) noexcept
+{
+    if (this != &other) {
+        Handle old(std::move(*this));
+        handle_ = std::exchange(other.handle_, nullptr);
+        pool_ = std::exchange(other.pool_, nullptr);
+        if (pool_ != nullptr) std::replace(pool_->handles_.begin(), pool_->handles_.end(), &other, this);
+    }
+    return *this;
+}
+
+inline
+Handle::~Handle()
+{
+    if (pool_ != nullptr) pool_->remove(*this);
+    if (handle_ != nullptr) fmux_close(handle_);
+}
+
+} //namespace fmux
+
+#endif //_FMUX_HPP_
@@ -1,26 +1,183 @@
 
+#define _GNU_SOURCE
 #include "../include/fmux.h"
 
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <arpa/inet.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
 #include <poll.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
 
 //For debugging
 #include <stdio.h>
 #include <errno.h>
 
+//The io_uring engine only needs the kernel's uapi header (no liburing), and
+//one recent enough to have multishot receives into provided buffers
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+#define FMUX_HAVE_URING 1
+#endif
+#endif
+#endif
+
 #define MAX(a, b) \
     ({ __typeof__ (a) _a = (a); \
        __typeof__ (b) _b = (b); \
      _a > _b ? _a : _b; })
 
+struct _fmux_message_pool;
+typedef struct _fmux_message_pool fmux_message_pool;
+
+/* Single-producer/single-consumer byte ring backing an in-process channel.
+ * The demuxer is the producer and fmux_read the consumer; head and tail only
+ * ever grow and are masked into buf. */
+typedef struct {
+    char* buf;
+    size_t mask; //Capacity - 1; capacity is a power of two
+    size_t head; //Written by the producer only
+    size_t tail; //Written by the consumer only
+    int evfd; //Readable while the ring has data, or -1
+    int waiting; //fmux_read is blocked on cond
+    int closed; //Protected by lock
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} fmux_ring;
+
+/* One direction of the shared memory transport (see fmux_set_shm), at the
+ * start of a memfd both processes map. Like fmux_ring, head and tail only
+ * ever grow; the data follows the header. Everything in it is accessed
+ * atomically, and what the peer writes is checked before it is used. */
+struct fmux_shm_ring {
+    uint64_t head; //Written by the producer only
+    char pad0[56];
+    uint64_t tail; //Written by the consumer only
+    char pad1[56];
+    uint32_t rx_waiting; //The consumer ran dry and wants a doorbell
+    uint32_t tx_waiting; //The producer ran out of room
+    uint32_t space; //Futex the producer sleeps on; bumped for it by the consumer
+    uint32_t pad2;
+    uint64_t capacity; //A power of two
+    char pad3[40];
+    char data[];
+};
+
+//What each end sends the other, along with its memfd
+struct fmux_shm_hello {
+    char magic[8];
+    uint64_t capacity;
+};
+
+//How long a producer with a full ring sleeps before checking on the peer
+#define FMUX_SHM_NAP_MS 10
+
+//What an epoll event registered by a pump refers to
+#define FMUX_WATCH_LINK 1    //The handle's underlying fd
+#define FMUX_WATCH_CHANNEL 2 //A channel's sock[1] (outbound data)
+#define FMUX_WATCH_TIMER 3   //The handle's cork timer
+
+struct fmux_watch {
+    int kind;
+    fmux_handle* handle;
+    fmux_channel* channel;
+    //io_uring requests armed for it, by kind (bits of 1 << FMUX_URING_*);
+    //only touched by the pump thread. See fmux_uring_reconcile.
+    int uring_armed;
+    int uring_cancelling;
+    //On the ring's dirty list; under its lock
+    int uring_dirty;
+    struct fmux_watch* uring_next;
+};
+
+//Work a pump has found for a handle (handle->events)
+#define FMUX_EV_IN 1  //Inbound data on the underlying fd
+#define FMUX_EV_OUT 2 //Outbound channel data, or the fd became writable
+#define FMUX_EV_RESUME 4 //A full ring channel was read from, or a channel
+                         //socket being watched for credit became writable
+#define FMUX_EV_FLUSH 8 //Frames held back by cork mode are due
+//Set in handle->busy while fmux_pump_remove_handle sleeps on it
+#define FMUX_BUSY_WAITING (1 << 30)
+
+//Control frames (payload of frames on FMUX_CONTROL_CHANNEL, or for
+//FMUX_CTL_HELLO and FMUX_CTL_V2 on FMUX_PROTO_CHANNEL): a type byte, then for
+//FMUX_CTL_WINDOW up to FMUX_CTL_UPDATES (channel, increment) pairs, and for
+//FMUX_CTL_HELLO the highest protocol version the sender speaks. After
+//FMUX_CTL_V2, the sender's frame headers are all v2.
+#define FMUX_CTL_WINDOW 1
+#define FMUX_CTL_HELLO 2
+#define FMUX_CTL_V2 3
+#define FMUX_CTL_UPDATES 64
+#define FMUX_CTL_MAX (1 + 8 * FMUX_CTL_UPDATES)
+//Bytes of frames drained from channel fds that are written to the link at once
+#define FMUX_TX_BATCH (256 * 1024)
+
+//Frames a channel keeps the time of until fmux_read gets to them, when
+//latency tracking is on
+#define FMUX_LATENCY_MARKS 64
+
+struct fmux_lat_mark {
+    uint64_t end; //The channel's bytes_in once the frame was demuxed
+    uint64_t ns;
+};
+
+//Starting size of a handle's channel hash (a power of two)
+#define FMUX_CHAN_TABLE_MIN 16
+
+//How long a writer without a pump waits on the link before rechecking credit
+#define FMUX_CREDIT_WAIT_MS 10
+
+//Bytes of capture records held before they're written out (see fmux_set_capture)
+#define FMUX_CAPTURE_BUFFER (64 * 1024)
+
+//io_uring engine: submission queue depth, and the provided buffers multishot
+//receives land in, which the demuxer parses in place (see fmux_rx_lend)
+#define FMUX_URING_ENTRIES 256
+#define FMUX_URING_BUFFERS 64 //A power of two
+#define FMUX_URING_BUFSIZE 16384
+#define FMUX_URING_BGID 0
+//Room in front of each buffer for what's left of the one before it: a
+//partial header, or a control frame that hasn't all arrived
+#define FMUX_URING_HEADROOM 1024
+#define FMUX_URING_SLOT (FMUX_URING_HEADROOM + FMUX_URING_BUFSIZE)
+//Buffers a handle may keep from the pump at once; past that, or while the
+//demuxer is stalled, they are copied to rx_inq and given back right away
+#define FMUX_URING_HOLD 4
+//How far rx_inq may get ahead of the demuxer before receiving pauses
+#define FMUX_URING_INQ_MAX (4 * FMUX_RX_BUFFER)
+//What a request was armed for, tagged into the low bits of its user_data
+#define FMUX_URING_RECV 1
+#define FMUX_URING_POLLIN 2
+#define FMUX_URING_POLLOUT 3
+#define FMUX_URING_KINDS 7
+//Set in handle->uring_live while fmux_uring_settle sleeps on it
+#define FMUX_URING_SETTLING (1 << 30)
+
+typedef struct _fmux_uring fmux_uring;
+
 struct _fmux_channel {
-    int id;
+    uint32_t id;
     fmux_handle* handle;
+    fmux_handle* link; //Where its frames go out; see fmux_channel_set_link
+    int active_index; //In handle->active
     /* Confusing as it is, both pipes below are read and written
      * read from pipe[0] and write to pipe[1]
      * The names, however, come from the fact that the client
@@ -29,17 +186,221 @@ struct _fmux_channel {
      * writes to pipe_read[1] */
     //Read and write to sock[0] via fmux_read and fmux_write, but
     //read and write into sock[1] from the underlying fd (e.g. in
-    //fmux_push and fmux_pop)
+    //fmux_push and fmux_pop). sock[1] is non-blocking.
     int sock[2]; // { LOCAL, REMOTE }
     fmux_chantype type;
+    fmux_channel* next_closed;
+    int users; //Calls like fmux_read still running on it (atomic)
+    //Where it was closed, and the pump's batch of events then, which may
+    //still have referred to its watch; see fmux_channel_reap
+    fmux_pump* closed_pump;
+    unsigned int closed_batch;
+    struct fmux_watch watch;
+    //Pending outbound data; handle->out_head lists, protected by out_lock
+    int out_queued;
+    int out_level; //The priority it was queued at
+    fmux_channel* out_next;
+    //Scheduling; see fmux_channel_set_priority
+    int priority;
+    uint32_t weight;
+    int64_t deficit; //What's left of its turn; under lock
+    int tx_active; //A write is partway out; under lock
+    int fd_out; //The application has been handed sock[0]
+    fmux_ring* ring; //Inbound ring for ring channels (sock[] are -1 then)
+    //Flow control; see fmux_set_flow_control
+    int64_t tx_credit; //Bytes the peer will still take (atomic)
+    uint64_t rx_total; //Bytes put in the socket or ring so far (atomic)
+    uint64_t rx_acked; //Bytes given back to the peer as credit (atomic)
+    //Inbound data there was no room for yet, so that one full channel never
+    //blocks the link. Under rx_lock, like credit_watch.
+    char* backlog;
+    size_t backlog_len;
+    size_t backlog_cap;
+    int credit_watch; //Backlogged, or read via the fd and credit may be due
+    //Message channels (type FMUX_CHANTYPE_BIN): a frame that arrived in
+    //pieces, put back together under rx_lock, and the bytes of messages read
+    //through fmux_recv_msg (atomic), which is what credit is given back for
+    char* msg_buf;
+    size_t msg_len;
+    size_t msg_cap;
+    uint64_t msg_consumed;
+    //Ring channels with data, for fmux_select (handle->sel_head)
+    int sel_queued; //Atomic
+    uint64_t sel_mark; //The fmux_select call that last reported its socket
+    fmux_channel* sel_next;
+    //Counters (the gauges at the end go unused); see fmux_stat_add
+    fmux_channel_stats stats;
+    //Frames waiting to be read, for the latency histogram; see fmux_stat_mark
+    pthread_mutex_t lat_lock;
+    struct fmux_lat_mark* lat_marks;
+    int lat_head;
+    int lat_len;
+};
+
+//A provided buffer an io_uring pump received into, kept for the demuxer
+struct fmux_rx_held {
+    fmux_pump* pump; //Whose ring it goes back to
+    char* data;
+    size_t len;
+    int bid;
+};
+
+//Part of rx_buf on its way to a socket channel
+struct fmux_rx_out {
+    fmux_channel* channel;
+    struct iovec iov;
 };
 
 struct _fmux_handle {
     int fd;
-    int max_channels;
+    int max_channels; //Most channels open at once
+    //Links (see fmux_add_link). bond is the handle whose channels our frames
+    //go to: ourselves, unless we were added to another. links[0] is always
+    //ourselves; the rest are only changed under rx_lock, and nlinks is atomic.
+    fmux_handle* bond;
+    fmux_handle* links[FMUX_MAX_LINKS];
+    int nlinks;
     int sync_read;
-    pthread_mutex_t lock;
-    fmux_channel **channels;
+    pthread_mutex_t lock; //Serializes writes to fd
+    pthread_mutex_t rx_lock; //Serializes reads from fd
+    //Open channels: a hash of ids for lookups and a dense list to walk them;
+    //see fmux_channel_lookup
+    pthread_mutex_t chan_lock;
+    fmux_channel** chan_table;
+    uint32_t chan_mask;
+    fmux_channel** active;
+    int nactive;
+    int active_cap;
+    struct pollfd* tx_pollfds; //fmux_flush_writes' scratch space; under chan_lock
+    int tx_pollcap;
+    //Receive buffer and streaming frame decoder state; see fmux_rx_fill
+    char* rx_buf;
+    size_t rx_cap;
+    size_t rx_start;
+    size_t rx_end;
+    int rx_eof;
+    int rx_in_frame; //Header parsed, payload not (fully) consumed yet
+    uint32_t rx_channel;
+    uint32_t rx_remaining;
+    uint32_t rx_frame_len; //Payload length of the current frame
+    //Frame header versions (see fmux_open_v2)
+    int proto_offered; //We sent a hello on FMUX_PROTO_CHANNEL
+    int proto_upgrade; //The peer's hello came in; switch tx_v2 on (atomic)
+    int rx_v2; //The peer said its headers are v2 from here on
+    int tx_v2; //Ours are; under lock
+    int rx_stalled; //A ring channel filled up mid-frame
+    uint32_t max_frame; //Largest payload we put in a single frame
+    //Frames drained from sock[1]s, gathered up to be written all at once;
+    //at least max_frame bytes plus a header. Under lock.
+    char* tx_buf;
+    size_t tx_cap;
+    size_t tx_len;
+    //Cork mode (see fmux_set_cork): frames stay in tx_buf until there are
+    //cork_limit bytes of them or the oldest is cork_delay ns old. Under lock.
+    size_t cork_limit; //0 when it's off
+    uint64_t cork_delay; //0 for no deadline
+    uint64_t cork_since; //When tx_buf stopped being empty, or 0
+    int cork_timerfd; //Keeps the deadline for the pump (atomic)
+    struct fmux_watch cork_watch;
+    struct fmux_push_req* push_head; //Frames waiting in fmux_push, newest first (atomic)
+    //Pipes large payloads are spliced through (see fmux_set_splice), or -1
+    int rx_pipe[2]; //Under rx_lock
+    int tx_pipe[2]; //Under lock
+    size_t pipe_cap; //Most either pipe holds
+    //Shared memory transport (see fmux_set_shm): our ring (under lock) and
+    //the peer's (under rx_lock), or NULL. The capacities are our own copies.
+    struct fmux_shm_ring* shm_tx;
+    struct fmux_shm_ring* shm_rx;
+    uint64_t shm_tx_cap;
+    uint64_t shm_rx_cap;
+    int shm_eof; //The peer hung up; atomic
+    //Non-blocking mode (see fmux_set_nonblocking): what the fd wouldn't take
+    //yet, which goes out ahead of anything else. Under lock; high_water and
+    //txq_len are atomic.
+    size_t high_water; //0 when it's off
+    char* txq;
+    size_t txq_cap;
+    size_t txq_start;
+    size_t txq_len;
+    fmux_message_pool* pool; //See fmux_message_alloc
+    //Channels closed via fmux_close_channel. They are kept around (with
+    //handle == NULL) until nothing can be using them anymore, then freed by
+    //the next open or close, so stale pointers fail gracefully until then.
+    fmux_channel *closed;
+    fmux_pump* pump; //The pump servicing this handle, if any
+    int queued; //On pump->runq; protected by pump->lock
+    int events; //FMUX_EV_* found by the pump; protected by pump->lock
+    int busy; //Number of pump threads servicing this handle, plus
+              //FMUX_BUSY_WAITING (atomic, and a futex)
+    struct fmux_watch watch;
+    int out_blocked; //fd wasn't writable; waiting on EPOLLOUT
+    //Channels with data waiting in sock[1], in the order it showed up, for
+    //each priority level
+    pthread_mutex_t out_lock;
+    fmux_channel* out_head[FMUX_PRIORITY_LEVELS];
+    fmux_channel* out_tail[FMUX_PRIORITY_LEVELS];
+    //Writers waiting for lock at each priority (atomic); less urgent ones
+    //holding it wait on tx_cond for them to go first
+    int tx_waiting[FMUX_PRIORITY_LEVELS];
+    pthread_cond_t tx_cond;
+    int fd_out_channels; //Channels with fd_out set
+    //Flow control; see fmux_set_flow_control
+    uint32_t window; //0 when it's off
+    pthread_mutex_t credit_lock; //Writers waiting on credit sleep on credit_cond
+    pthread_cond_t credit_cond;
+    uint32_t acks[FMUX_CTL_UPDATES][2]; //Window updates to send; under rx_lock
+    int nacks;
+    int backlogged; //Channels with a backlog (atomic)
+    int credit_watches; //Channels with credit_watch set; under rx_lock
+    //What an io_uring pump has received from fd but the demuxer hasn't
+    //parsed yet; see fmux_rx_read. len, eof and paused are atomic.
+    pthread_mutex_t rx_inq_lock;
+    char* rx_inq;
+    size_t rx_inq_cap;
+    size_t rx_inq_start;
+    size_t rx_inq_len;
+    int rx_inq_eof;
+    int rx_inq_paused; //Too far ahead of the demuxer; not receiving
+    int rx_uring; //The pump receives fd into rx_inq (atomic)
+    //Buffers received into before anything now in rx_inq, oldest first, under
+    //rx_inq_lock (nheld and held_bytes are atomic). fmux_service_reads points
+    //rx_buf at them in turn (rx_lent), keeping its own in rx_own meanwhile.
+    struct fmux_rx_held rx_held[FMUX_URING_HOLD];
+    int rx_held_start;
+    int rx_nheld;
+    size_t rx_held_bytes;
+    struct fmux_rx_held rx_lent; //data is NULL unless lent; under rx_lock
+    char* rx_own;
+    size_t rx_own_cap;
+    //Payloads for socket channels that fmux_rx_deliver has parsed but not
+    //written yet, so each channel gets one writev per pass; under rx_lock
+    struct fmux_rx_out rx_out[FMUX_BATCH_IOV];
+    int rx_nout;
+    int uring_live; //io_uring requests and dirty watches for it, plus
+                    //FMUX_URING_SETTLING (atomic, and a futex)
+    //fmux_select's readiness set, created on first use: an epoll set over the
+    //socket channels' sock[0] (plus sel_evfd), and a list of ring channels
+    //that may have data, added to by the demuxer
+    int sel_epfd;
+    int sel_evfd; //Signalled when a ring is queued while somebody is selecting
+    int sel_waiting; //Atomic
+    pthread_mutex_t sel_lock;
+    fmux_channel* sel_head;
+    uint64_t sel_calls; //Numbers fmux_select calls, for sel_mark (atomic)
+    //Counters (the gauges at the end go unused); see fmux_stat_add
+    fmux_stats stats;
+    int track_latency; //Atomic; see fmux_set_latency_tracking
+    //Capture (see fmux_set_capture): the file, or -1 (atomic), and records
+    //not written to it yet (under cap_lock). A frame the demuxer consumes in
+    //pieces is put back together in cap_rx first, under rx_lock.
+    int cap_fd;
+    pthread_mutex_t cap_lock;
+    char* cap_buf;
+    size_t cap_len;
+    char* cap_rx;
+    size_t cap_rx_len;
+    size_t cap_rx_cap;
+    int cap_rx_skip; //Capture started partway through the current frame
 };
 
 struct _fmux_handle_link {
@@ -49,307 +410,5028 @@ struct _fmux_handle_link {
 
 
 int
-fmux_close_channel(fmux_handle* handle, int index);
+fmux_close_channel(fmux_handle* handle, uint32_t channel_id);
+
+fmux_channel*
+fmux_channel_lookup(fmux_handle* handle, uint32_t channel_id);
+
+void
+fmux_pump_watch_channel(fmux_pump* pump, fmux_channel* channel, int op);
+
+void
+fmux_queue_out(fmux_handle* handle, fmux_channel* channel, int at_front);
+
+void
+fmux_unqueue_out(fmux_handle* handle, fmux_channel* channel);
+
+int
+fmux_schedule_out_locked(fmux_handle* handle, int nonblocking);
+
+void
+fmux_kick_reads(fmux_handle* handle);
+
+void
+fmux_kick_writes(fmux_handle* handle, fmux_channel* channel);
+
+void
+fmux_pump_kick(fmux_handle* handle, int events);
+
+void
+fmux_tx_unlock(fmux_handle* handle);
+
+void
+fmux_pump_watch_credit(fmux_handle* handle, fmux_channel* channel);
+
+void
+fmux_pump_watch_cork(fmux_pump* pump, fmux_handle* handle);
+
+void
+fmux_uring_touch(fmux_pump* pump, struct fmux_watch* watch);
+
+int
+fmux_uring_quiet(fmux_pump* pump, struct fmux_watch* watch);
+
+void
+fmux_pump_wake(fmux_pump* pump);
+
+void
+fmux_channel_destroy(fmux_channel* channel);
+
+void
+fmux_uring_give_back(fmux_pump* pump, int bid);
+
+fmux_uring*
+fmux_uring_create(fmux_pump* pump);
+
+void
+fmux_uring_teardown(fmux_pump* pump);
+
+void
+fmux_uring_destroy(fmux_uring* ring);
+
+void
+fmux_pump_share(fmux_pump* pump, int nqueued);
+
+int
+fmux_send_frame_locked(fmux_handle* handle, uint32_t channel_id,
+                       const struct iovec* payload, int iovcnt);
+
+int
+fmux_tx_flush_locked(fmux_handle* handle);
+
+void
+fmux_rx_control(fmux_handle* handle, const char* data, uint32_t nbyte);
+
+void
+fmux_proto_check(fmux_handle* handle);
+
+uint64_t
+fmux_now_ns();
+
+size_t
+fmux_rx_avail(fmux_handle* handle);
+
+int
+fmux_rx_fill(fmux_handle* handle, size_t* asked);
+
+void
+fmux_splice_close(int pipefd[2]);
+
+int
+fmux_tx_release_locked(fmux_handle* handle);
+
+int
+fmux_txq_drain_locked(fmux_handle* handle, int wait);
+
+fmux_message_pool*
+fmux_pool_create();
+
+fmux_ring*
+fmux_ring_create(size_t capacity, int flags);
+
+void
+fmux_ring_destroy(fmux_ring* ring);
+
+void
+fmux_ring_notify(fmux_ring* ring);
+
+void
+fmux_pool_close(fmux_message_pool* pool);
+
+void
+fmux_select_watch(fmux_handle* handle, fmux_channel* channel);
+
+void
+fmux_select_mark(fmux_channel* channel);
+
+void
+fmux_stat_add(uint64_t* counter, uint64_t n);
+
+int
+fmux_writev_fully(int fd, struct iovec* iov, int iovcnt, uint64_t* calls);
+
+int
+fmux_iov_slice(const struct iovec* iov, int iovcnt, size_t off, size_t nbyte, struct iovec* out);
+
+void
+fmux_capture_flush_locked(fmux_handle* handle);
+
+/* PRIVATE */ fmux_handle*
+fmux_handle_create(int fd, int max_channels)
+{
+    fmux_handle* ret = malloc(sizeof(fmux_handle));
+    memset(ret, 0, sizeof(fmux_handle));
+
+    ret->fd = fd;
+    ret->max_channels = max_channels;
+    ret->bond = ret;
+    ret->links[0] = ret;
+    ret->nlinks = 1;
+    ret->sync_read = 1;
+    ret->chan_mask = FMUX_CHAN_TABLE_MIN - 1;
+    ret->chan_table = calloc(FMUX_CHAN_TABLE_MIN, sizeof(fmux_channel*));
+    pthread_mutex_init(&(ret->chan_lock), NULL);
+
+    pthread_mutex_init(&(ret->lock), NULL);
+    pthread_mutex_init(&(ret->rx_lock), NULL);
+    pthread_mutex_init(&(ret->out_lock), NULL);
+    pthread_cond_init(&(ret->tx_cond), NULL);
+    pthread_mutex_init(&(ret->credit_lock), NULL);
+    pthread_cond_init(&(ret->credit_cond), NULL);
+    pthread_mutex_init(&(ret->rx_inq_lock), NULL);
+    ret->rx_cap = FMUX_RX_BUFFER;
+    ret->rx_buf = malloc(ret->rx_cap);
+    ret->pool = fmux_pool_create();
+    ret->max_frame = FMUX_DEFAULT_FRAME;
+    ret->tx_cap = FMUX_TX_BATCH;
+    ret->tx_buf = malloc(ret->tx_cap);
+    ret->watch.kind = FMUX_WATCH_LINK;
+    ret->watch.handle = ret;
+    ret->watch.channel = NULL;
+    ret->cork_timerfd = -1;
+    ret->rx_pipe[0] = ret->rx_pipe[1] = ret->tx_pipe[0] = ret->tx_pipe[1] = -1;
+    ret->cork_watch.kind = FMUX_WATCH_TIMER;
+    ret->cork_watch.handle = ret;
+    ret->sel_epfd = ret->sel_evfd = -1;
+    pthread_mutex_init(&(ret->sel_lock), NULL);
+    ret->cap_fd = -1;
+    pthread_mutex_init(&(ret->cap_lock), NULL);
+    return ret;
+}
+
+fmux_handle*
+fmux_open(int fd, int max_channels)
+{
+    fmux_handle* ret = fmux_handle_create(fd, max_channels);
+    fmux_open_channel(ret, 0);
+    return ret;
+}
+
+fmux_handle*
+fmux_open_v2(int fd, int max_channels, int timeout_ms)
+{
+    fmux_handle* ret = fmux_open(fd, max_channels);
+    ret->proto_offered = 1;
+    char hello[2] = { FMUX_CTL_HELLO, FMUX_PROTO_V2 };
+    struct iovec iov = {.iov_base = hello, .iov_len = sizeof(hello)};
+    pthread_mutex_lock(&(ret->lock));
+    int err = fmux_send_frame_locked(ret, FMUX_PROTO_CHANNEL, &iov, 1);
+    if (err >= 0) err = fmux_tx_flush_locked(ret);
+    fmux_tx_unlock(ret);
+    if (err < 0) {
+        fmux_close(ret);
+        return NULL;
+    }
+
+    //A v2 peer's hello is the first thing it sends. Anything else means a v1
+    //peer, and whatever was read stays buffered for the demuxer.
+    unsigned char expect[10] = { 0xff, 0xff, 0xff, 0xff, 0, 0, 0, 2, FMUX_CTL_HELLO };
+    uint64_t deadline = fmux_now_ns() + (uint64_t)timeout_ms * 1000000;
+    pthread_mutex_lock(&(ret->rx_lock));
+    for (;;) {
+        size_t avail = fmux_rx_avail(ret);
+        if (memcmp(ret->rx_buf + ret->rx_start, expect, (avail < 9) ? avail : 9) != 0) break;
+        if (avail >= sizeof(expect)) {
+            if ((unsigned char)ret->rx_buf[ret->rx_start + 9] >= FMUX_PROTO_V2) {
+                ret->rx_start += sizeof(expect);
+                ret->proto_upgrade = 1;
+            }
+            break;
+        }
+        uint64_t now = fmux_now_ns();
+        if (now >= deadline) break;
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        int n = poll(&pfd, 1, (int)((deadline - now + 999999) / 1000000));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || fmux_rx_fill(ret, NULL) <= 0) break;
+    }
+    pthread_mutex_unlock(&(ret->rx_lock));
+    fmux_proto_check(ret);
+    return ret;
+}
+
+void
+fmux_close(fmux_handle* handle)
+{
+    fmux_flush(handle); //Anything cork mode held back
+    if (handle->txq_len > 0) fmux_txq_drain_locked(handle, 1);
+    while (handle->nactive > 0)
+        fmux_close_channel(handle, handle->active[handle->nactive - 1]->id);
+    for (int i = 1; i < handle->nlinks; i++) fmux_close(handle->links[i]);
+    free(handle->chan_table);
+    handle->chan_table = NULL;
+    free(handle->active);
+    handle->active = NULL;
+    free(handle->tx_pollfds);
+    pthread_mutex_destroy(&(handle->chan_lock));
+    while (handle->closed != NULL) {
+        fmux_channel* to_free = handle->closed;
+        handle->closed = to_free->next_closed;
+        fmux_channel_destroy(to_free);
+    }
+    int err = pthread_mutex_destroy(&(handle->lock));
+    if (err < 0) perror("Destroying mutex");
+    pthread_mutex_destroy(&(handle->rx_lock));
+    pthread_mutex_destroy(&(handle->out_lock));
+    pthread_cond_destroy(&(handle->tx_cond));
+    pthread_mutex_destroy(&(handle->credit_lock));
+    pthread_cond_destroy(&(handle->credit_cond));
+    pthread_mutex_destroy(&(handle->rx_inq_lock));
+    free(handle->rx_inq);
+    if (handle->sel_epfd >= 0) close(handle->sel_epfd);
+    if (handle->sel_evfd >= 0) close(handle->sel_evfd);
+    if (handle->cork_timerfd >= 0) close(handle->cork_timerfd);
+    fmux_splice_close(handle->rx_pipe);
+    fmux_splice_close(handle->tx_pipe);
+    if (handle->shm_tx != NULL) munmap(handle->shm_tx, sizeof(struct fmux_shm_ring) + handle->shm_tx_cap);
+    if (handle->shm_rx != NULL) munmap(handle->shm_rx, sizeof(struct fmux_shm_ring) + handle->shm_rx_cap);
+    pthread_mutex_destroy(&(handle->sel_lock));
+    fmux_capture_flush_locked(handle);
+    pthread_mutex_destroy(&(handle->cap_lock));
+    free(handle->cap_buf);
+    free(handle->cap_rx);
+    free(handle->rx_buf);
+    free(handle->tx_buf);
+    free(handle->txq);
+    fmux_pool_close(handle->pool);
+    close(handle->fd); //Should I do this? I don't open this file descriptor...
+    free(handle);
+}
+
+/* Channel table. Channels are found by id through an open-addressing hash
+ * (linear probing, kept at most half full) and walked through a dense array,
+ * so ids can be anything up to 2^32 - 1 without costing memory or time for
+ * the ones that aren't open. Opening and closing channels changes both under
+ * rx_lock and chan_lock, so the demuxer (which holds rx_lock anyway) looks
+ * channels up without any locking of its own, and everybody else walks them
+ * under chan_lock. */
+
+/* PRIVATE */ uint32_t
+fmux_channel_slot(uint32_t channel_id, uint32_t mask)
+{
+    //murmur3's fmix32, so every bit of the id reaches the low bits the mask
+    //keeps; ids that differ only in their high bits (k << 16, a namespace
+    //in the top byte) still spread out
+    uint32_t h = channel_id;
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h & mask;
+}
+
+fmux_channel*
+fmux_channel_lookup(fmux_handle* handle, uint32_t channel_id)
+{
+    handle = handle->bond; //Links demux into their bond's channels
+    uint32_t mask = handle->chan_mask;
+    for (uint32_t i = fmux_channel_slot(channel_id, mask);; i = (i + 1) & mask) {
+        fmux_channel* channel = handle->chan_table[i];
+        if (channel == NULL || channel->id == channel_id) return channel;
+    }
+}
+
+/* PRIVATE */ void
+fmux_channel_hold(fmux_channel* channel)
+{
+    //Keeps fmux_channel_reap from freeing it if it's closed meanwhile
+    __atomic_add_fetch(&(channel->users), 1, __ATOMIC_ACQ_REL);
+}
+
+/* PRIVATE */ void
+fmux_channel_drop(fmux_channel* channel)
+{
+    __atomic_sub_fetch(&(channel->users), 1, __ATOMIC_ACQ_REL);
+}
+
+/* PRIVATE */ fmux_channel*
+fmux_channel_find(fmux_handle* handle, uint32_t channel_id)
+{
+    //fmux_channel_lookup for callers that don't hold rx_lock. The channel
+    //comes back held; let go of it with fmux_channel_drop.
+    handle = handle->bond;
+    pthread_mutex_lock(&(handle->chan_lock));
+    fmux_channel* channel = fmux_channel_lookup(handle, channel_id);
+    if (channel != NULL) fmux_channel_hold(channel);
+    pthread_mutex_unlock(&(handle->chan_lock));
+    return channel;
+}
+
+/* PRIVATE */ void
+fmux_channel_place(fmux_channel** table, uint32_t mask, fmux_channel* channel)
+{
+    uint32_t i = fmux_channel_slot(channel->id, mask);
+    while (table[i] != NULL) i = (i + 1) & mask;
+    table[i] = channel;
+}
+
+/* PRIVATE */ void
+fmux_channel_insert(fmux_handle* handle, fmux_channel* channel)
+{
+    //Holding rx_lock and chan_lock
+    if (2 * (handle->nactive + 1) > (int64_t)handle->chan_mask + 1) {
+        uint32_t mask = 2 * handle->chan_mask + 1;
+        fmux_channel** table = calloc((size_t)mask + 1, sizeof(fmux_channel*));
+        for (int i = 0; i < handle->nactive; i++)
+            fmux_channel_place(table, mask, handle->active[i]);
+        free(handle->chan_table);
+        handle->chan_table = table;
+        handle->chan_mask = mask;
+    }
+    fmux_channel_place(handle->chan_table, handle->chan_mask, channel);
+
+    if (handle->nactive == handle->active_cap) {
+        handle->active_cap = handle->active_cap ? 2 * handle->active_cap : FMUX_CHAN_TABLE_MIN;
+        handle->active = realloc(handle->active, handle->active_cap * sizeof(fmux_channel*));
+    }
+    channel->active_index = handle->nactive;
+    handle->active[handle->nactive++] = channel;
+}
+
+/* PRIVATE */ void
+fmux_channel_remove(fmux_handle* handle, fmux_channel* channel)
+{
+    //Holding rx_lock and chan_lock. Entries after the hole that would have
+    //landed there are shifted back, so lookups never need tombstones.
+    uint32_t mask = handle->chan_mask;
+    uint32_t i = fmux_channel_slot(channel->id, mask);
+    while (handle->chan_table[i] != channel) i = (i + 1) & mask;
+    for (uint32_t j = (i + 1) & mask; handle->chan_table[j] != NULL; j = (j + 1) & mask) {
+        uint32_t home = fmux_channel_slot(handle->chan_table[j]->id, mask);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            handle->chan_table[i] = handle->chan_table[j];
+            i = j;
+        }
+    }
+    handle->chan_table[i] = NULL;
+
+    fmux_channel* last = handle->active[--handle->nactive];
+    handle->active[channel->active_index] = last;
+    last->active_index = channel->active_index;
+    channel->active_index = -1;
+}
+
+/* PRIVATE */ fmux_channel*
+fmux_channel_new(fmux_handle* handle, uint32_t channel_id)
+{
+    fmux_channel* chan = malloc(sizeof(fmux_channel));
+    chan->next_closed = NULL;
+    chan->users = 0;
+    chan->closed_pump = NULL;
+    chan->closed_batch = 0;
+    chan->id = channel_id;
+    chan->handle = handle;
+    //Spread over the links there are so far
+    int nlinks = __atomic_load_n(&(handle->nlinks), __ATOMIC_ACQUIRE);
+    chan->link = handle->links[channel_id % nlinks];
+    chan->type = FMUX_CHANTYPE_TEXT; //Does this matter?
+    chan->watch.kind = FMUX_WATCH_CHANNEL;
+    chan->watch.handle = chan->link;
+    chan->watch.channel = chan;
+    chan->watch.uring_armed = chan->watch.uring_cancelling = 0;
+    chan->watch.uring_dirty = 0;
+    chan->watch.uring_next = NULL;
+    chan->active_index = -1;
+    chan->sel_queued = 0;
+    chan->sel_mark = 0;
+    chan->sel_next = NULL;
+    chan->out_queued = 0;
+    chan->out_level = 0;
+    chan->out_next = NULL;
+    chan->priority = FMUX_PRIORITY_DEFAULT;
+    chan->weight = 1;
+    chan->deficit = 0;
+    chan->tx_active = 0;
+    chan->fd_out = 0;
+    chan->ring = NULL;
+    chan->sock[0] = chan->sock[1] = -1;
+    chan->tx_credit = handle->window;
+    chan->rx_total = chan->rx_acked = 0;
+    chan->backlog = NULL;
+    chan->backlog_len = chan->backlog_cap = 0;
+    chan->credit_watch = 0;
+    chan->msg_buf = NULL;
+    chan->msg_len = chan->msg_cap = 0;
+    chan->msg_consumed = 0;
+    memset(&(chan->stats), 0, sizeof(chan->stats));
+    pthread_mutex_init(&(chan->lat_lock), NULL);
+    chan->lat_marks = NULL;
+    chan->lat_head = chan->lat_len = 0;
+    return chan;
+}
+
+/* PRIVATE */ void
+fmux_links_rx_lock(fmux_handle* handle)
+{
+    //Every link's demuxer looks up channels in the table, so changing it
+    //takes all of their rx_locks (ours first; see fmux_add_link)
+    pthread_mutex_lock(&(handle->rx_lock));
+    for (int i = 1; i < handle->nlinks; i++)
+        pthread_mutex_lock(&(handle->links[i]->rx_lock));
+}
+
+/* PRIVATE */ void
+fmux_links_rx_unlock(fmux_handle* handle)
+{
+    for (int i = handle->nlinks - 1; i > 0; i--)
+        pthread_mutex_unlock(&(handle->links[i]->rx_lock));
+    pthread_mutex_unlock(&(handle->rx_lock));
+}
+
+/* PRIVATE */ fmux_channel*
+fmux_channel_add(fmux_handle* handle, fmux_channel* chan)
+{
+    //Returns whichever channel ends up open with chan's id, or NULL if the
+    //handle has as many open as it may
+    fmux_links_rx_lock(handle);
+    pthread_mutex_lock(&(handle->chan_lock));
+    fmux_channel* ret = fmux_channel_lookup(handle, chan->id);
+    if (ret == NULL && handle->nactive < handle->max_channels) {
+        fmux_channel_insert(handle, chan);
+        fmux_select_watch(handle, chan);
+        ret = chan;
+    }
+    pthread_mutex_unlock(&(handle->chan_lock));
+    fmux_links_rx_unlock(handle);
+    return ret;
+}
+
+/* PRIVATE */ void
+fmux_channel_free(fmux_channel* channel)
+{
+    //One that never made it into the table
+    if (channel->sock[0] >= 0) close(channel->sock[0]);
+    if (channel->sock[1] >= 0) close(channel->sock[1]);
+    if (channel->ring != NULL) fmux_ring_destroy(channel->ring);
+    pthread_mutex_destroy(&(channel->lat_lock));
+    free(channel);
+}
+
+void
+fmux_channel_destroy(fmux_channel* channel)
+{
+    //One that was closed; its sockets are gone already
+    if (channel->ring != NULL) fmux_ring_destroy(channel->ring);
+    pthread_mutex_destroy(&(channel->lat_lock));
+    free(channel->lat_marks);
+    free(channel);
+}
+
+/* PRIVATE */ int
+fmux_channel_quiet(fmux_pump* pump, fmux_channel* channel)
+{
+    //Whether a closed channel can be freed: no call holds it, and the pump
+    //(holding pump->lock, if the handle is still on one) is done with its
+    //watch. A pump the handle has left is done with it too.
+    if (__atomic_load_n(&(channel->users), __ATOMIC_ACQUIRE) > 0) return 0;
+    if (pump == NULL || channel->closed_pump != pump) return 1;
+    if (pump->uring != NULL) return fmux_uring_quiet(pump, &(channel->watch));
+    //The batch of events it was closed during may have had it in
+    return pump->batches != channel->closed_batch;
+}
+
+/* PRIVATE */ void
+fmux_channel_reap(fmux_handle* handle)
+{
+    //Frees the closed channels that nothing can be using anymore; see
+    //fmux_channel_quiet. The rest wait for a later open or close.
+    fmux_pump* pump = handle->pump;
+    if (pump != NULL) {
+        pthread_mutex_lock(&(pump->lock));
+        //It may have left the pump since
+        if (handle->pump != pump) {
+            pthread_mutex_unlock(&(pump->lock));
+            pump = NULL;
+        }
+    }
+    pthread_mutex_lock(&(handle->chan_lock));
+    fmux_channel** link = &(handle->closed);
+    while (*link != NULL) {
+        fmux_channel* channel = *link;
+        if (!fmux_channel_quiet(pump, channel)) {
+            link = &(channel->next_closed);
+            continue;
+        }
+        *link = channel->next_closed;
+        fmux_channel_destroy(channel);
+    }
+    pthread_mutex_unlock(&(handle->chan_lock));
+    if (pump != NULL) pthread_mutex_unlock(&(pump->lock));
+}
+
+/* PRIVATE */ fmux_channel*
+fmux_channel_reuse(fmux_channel* existing, fmux_chantype type)
+{
+    //Opening a channel that's open already returns it, but a message channel
+    //has to be one; messages would run together in anything else
+    if (type == FMUX_CHANTYPE_BIN && existing->type != FMUX_CHANTYPE_BIN) {
+        errno = EEXIST;
+        return NULL;
+    }
+    return existing;
+}
+
+/* PRIVATE */ fmux_channel*
+fmux_open_socket_channel(fmux_handle* handle, uint32_t channel_id, fmux_chantype type)
+{
+    if (handle == NULL) return NULL;
+    if (channel_id == FMUX_PROTO_CHANNEL) { errno = EINVAL; return NULL; }
+    handle = handle->bond;
+
+    fmux_channel* existing = fmux_channel_find(handle, channel_id);
+    if (existing != NULL) {
+        fmux_channel* ret = fmux_channel_reuse(existing, type);
+        fmux_channel_drop(existing);
+        return ret;
+    }
+    fmux_channel_reap(handle);
+
+    fmux_channel* chan = fmux_channel_new(handle, channel_id);
+    //Message channels keep each message a record of its own
+    chan->type = type;
+    if (socketpair(AF_LOCAL, (type == FMUX_CHANTYPE_BIN) ? SOCK_SEQPACKET : SOCK_STREAM, 0, chan->sock) < 0) {
+        int err = errno; //Out of fds, most likely
+        fmux_channel_free(chan);
+        errno = err;
+        return NULL;
+    }
+    //The library side never blocks on a channel; see fmux_write_fully
+    fcntl(chan->sock[1], F_SETFL, fcntl(chan->sock[1], F_GETFL) | O_NONBLOCK);
+    existing = fmux_channel_add(handle, chan);
+    if (existing != chan) {
+        fmux_channel_free(chan);
+        return fmux_channel_reuse(existing, type);
+    }
+
+    fmux_pump* pump = handle->pump;
+    if (pump != NULL) {
+        pthread_mutex_lock(&(pump->lock));
+        fmux_pump_watch_channel(pump, chan, EPOLL_CTL_ADD);
+        pthread_mutex_unlock(&(pump->lock));
+    }
+
+    return chan;
+}
+
+fmux_channel*
+fmux_open_channel(fmux_handle* handle, uint32_t channel_id)
+{
+    return fmux_open_socket_channel(handle, channel_id, FMUX_CHANTYPE_TEXT);
+}
+
+fmux_channel*
+fmux_open_msg_channel(fmux_handle* handle, uint32_t channel_id)
+{
+    return fmux_open_socket_channel(handle, channel_id, FMUX_CHANTYPE_BIN);
+}
+
+fmux_channel*
+fmux_open_ring_channel(fmux_handle* handle, uint32_t channel_id, size_t capacity, int flags)
+{
+    if (handle == NULL) return NULL;
+    if (channel_id == FMUX_PROTO_CHANNEL) { errno = EINVAL; return NULL; }
+    handle = handle->bond;
+
+    fmux_channel* existing = fmux_channel_find(handle, channel_id);
+    if (existing != NULL) {
+        fmux_channel_drop(existing);
+        return existing;
+    }
+    fmux_channel_reap(handle);
+
+    fmux_channel* chan = fmux_channel_new(handle, channel_id);
+    chan->ring = fmux_ring_create(capacity, flags);
+    if (chan->ring == NULL) {
+        fmux_channel_free(chan);
+        return NULL;
+    }
+    //Nothing for the pump to watch: outbound data goes straight to the wire
+    existing = fmux_channel_add(handle, chan);
+    if (existing != chan) fmux_channel_free(chan);
+    return existing;
+}
+
+int
+fmux_close_channel(fmux_handle* handle, uint32_t channel_id)
+{
+    if (handle == NULL) return -1;
+    handle = handle->bond;
+
+    fmux_channel_reap(handle);
+    fmux_channel* channel = fmux_channel_find(handle, channel_id);
+    if (channel == NULL) return -1;
+
+    if (handle->sel_epfd >= 0 && channel->sock[0] >= 0)
+        epoll_ctl(handle->sel_epfd, EPOLL_CTL_DEL, channel->sock[0], NULL);
+    fmux_pump* pump = handle->pump;
+    int watched = pump != NULL && (pump->uring != NULL || channel->sock[1] >= 0);
+    if (watched) {
+        pthread_mutex_lock(&(pump->lock));
+        if (pump->uring == NULL) epoll_ctl(pump->epfd, EPOLL_CTL_DEL, channel->sock[1], NULL);
+        channel->closed_pump = pump;
+        channel->closed_batch = pump->batches;
+        pthread_mutex_unlock(&(pump->lock));
+    }
+    fmux_handle* link = channel->link;
+
+    //Don't pull the socket (or ring) out from under a pump thread using it
+    fmux_links_rx_lock(handle);
+    pthread_mutex_lock(&(handle->lock));
+    if (link != handle) pthread_mutex_lock(&(link->lock));
+    pthread_mutex_lock(&(handle->chan_lock));
+    if (channel->active_index < 0) {
+        //Somebody else closed it first
+        pthread_mutex_unlock(&(handle->chan_lock));
+        if (link != handle) fmux_tx_unlock(link);
+        fmux_tx_unlock(handle);
+        fmux_links_rx_unlock(handle);
+        fmux_channel_drop(channel);
+        return -1;
+    }
+    fmux_channel_remove(handle, channel);
+    //Freed by fmux_channel_reap; the list is only changed under chan_lock
+    channel->next_closed = handle->closed;
+    handle->closed = channel;
+    pthread_mutex_unlock(&(handle->chan_lock));
+    if (channel->sock[0] >= 0) close(channel->sock[0]);
+    if (channel->sock[1] >= 0) close(channel->sock[1]);
+    if (channel->ring != NULL) {
+        //Wake up anybody blocked in fmux_read; they'll see the channel is gone
+        pthread_mutex_lock(&(channel->ring->lock));
+        channel->ring->closed = 1;
+        pthread_cond_broadcast(&(channel->ring->cond));
+        pthread_mutex_unlock(&(channel->ring->lock));
+    }
+    //The io_uring pump looks at it without our locks
+    __atomic_store_n(&(channel->handle), NULL, __ATOMIC_RELEASE);
+    //Nobody can queue it again now that handle is NULL
+    fmux_unqueue_out(link, channel);
+    if (channel->fd_out) __atomic_sub_fetch(&(handle->fd_out_channels), 1, __ATOMIC_RELAXED);
+    if (channel->backlog_len > 0) __atomic_sub_fetch(&(handle->backlogged), 1, __ATOMIC_RELAXED);
+    if (channel->credit_watch) handle->credit_watches--;
+    free(channel->backlog);
+    channel->backlog = NULL;
+    free(channel->msg_buf);
+    channel->msg_buf = NULL;
+    __atomic_store_n(&(channel->backlog_len), 0, __ATOMIC_RELAXED);
+    if (link != handle) fmux_tx_unlock(link);
+    fmux_tx_unlock(handle);
+    fmux_links_rx_unlock(handle);
+    //With io_uring, the pump cancels its requests once it sees handle == NULL.
+    //With epoll, the channel can be freed once the pump is past the batch of
+    //events that may have had it in.
+    if (pump != NULL && pump->uring != NULL) fmux_uring_touch(pump, &(channel->watch));
+    else if (watched) fmux_pump_wake(pump);
+    //Writers waiting on credit for this channel give up
+    pthread_mutex_lock(&(handle->credit_lock));
+    pthread_cond_broadcast(&(handle->credit_cond));
+    pthread_mutex_unlock(&(handle->credit_lock));
+    fmux_channel_drop(channel);
+    return 0;
+}
+
+int
+fmux_channel_is_good(fmux_channel* channel)
+{
+    if (channel == NULL) return 0;
+    if (channel->handle == NULL) return 0;
+    return 1;
+}
+
+/* PRIVATE */ int
+fmux_channel_sends_on(fmux_channel* channel, fmux_handle* handle)
+{
+    //Whether the channel is open and its frames go out over handle's fd
+    return __atomic_load_n(&(channel->handle), __ATOMIC_ACQUIRE) != NULL && channel->link == handle;
+}
+
+/* Links. A handle can send over several fds at once: each link is a handle
+ * of its own (with its own locks, buffers and decoder) whose frames go to its
+ * bond's channels. Every channel's frames go out over one link, so they stay
+ * in order without the wire format changing, and so the peer's demuxers never
+ * race each other over a channel. */
+
+/* PRIVATE */ int
+fmux_is_bonded(fmux_handle* handle)
+{
+    return handle->bond != handle || __atomic_load_n(&(handle->nlinks), __ATOMIC_ACQUIRE) > 1;
+}
+
+int
+fmux_add_link(fmux_handle* handle, int fd)
+{
+    if (handle == NULL) return -1;
+    //Flow control, shared memory and the like are per fd, and the other
+    //links wouldn't have them
+    if (handle->bond != handle || handle->pump != NULL || handle->window || handle->proto_offered ||
+        handle->shm_tx != NULL || handle->high_water || handle->tx_pipe[0] >= 0 || handle->cork_limit) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&(handle->rx_lock));
+    int n = handle->nlinks;
+    if (n == FMUX_MAX_LINKS) {
+        pthread_mutex_unlock(&(handle->rx_lock));
+        errno = EMLINK;
+        return -1;
+    }
+    fmux_handle* link = fmux_handle_create(fd, handle->max_channels);
+    link->bond = handle;
+    if (handle->max_frame != link->max_frame) fmux_set_max_frame(link, handle->max_frame);
+    handle->links[n] = link;
+    __atomic_store_n(&(handle->nlinks), n + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&(handle->rx_lock));
+    return n;
+}
+
+fmux_handle*
+fmux_get_link(fmux_handle* handle, int link)
+{
+    if (link < 0 || link >= __atomic_load_n(&(handle->nlinks), __ATOMIC_ACQUIRE)) return NULL;
+    return handle->links[link];
+}
+
+int
+fmux_channel_set_link(fmux_channel* channel, int link)
+{
+    if (!fmux_channel_is_good(channel)) return -1;
+    fmux_handle* handle = channel->handle;
+    fmux_handle* to = fmux_get_link(handle, link);
+    //The pump keeps the link a channel's fd is drained to; see fmux_pump_start
+    if (to == NULL || handle->pump != NULL) { errno = EINVAL; return -1; }
+    fmux_handle* from = channel->link;
+    pthread_mutex_lock(&(from->lock));
+    fmux_unqueue_out(from, channel);
+    channel->link = to;
+    channel->watch.handle = to;
+    fmux_tx_unlock(from);
+    return 0;
+}
+
+/* PRIVATE */ void
+fmux_channel_expose_fd(fmux_channel* channel)
+{
+    //Once the application has sock[0], data can show up in sock[1] behind
+    //the library's back, so fmux_writev has to flush it before sending.
+    if (!channel->fd_out) {
+        channel->fd_out = 1;
+        __atomic_add_fetch(&(channel->handle->fd_out_channels), 1, __ATOMIC_RELAXED);
+    }
+}
+
+int
+fmux_channel_read_fd(fmux_channel* channel)
+{
+    if (!fmux_channel_is_good(channel)) return -1;
+    //For ring channels, this is the readiness eventfd (if any)
+    if (channel->ring != NULL) return channel->ring->evfd;
+    //sock[0] is bidirectional; sock[1] belongs to the library
+    fmux_channel_expose_fd(channel);
+    return channel->sock[0];
+}
+
+int
+fmux_channel_write_fd(fmux_channel* channel)
+{
+    if (!fmux_channel_is_good(channel)) return -1;
+    if (channel->ring != NULL) return -1; //Use fmux_write
+    fmux_channel_expose_fd(channel);
+    return channel->sock[0];
+}
+
+/* PRIVATE */ int
+fmux_splice_fully(int in, int out, size_t nbyte, uint64_t* calls)
+{
+    //Move nbyte bytes from the pipe in to out, waiting for out to take them
+    //if it's non-blocking
+    while (nbyte > 0) {
+        ssize_t n = splice(in, NULL, out, NULL, nbyte, SPLICE_F_MOVE);
+        if (calls != NULL) fmux_stat_add(calls, 1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+            struct pollfd pfd = {.fd = out, .events = POLLOUT};
+            poll(&pfd, 1, -1);
+            continue;
+        }
+        if (n == 0) { errno = EPIPE; return -1; }
+        nbyte -= n;
+    }
+    return 0;
+}
+
+void
+fmux_splice_close(int pipefd[2])
+{
+    if (pipefd[0] >= 0) close(pipefd[0]);
+    if (pipefd[1] >= 0) close(pipefd[1]);
+    pipefd[0] = pipefd[1] = -1;
+}
+
+/* PRIVATE */ int
+fmux_write_fully(int fd, const void* buf, size_t nbyte, uint64_t* calls)
+{
+    //Write all of buf to a (possibly non-blocking) fd, counting the write()s
+    //in calls if it isn't NULL
+    const char* cur = buf;
+    size_t left = nbyte;
+    while (left > 0) {
+        ssize_t n = write(fd, cur, left);
+        if (calls != NULL) fmux_stat_add(calls, 1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+            struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+            poll(&pfd, 1, -1);
+            continue;
+        }
+        cur += n;
+        left -= n;
+    }
+    return nbyte;
+}
+
+/* Capture. Every frame a handle sends or receives is appended to a file as
+ * a fmux_capture_record and its payload, as it goes out or is demuxed, so
+ * test/replay can play the traffic back later. Records are gathered in
+ * cap_buf (under cap_lock, which both directions share, so the timestamps in
+ * the file never go backwards) and written FMUX_CAPTURE_BUFFER bytes at a
+ * time. Nothing but a relaxed load is spent while it's off. */
+
+/* PRIVATE */ int
+fmux_capturing(fmux_handle* handle)
+{
+    return __atomic_load_n(&(handle->cap_fd), __ATOMIC_RELAXED) >= 0;
+}
+
+void
+fmux_capture_flush_locked(fmux_handle* handle)
+{
+    //Under cap_lock. A failed write loses the records rather than the frames.
+    if (handle->cap_len > 0 && handle->cap_fd >= 0)
+        fmux_write_fully(handle->cap_fd, handle->cap_buf, handle->cap_len, NULL);
+    handle->cap_len = 0;
+}
+
+/* PRIVATE */ void
+fmux_capture(fmux_handle* handle, uint32_t channel_id, uint32_t flags,
+             const struct iovec* payload, int iovcnt)
+{
+    //Append a record for one frame (flags is FMUX_CAPTURE_OUT or 0)
+    size_t nbytes = 0;
+    for (int i = 0; i < iovcnt; i++) nbytes += payload[i].iov_len;
+    if (nbytes > FMUX_CAPTURE_LEN) return;
+    pthread_mutex_lock(&(handle->cap_lock));
+    if (handle->cap_fd < 0) {
+        //Turned off meanwhile
+        pthread_mutex_unlock(&(handle->cap_lock));
+        return;
+    }
+    fmux_capture_record record = {.ns = fmux_now_ns(), .channel_id = channel_id,
+                                  .nbytes = (uint32_t)nbytes | flags};
+    if (handle->cap_len + sizeof(record) + nbytes > FMUX_CAPTURE_BUFFER)
+        fmux_capture_flush_locked(handle);
+    if (sizeof(record) + nbytes > FMUX_CAPTURE_BUFFER) {
+        //Too big to buffer; straight out behind everything before it
+        struct iovec iov[iovcnt + 1];
+        iov[0].iov_base = &record;
+        iov[0].iov_len = sizeof(record);
+        memcpy(iov + 1, payload, iovcnt * sizeof(struct iovec));
+        fmux_writev_fully(handle->cap_fd, iov, iovcnt + 1, NULL);
+    } else {
+        memcpy(handle->cap_buf + handle->cap_len, &record, sizeof(record));
+        handle->cap_len += sizeof(record);
+        for (int i = 0; i < iovcnt; i++) {
+            memcpy(handle->cap_buf + handle->cap_len, payload[i].iov_base, payload[i].iov_len);
+            handle->cap_len += payload[i].iov_len;
+        }
+    }
+    pthread_mutex_unlock(&(handle->cap_lock));
+}
+
+/* PRIVATE */ void
+fmux_capture_rx(fmux_handle* handle, const char* data, size_t nbyte)
+{
+    //The demuxer is consuming nbyte more bytes of the current frame, under
+    //rx_lock and before rx_remaining goes down. The record is made once the
+    //last of them are in, with nothing copied if that's all at once.
+    if (!fmux_capturing(handle)) return;
+    int last = (nbyte == handle->rx_remaining);
+    if (handle->cap_rx_skip) {
+        if (last) handle->cap_rx_skip = 0;
+        return;
+    }
+    if (last && handle->cap_rx_len == 0) {
+        struct iovec iov = {.iov_base = (void*)data, .iov_len = nbyte};
+        fmux_capture(handle, handle->rx_channel, 0, &iov, 1);
+        return;
+    }
+    if (handle->cap_rx_len + nbyte > handle->cap_rx_cap) {
+        size_t cap = handle->cap_rx_cap ? handle->cap_rx_cap : FMUX_RX_BUFFER;
+        while (cap < handle->cap_rx_len + nbyte) cap *= 2;
+        handle->cap_rx = realloc(handle->cap_rx, cap);
+        handle->cap_rx_cap = cap;
+    }
+    memcpy(handle->cap_rx + handle->cap_rx_len, data, nbyte);
+    handle->cap_rx_len += nbyte;
+    if (last) {
+        struct iovec iov = {.iov_base = handle->cap_rx, .iov_len = handle->cap_rx_len};
+        fmux_capture(handle, handle->rx_channel, 0, &iov, 1);
+        handle->cap_rx_len = 0;
+    }
+}
+
+int
+fmux_set_capture(fmux_handle* handle, int fd)
+{
+    if (handle == NULL) return -1;
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) < 0) return -1;
+    //rx_lock, so the demuxer isn't partway through putting a frame together
+    pthread_mutex_lock(&(handle->rx_lock));
+    pthread_mutex_lock(&(handle->cap_lock));
+    fmux_capture_flush_locked(handle);
+    int err = 0;
+    if (fd >= 0 && (!S_ISREG(st.st_mode) || st.st_size == 0))
+        err = fmux_write_fully(fd, FMUX_CAPTURE_MAGIC, FMUX_CAPTURE_MAGIC_LEN, NULL);
+    if (err >= 0) {
+        if (fd >= 0 && handle->cap_buf == NULL) handle->cap_buf = malloc(FMUX_CAPTURE_BUFFER);
+        handle->cap_rx_len = 0;
+        handle->cap_rx_skip = handle->rx_in_frame;
+        __atomic_store_n(&(handle->cap_fd), fd, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&(handle->cap_lock));
+    pthread_mutex_unlock(&(handle->rx_lock));
+    return (err < 0) ? -1 : 0;
+}
+
+/* Shared memory transport. Once both ends of an AF_UNIX link have called
+ * fmux_set_shm, each writes its frames into a ring in a memfd it created and
+ * passed to the other over the fd (SCM_RIGHTS). What goes through the rings
+ * is the same byte stream that would have gone through the fd, so only
+ * fmux_link_writev and fmux_rx_read know the difference. The fd is left
+ * with doorbells: single bytes sent after writing, if the reader ran dry and
+ * asked for one, so the pump watches it as before. */
+
+/* PRIVATE */ void
+fmux_shm_bells(fmux_handle* handle)
+{
+    //Drain the doorbells on the fd, noting whether the peer hung up
+    char bells[64];
+    for (;;) {
+        ssize_t n = recv(handle->fd, bells, sizeof(bells), MSG_DONTWAIT);
+        if (n > 0 || (n < 0 && errno == EINTR)) continue;
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            __atomic_store_n(&(handle->shm_eof), 1, __ATOMIC_RELEASE);
+        return;
+    }
+}
+
+/* PRIVATE */ int
+fmux_shm_ready(fmux_handle* handle)
+{
+    //fmux_rx_ready for shared memory. Asks for a doorbell before looking,
+    //so that anything written after it looked rings one.
+    struct fmux_shm_ring* ring = handle->shm_rx;
+    fmux_shm_bells(handle);
+    __atomic_store_n(&(ring->rx_waiting), 1, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&(ring->head), __ATOMIC_SEQ_CST) != __atomic_load_n(&(ring->tail), __ATOMIC_RELAXED) ||
+           __atomic_load_n(&(handle->shm_eof), __ATOMIC_ACQUIRE);
+}
+
+/* PRIVATE */ ssize_t
+fmux_shm_read(fmux_handle* handle, void* buf, size_t nbyte)
+{
+    //fmux_rx_read for shared memory: as much of the peer's ring as fits.
+    //Like read(), blocks until there is some unless the fd is non-blocking.
+    struct fmux_shm_ring* ring = handle->shm_rx;
+    uint64_t cap = handle->shm_rx_cap;
+    uint64_t tail = __atomic_load_n(&(ring->tail), __ATOMIC_RELAXED);
+    size_t got = 0;
+    for (;;) {
+        uint64_t head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+        if (head - tail > cap) { errno = EPROTO; return -1; }
+        size_t n = (head - tail < nbyte - got) ? head - tail : nbyte - got;
+        if (n > 0) {
+            size_t off = tail & (cap - 1);
+            size_t first = (n < cap - off) ? n : cap - off;
+            memcpy((char*)buf + got, ring->data + off, first);
+            memcpy((char*)buf + got + first, ring->data, n - first);
+            tail += n;
+            got += n;
+            __atomic_store_n(&(ring->tail), tail, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&(ring->tx_waiting), __ATOMIC_SEQ_CST) &&
+                __atomic_exchange_n(&(ring->tx_waiting), 0, __ATOMIC_SEQ_CST)) {
+                //Not a private futex: the producer may be another process
+                __atomic_add_fetch(&(ring->space), 1, __ATOMIC_SEQ_CST);
+                syscall(SYS_futex, &(ring->space), FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+            }
+        }
+        if (got == nbyte) break;
+        //Ran dry: ask for a doorbell, then look again in case data beat it
+        __atomic_store_n(&(ring->rx_waiting), 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&(ring->head), __ATOMIC_SEQ_CST) != tail) continue;
+        if (got > 0 || __atomic_load_n(&(handle->shm_eof), __ATOMIC_ACQUIRE)) break;
+        if (fcntl(handle->fd, F_GETFL) & O_NONBLOCK) { errno = EAGAIN; return -1; }
+        struct pollfd pfd = {.fd = handle->fd, .events = POLLIN};
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) return -1;
+        fmux_shm_bells(handle);
+    }
+    fmux_stat_add(&(handle->stats.reads), 1);
+    return got;
+}
+
+/* PRIVATE */ int
+fmux_shm_doorbell(fmux_handle* handle)
+{
+    //After publishing head: wake the peer up if it asked
+    struct fmux_shm_ring* ring = handle->shm_tx;
+    if (!__atomic_load_n(&(ring->rx_waiting), __ATOMIC_SEQ_CST) ||
+        !__atomic_exchange_n(&(ring->rx_waiting), 0, __ATOMIC_SEQ_CST))
+        return 0;
+    ssize_t n;
+    do {
+        n = send(handle->fd, "", 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    //A full socket means the peer has doorbells to get to already
+    return (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) ? -1 : 0;
+}
+
+/* PRIVATE */ int
+fmux_shm_wait_room(fmux_handle* handle, uint64_t head)
+{
+    //Our ring is full; sleep until the peer reads some of it
+    struct fmux_shm_ring* ring = handle->shm_tx;
+    uint32_t seen = __atomic_load_n(&(ring->space), __ATOMIC_SEQ_CST);
+    __atomic_store_n(&(ring->tx_waiting), 1, __ATOMIC_SEQ_CST);
+    if (head - __atomic_load_n(&(ring->tail), __ATOMIC_SEQ_CST) < handle->shm_tx_cap) return 0;
+    struct timespec nap = {0, FMUX_SHM_NAP_MS * 1000000L};
+    syscall(SYS_futex, &(ring->space), FUTEX_WAIT, seen, &nap, NULL, 0);
+    //Nobody will make room once the peer is gone
+    struct pollfd pfd = {.fd = handle->fd, .events = 0};
+    if (poll(&pfd, 1, 0) == 1 && (pfd.revents & (POLLHUP | POLLERR))) {
+        errno = EPIPE;
+        return -1;
+    }
+    return 0;
+}
+
+/* PRIVATE */ int
+fmux_shm_writev(fmux_handle* handle, const struct iovec* iov, int iovcnt)
+{
+    //fmux_writev_fully for shared memory: copy iov into our ring, letting
+    //the peer at it and waiting whenever it fills up. Under lock.
+    struct fmux_shm_ring* ring = handle->shm_tx;
+    uint64_t cap = handle->shm_tx_cap;
+    uint64_t head = __atomic_load_n(&(ring->head), __ATOMIC_RELAXED);
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        const char* src = iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+        while (left > 0) {
+            uint64_t used = head - __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE);
+            if (used > cap) { errno = EPROTO; return -1; }
+            if (used == cap) {
+                __atomic_store_n(&(ring->head), head, __ATOMIC_SEQ_CST);
+                if (fmux_shm_doorbell(handle) < 0 || fmux_shm_wait_room(handle, head) < 0) return -1;
+                continue;
+            }
+            size_t n = (left < cap - used) ? left : cap - used;
+            size_t off = head & (cap - 1);
+            size_t first = (n < cap - off) ? n : cap - off;
+            memcpy(ring->data + off, src, first);
+            memcpy(ring->data, src + first, n - first);
+            head += n;
+            src += n;
+            left -= n;
+            total += n;
+        }
+    }
+    __atomic_store_n(&(ring->head), head, __ATOMIC_SEQ_CST);
+    fmux_stat_add(&(handle->stats.writes), 1);
+    if (fmux_shm_doorbell(handle) < 0) return -1;
+    return total;
+}
+
+/* PRIVATE */ struct fmux_shm_ring*
+fmux_shm_map(int fd, uint64_t capacity)
+{
+    void* ring = mmap(NULL, sizeof(struct fmux_shm_ring) + capacity, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+    return (ring == MAP_FAILED) ? NULL : ring;
+}
+
+/* PRIVATE */ int
+fmux_shm_handshake(fmux_handle* handle, uint64_t capacity)
+{
+    //Send our ring over and map the one that comes back. Holding both locks.
+    int memfd = memfd_create("fmux", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd < 0) return -1;
+    //Sealed at its size, so the peer's mapping can't be cut short under it
+    if (ftruncate(memfd, sizeof(struct fmux_shm_ring) + capacity) < 0 ||
+        fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0 ||
+        (handle->shm_tx = fmux_shm_map(memfd, capacity)) == NULL) {
+        close(memfd);
+        return -1;
+    }
+    handle->shm_tx->capacity = capacity;
+    handle->shm_tx_cap = capacity;
+
+    struct fmux_shm_hello hello = {.magic = "FMUXSHM", .capacity = capacity};
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = {.iov_base = &hello, .iov_len = sizeof(hello)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1,
+                         .msg_control = control.buf, .msg_controllen = sizeof(control.buf)};
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+    struct pollfd pfd = {.fd = handle->fd, .events = POLLOUT};
+    ssize_t n;
+    while ((n = sendmsg(handle->fd, &msg, MSG_NOSIGNAL)) < 0 &&
+           (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+        poll(&pfd, 1, -1);
+    close(memfd);
+
+    int peer = -1;
+    if (n == sizeof(hello)) {
+        memset(&hello, 0, sizeof(hello));
+        memset(&control, 0, sizeof(control));
+        msg.msg_controllen = sizeof(control.buf);
+        pfd.events = POLLIN;
+        while ((n = recvmsg(handle->fd, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL)) < 0 &&
+               (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+            poll(&pfd, 1, -1);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (n > 0 && cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+            memcpy(&peer, CMSG_DATA(cmsg), sizeof(int));
+
+        //The peer's ring has to be what it says it is
+        uint64_t cap = hello.capacity;
+        struct stat st;
+        int seals = (peer >= 0) ? fcntl(peer, F_GET_SEALS) : -1;
+        if (n != sizeof(hello) || memcmp(hello.magic, "FMUXSHM", sizeof(hello.magic)) != 0 ||
+            cap < FMUX_SHM_MIN || cap > FMUX_SHM_MAX || (cap & (cap - 1)) != 0 ||
+            seals < 0 || !(seals & F_SEAL_SHRINK) || fstat(peer, &st) < 0 ||
+            (uint64_t)st.st_size < sizeof(struct fmux_shm_ring) + cap ||
+            (handle->shm_rx = fmux_shm_map(peer, cap)) == NULL) {
+            if (n >= 0) errno = EPROTO;
+        } else {
+            handle->shm_rx_cap = cap;
+        }
+    }
+    if (peer >= 0) close(peer);
+    if (handle->shm_rx == NULL) {
+        munmap(handle->shm_tx, sizeof(struct fmux_shm_ring) + capacity);
+        handle->shm_tx = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int
+fmux_set_shm(fmux_handle* handle, size_t capacity)
+{
+    if (handle == NULL) return -1;
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (fmux_is_bonded(handle) ||
+        getsockname(handle->fd, (struct sockaddr*)&addr, &len) < 0 || addr.ss_family != AF_UNIX) {
+        errno = EINVAL;
+        return -1;
+    }
+    uint64_t cap = FMUX_SHM_MIN;
+    if (capacity == 0) capacity = FMUX_SHM_DEFAULT;
+    while (cap < capacity && cap < FMUX_SHM_MAX) cap *= 2;
+
+    pthread_mutex_lock(&(handle->rx_lock));
+    pthread_mutex_lock(&(handle->lock));
+    int err = -1;
+    if (handle->shm_tx != NULL || handle->pump != NULL || handle->tx_len > 0 || handle->high_water ||
+        handle->rx_end > handle->rx_start) {
+        errno = EINVAL;
+    } else if ((err = fmux_shm_handshake(handle, cap)) == 0) {
+        //Splicing would go around the rings
+        fmux_splice_close(handle->rx_pipe);
+        fmux_splice_close(handle->tx_pipe);
+    }
+    fmux_tx_unlock(handle);
+    pthread_mutex_unlock(&(handle->rx_lock));
+    return err;
+}
+
+/* Ring channels */
+
+fmux_ring*
+fmux_ring_create(size_t capacity, int flags)
+{
+    size_t cap = FMUX_RING_MIN;
+    if (capacity == 0) capacity = FMUX_RING_DEFAULT;
+    while (cap < capacity) cap <<= 1;
+
+    fmux_ring* ring = malloc(sizeof(fmux_ring));
+    if (ring == NULL) return NULL;
+    ring->buf = malloc(cap);
+    if (ring->buf == NULL) {
+        free(ring);
+        return NULL;
+    }
+    ring->mask = cap - 1;
+    ring->head = ring->tail = 0;
+    ring->waiting = 0;
+    ring->closed = 0;
+    ring->evfd = -1;
+    if (flags & FMUX_RING_EVENTFD) {
+        ring->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (ring->evfd < 0) {
+            free(ring->buf);
+            free(ring);
+            return NULL;
+        }
+    }
+    pthread_mutex_init(&(ring->lock), NULL);
+    pthread_cond_init(&(ring->cond), NULL);
+    return ring;
+}
+
+void
+fmux_ring_destroy(fmux_ring* ring)
+{
+    if (ring->evfd >= 0) close(ring->evfd);
+    pthread_mutex_destroy(&(ring->lock));
+    pthread_cond_destroy(&(ring->cond));
+    free(ring->buf);
+    free(ring);
+}
+
+/* PRIVATE */ size_t
+fmux_ring_used(fmux_ring* ring)
+{
+    return __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE) -
+           __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE);
+}
+
+void
+fmux_ring_notify(fmux_ring* ring)
+{
+    //Only costs a lock when a reader is actually asleep
+    if (__atomic_load_n(&(ring->waiting), __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&(ring->lock));
+        pthread_cond_broadcast(&(ring->cond));
+        pthread_mutex_unlock(&(ring->lock));
+    }
+}
+
+/* PRIVATE */ size_t
+fmux_ring_push(fmux_ring* ring, const char* data, size_t nbyte)
+{
+    //Producer side. Copies as much as fits and returns how much that was.
+    size_t head = ring->head;
+    size_t tail = __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE);
+    size_t room = ring->mask + 1 - (head - tail);
+    if (nbyte > room) nbyte = room;
+    if (nbyte == 0) return 0;
+
+    size_t off = head & ring->mask;
+    size_t first = ring->mask + 1 - off;
+    if (first > nbyte) first = nbyte;
+    memcpy(ring->buf + off, data, first);
+    memcpy(ring->buf, data + first, nbyte - first);
+    __atomic_store_n(&(ring->head), head + nbyte, __ATOMIC_SEQ_CST);
+
+    if (head == tail && ring->evfd >= 0) {
+        uint64_t one = 1;
+        write(ring->evfd, &one, sizeof(one));
+    }
+    fmux_ring_notify(ring);
+    return nbyte;
+}
+
+/* PRIVATE */ size_t
+fmux_ring_pop(fmux_ring* ring, char* data, size_t nbyte)
+{
+    //Consumer side
+    size_t tail = ring->tail;
+    size_t head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+    if (nbyte > head - tail) nbyte = head - tail;
+    if (nbyte == 0) return 0;
+
+    size_t off = tail & ring->mask;
+    size_t first = ring->mask + 1 - off;
+    if (first > nbyte) first = nbyte;
+    memcpy(data, ring->buf + off, first);
+    memcpy(data + first, ring->buf, nbyte - first);
+    __atomic_store_n(&(ring->tail), tail + nbyte, __ATOMIC_SEQ_CST);
+
+    if (ring->evfd >= 0 && tail + nbyte == head) {
+        //Drained it; the eventfd should only stay readable if the producer
+        //slipped something in meanwhile
+        uint64_t count;
+        read(ring->evfd, &count, sizeof(count));
+        if (fmux_ring_used(ring) > 0) {
+            uint64_t one = 1;
+            write(ring->evfd, &one, sizeof(one));
+        }
+    }
+    return nbyte;
+}
+
+/* PRIVATE */ void
+fmux_ring_wait(fmux_ring* ring, fmux_handle* handle)
+{
+    pthread_mutex_lock(&(ring->lock));
+    __atomic_store_n(&(ring->waiting), 1, __ATOMIC_SEQ_CST);
+    //A single wait; the caller re-checks everything afterwards anyway
+    if (fmux_ring_used(ring) == 0 && !ring->closed &&
+        !__atomic_load_n(&(handle->rx_eof), __ATOMIC_ACQUIRE))
+        pthread_cond_wait(&(ring->cond), &(ring->lock));
+    __atomic_store_n(&(ring->waiting), 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&(ring->lock));
+}
+
+/* Message pool. fmux_message buffers are carved into power-of-two size
+ * classes and recycled through per-handle free lists instead of going back
+ * to malloc. Each buffer is preceded by a small header pointing back at its
+ * pool, so releasing one only needs the message. The pool outlives its
+ * handle until every buffer handed out has come back. */
+
+#define FMUX_POOL_MIN_SHIFT 6 //Smallest class holds 64 payload bytes
+
+typedef struct _fmux_pool_block fmux_pool_block;
+struct _fmux_pool_block {
+    fmux_message_pool* pool; //NULL for oversized, plain malloc'd messages
+    fmux_pool_block* next;
+    int size_class;
+    int pad;
+};
+
+struct _fmux_message_pool {
+    pthread_mutex_t lock;
+    fmux_pool_block* free[FMUX_POOL_CLASSES];
+    int nfree[FMUX_POOL_CLASSES];
+    int outstanding; //Buffers handed out and not released yet
+    int closed; //The handle is gone; free the pool with the last buffer
+};
+
+fmux_message_pool*
+fmux_pool_create()
+{
+    fmux_message_pool* pool = calloc(1, sizeof(fmux_message_pool));
+    pthread_mutex_init(&(pool->lock), NULL);
+    return pool;
+}
+
+/* PRIVATE */ void
+fmux_pool_destroy(fmux_message_pool* pool)
+{
+    for (int i = 0; i < FMUX_POOL_CLASSES; i++) {
+        while (pool->free[i] != NULL) {
+            fmux_pool_block* block = pool->free[i];
+            pool->free[i] = block->next;
+            free(block);
+        }
+    }
+    pthread_mutex_destroy(&(pool->lock));
+    free(pool);
+}
+
+void
+fmux_pool_close(fmux_message_pool* pool)
+{
+    pthread_mutex_lock(&(pool->lock));
+    pool->closed = 1;
+    int last = (pool->outstanding == 0);
+    pthread_mutex_unlock(&(pool->lock));
+    if (last) fmux_pool_destroy(pool);
+}
+
+/* PRIVATE */ uint32_t
+fmux_pool_class_size(int size_class)
+{
+    return (uint32_t)1 << (FMUX_POOL_MIN_SHIFT + size_class);
+}
+
+/* PRIVATE */ fmux_message*
+fmux_block_message(fmux_pool_block* block)
+{
+    return (fmux_message*)(block + 1);
+}
+
+/* PRIVATE */ fmux_pool_block*
+fmux_message_block(fmux_message* message)
+{
+    return ((fmux_pool_block*)message) - 1;
+}
+
+fmux_message*
+fmux_message_alloc(fmux_handle* handle, uint32_t nbytes)
+{
+    int size_class = 0;
+    while (size_class < FMUX_POOL_CLASSES && fmux_pool_class_size(size_class) < nbytes)
+        size_class++;
+
+    fmux_message_pool* pool = handle->pool;
+    fmux_pool_block* block = NULL;
+    if (size_class < FMUX_POOL_CLASSES) {
+        pthread_mutex_lock(&(pool->lock));
+        block = pool->free[size_class];
+        if (block != NULL) {
+            pool->free[size_class] = block->next;
+            pool->nfree[size_class]--;
+        }
+        pool->outstanding++;
+        pthread_mutex_unlock(&(pool->lock));
+        if (block == NULL) {
+            block = malloc(sizeof(fmux_pool_block) + 2*sizeof(uint32_t) + fmux_pool_class_size(size_class));
+            if (block == NULL) {
+                pthread_mutex_lock(&(pool->lock));
+                pool->outstanding--;
+                pthread_mutex_unlock(&(pool->lock));
+                return NULL;
+            }
+        }
+        block->pool = pool;
+        block->size_class = size_class;
+    } else {
+        //Too big to be worth keeping around
+        block = malloc(sizeof(fmux_pool_block) + 2*sizeof(uint32_t) + nbytes);
+        if (block == NULL) return NULL;
+        block->pool = NULL;
+        block->size_class = -1;
+    }
+    block->next = NULL;
+
+    fmux_message* message = fmux_block_message(block);
+    message->channel_id = 0;
+    message->nbytes = nbytes;
+    return message;
+}
+
+void
+fmux_message_release(fmux_message* message)
+{
+    if (message == NULL) return;
+    fmux_pool_block* block = fmux_message_block(message);
+    fmux_message_pool* pool = block->pool;
+    if (pool == NULL) {
+        free(block);
+        return;
+    }
+
+    pthread_mutex_lock(&(pool->lock));
+    pool->outstanding--;
+    int last = pool->closed && pool->outstanding == 0;
+    if (!pool->closed && pool->nfree[block->size_class] < FMUX_POOL_DEPTH) {
+        block->next = pool->free[block->size_class];
+        pool->free[block->size_class] = block;
+        pool->nfree[block->size_class]++;
+        block = NULL;
+    }
+    pthread_mutex_unlock(&(pool->lock));
+    free(block);
+    if (last) fmux_pool_destroy(pool);
+}
+
+/* PRIVATE */ int
+fmux_message_fits(fmux_message* message, uint32_t nbytes)
+{
+    fmux_pool_block* block = fmux_message_block(message);
+    return block->pool != NULL && fmux_pool_class_size(block->size_class) >= nbytes;
+}
+
+/* Reading */
+
+/* Statistics. Counters are bumped with relaxed atomics wherever the thing
+ * they count happens and copied out one at a time, so they cost next to
+ * nothing and never wait on a lock. For latency, the demuxer notes when each
+ * frame was done and where it ends in the channel's stream; fmux_read times
+ * the frames it reads past. */
+
+void
+fmux_stat_add(uint64_t* counter, uint64_t n)
+{
+    __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+/* PRIVATE */ void
+fmux_stat_copy(uint64_t* dst, uint64_t* src, size_t n)
+{
+    for (size_t i = 0; i < n; i++) dst[i] = __atomic_load_n(&(src[i]), __ATOMIC_RELAXED);
+}
+
+/* PRIVATE */ uint64_t
+fmux_now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* PRIVATE */ void
+fmux_stat_mark(fmux_channel* channel)
+{
+    //The demuxer just finished a frame for the channel. If too many are
+    //waiting to be read already, this one just isn't timed.
+    pthread_mutex_lock(&(channel->lat_lock));
+    if (channel->lat_marks == NULL)
+        channel->lat_marks = malloc(FMUX_LATENCY_MARKS * sizeof(struct fmux_lat_mark));
+    if (channel->lat_marks != NULL && channel->lat_len < FMUX_LATENCY_MARKS) {
+        int i = (channel->lat_head + channel->lat_len) % FMUX_LATENCY_MARKS;
+        channel->lat_marks[i].end = __atomic_load_n(&(channel->stats.bytes_in), __ATOMIC_RELAXED);
+        channel->lat_marks[i].ns = fmux_now_ns();
+        channel->lat_len++;
+    }
+    pthread_mutex_unlock(&(channel->lat_lock));
+}
+
+/* PRIVATE */ void
+fmux_stat_unmark(fmux_channel* channel)
+{
+    pthread_mutex_lock(&(channel->lat_lock));
+    channel->lat_head = channel->lat_len = 0;
+    pthread_mutex_unlock(&(channel->lat_lock));
+}
+
+/* PRIVATE */ void
+fmux_stat_read(fmux_channel* channel, size_t nbyte)
+{
+    //fmux_read returned nbyte bytes of the channel
+    fmux_stat_add(&(channel->stats.reads), 1);
+    uint64_t total = __atomic_add_fetch(&(channel->stats.bytes_read), nbyte, __ATOMIC_RELAXED);
+    fmux_handle* handle = channel->handle;
+    if (handle == NULL || !__atomic_load_n(&(handle->track_latency), __ATOMIC_RELAXED)) return;
+    uint64_t now = 0;
+    pthread_mutex_lock(&(channel->lat_lock));
+    while (channel->lat_len > 0 && channel->lat_marks[channel->lat_head].end <= total) {
+        if (now == 0) now = fmux_now_ns();
+        uint64_t us = (now - channel->lat_marks[channel->lat_head].ns) / 1000;
+        int bucket = (us == 0) ? 0 : 64 - __builtin_clzll(us);
+        if (bucket >= FMUX_LATENCY_BUCKETS) bucket = FMUX_LATENCY_BUCKETS - 1;
+        fmux_stat_add(&(channel->stats.latency[bucket]), 1);
+        fmux_stat_add(&(handle->stats.latency[bucket]), 1);
+        channel->lat_head = (channel->lat_head + 1) % FMUX_LATENCY_MARKS;
+        channel->lat_len--;
+    }
+    pthread_mutex_unlock(&(channel->lat_lock));
+}
+
+/* PRIVATE */ int
+fmux_rx_is_control(fmux_handle* handle)
+{
+    //Whether the frame being demuxed is a control frame
+    return (handle->window && handle->rx_channel == FMUX_CONTROL_CHANNEL) ||
+           handle->rx_channel == FMUX_PROTO_CHANNEL;
+}
+
+/* PRIVATE */ void
+fmux_rx_count(fmux_handle* handle, fmux_channel* channel, size_t nbyte)
+{
+    //The demuxer moved nbyte more of the current frame
+    fmux_stat_add(&(handle->stats.bytes_in), nbyte);
+    if (channel != NULL) fmux_stat_add(&(channel->stats.bytes_in), nbyte);
+    else if (!fmux_rx_is_control(handle)) fmux_stat_add(&(handle->stats.bytes_dropped), nbyte);
+}
+
+/* PRIVATE */ void
+fmux_rx_count_frame(fmux_handle* handle, fmux_channel* channel)
+{
+    //...and finished it
+    fmux_stat_add(&(handle->stats.frames_in), 1);
+    if (channel != NULL) {
+        fmux_stat_add(&(channel->stats.frames_in), 1);
+        if (__atomic_load_n(&(handle->track_latency), __ATOMIC_RELAXED)) fmux_stat_mark(channel);
+    } else if (!fmux_rx_is_control(handle)) {
+        fmux_stat_add(&(handle->stats.frames_dropped), 1);
+    }
+}
+
+int
+fmux_get_stats(fmux_handle* handle, fmux_stats* stats)
+{
+    if (handle == NULL || stats == NULL) return -1;
+    memset(stats, 0, sizeof(*stats));
+    fmux_stat_copy((uint64_t*)stats, (uint64_t*)&(handle->stats),
+                   offsetof(fmux_stats, channels) / sizeof(uint64_t));
+    pthread_mutex_lock(&(handle->chan_lock));
+    stats->channels = handle->nactive;
+    pthread_mutex_unlock(&(handle->chan_lock));
+    stats->backlogged = __atomic_load_n(&(handle->backlogged), __ATOMIC_RELAXED);
+    pthread_mutex_lock(&(handle->out_lock));
+    for (int level = 0; level < FMUX_PRIORITY_LEVELS; level++) {
+        for (fmux_channel* cur = handle->out_head[level]; cur != NULL; cur = cur->out_next)
+            stats->tx_queued++;
+    }
+    pthread_mutex_unlock(&(handle->out_lock));
+    stats->rx_queued = __atomic_load_n(&(handle->rx_inq_len), __ATOMIC_ACQUIRE) +
+                       __atomic_load_n(&(handle->rx_held_bytes), __ATOMIC_ACQUIRE);
+    return 0;
+}
+
+int
+fmux_channel_get_stats(fmux_channel* channel, fmux_channel_stats* stats)
+{
+    if (!fmux_channel_is_good(channel) || stats == NULL) return -1;
+    memset(stats, 0, sizeof(*stats));
+    fmux_stat_copy((uint64_t*)stats, (uint64_t*)&(channel->stats),
+                   offsetof(fmux_channel_stats, rx_queued) / sizeof(uint64_t));
+    if (channel->ring != NULL) {
+        stats->rx_queued = fmux_ring_used(channel->ring);
+    } else {
+        int queued;
+        if (ioctl(channel->sock[0], FIONREAD, &queued) == 0) stats->rx_queued = queued;
+        if (ioctl(channel->sock[1], FIONREAD, &queued) == 0) stats->tx_queued = queued;
+    }
+    stats->rx_backlog = __atomic_load_n(&(channel->backlog_len), __ATOMIC_RELAXED);
+    stats->rx_queued += stats->rx_backlog;
+    stats->tx_credit = __atomic_load_n(&(channel->tx_credit), __ATOMIC_ACQUIRE);
+    return 0;
+}
+
+int
+fmux_set_latency_tracking(fmux_handle* handle, int on)
+{
+    if (handle == NULL) return -1;
+    //Frames noted before a change would be timed wrong, or never
+    pthread_mutex_lock(&(handle->chan_lock));
+    __atomic_store_n(&(handle->track_latency), (on != 0), __ATOMIC_RELAXED);
+    for (int i = 0; i < handle->nactive; i++) fmux_stat_unmark(handle->active[i]);
+    pthread_mutex_unlock(&(handle->chan_lock));
+    return 0;
+}
+
+/* Receive buffer. Reads from the underlying fd go into handle->rx_buf in
+ * chunks as large as the free space allows, and as many frames as it holds
+ * are parsed out of each read. Frames (or parts of frames) that haven't fully
+ * arrived yet simply stay in the buffer until the next read.
+ * Everything here is protected by handle->rx_lock. */
+
+/* PRIVATE */ size_t
+fmux_rx_avail(fmux_handle* handle)
+{
+    return handle->rx_end - handle->rx_start;
+}
+
+/* PRIVATE */ int
+fmux_rx_inq_append(fmux_handle* handle, const char* data, size_t nbyte)
+{
+    //Called by an io_uring pump with what a receive brought in. Returns 1 if
+    //the queue just got too long and receiving should pause until the
+    //demuxer catches up.
+    pthread_mutex_lock(&(handle->rx_inq_lock));
+    size_t len = handle->rx_inq_len;
+    if (handle->rx_inq_start + len + nbyte > handle->rx_inq_cap) {
+        if (len > 0) memmove(handle->rx_inq, handle->rx_inq + handle->rx_inq_start, len);
+        handle->rx_inq_start = 0;
+        if (len + nbyte > handle->rx_inq_cap) {
+            size_t cap = handle->rx_inq_cap ? handle->rx_inq_cap : FMUX_RX_BUFFER;
+            while (cap < len + nbyte) cap *= 2;
+            handle->rx_inq = realloc(handle->rx_inq, cap);
+            handle->rx_inq_cap = cap;
+        }
+    }
+    memcpy(handle->rx_inq + handle->rx_inq_start + len, data, nbyte);
+    __atomic_store_n(&(handle->rx_inq_len), len + nbyte, __ATOMIC_RELEASE);
+    int pause = !handle->rx_inq_paused && len + nbyte > FMUX_URING_INQ_MAX;
+    if (pause) __atomic_store_n(&(handle->rx_inq_paused), 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&(handle->rx_inq_lock));
+    return pause;
+}
+
+/* PRIVATE */ int
+fmux_rx_hold(fmux_handle* handle, fmux_pump* pump, char* data, size_t nbyte, int bid)
+{
+    //Called by an io_uring pump with a buffer a receive filled. Returns 1 if
+    //the handle keeps it for the demuxer to parse in place; otherwise the
+    //pump copies it to rx_inq (which has to go after what's held here).
+    pthread_mutex_lock(&(handle->rx_inq_lock));
+    int nheld = handle->rx_nheld;
+    int keep = nheld < FMUX_URING_HOLD && handle->rx_inq_len == 0 && !handle->rx_inq_eof;
+    if (keep) {
+        struct fmux_rx_held* held = &(handle->rx_held[(handle->rx_held_start + nheld) % FMUX_URING_HOLD]);
+        held->pump = pump;
+        held->data = data;
+        held->len = nbyte;
+        held->bid = bid;
+        __atomic_add_fetch(&(handle->rx_held_bytes), nbyte, __ATOMIC_ACQ_REL);
+        __atomic_store_n(&(handle->rx_nheld), nheld + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&(handle->rx_inq_lock));
+    return keep;
+}
+
+/* PRIVATE */ int
+fmux_rx_unhold(fmux_handle* handle, struct fmux_rx_held* out)
+{
+    //Takes the oldest held buffer; under rx_inq_lock. Returns 0 if there's none.
+    if (handle->rx_nheld == 0) return 0;
+    *out = handle->rx_held[handle->rx_held_start];
+    handle->rx_held_start = (handle->rx_held_start + 1) % FMUX_URING_HOLD;
+    __atomic_sub_fetch(&(handle->rx_held_bytes), out->len, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&(handle->rx_nheld), handle->rx_nheld - 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* PRIVATE */ void
+fmux_rx_spill(fmux_handle* handle)
+{
+    //Copies the held buffers to the front of rx_inq and gives them back, so
+    //that a stalled demuxer (or a handle leaving its pump) doesn't keep them
+    //from the pump's other handles
+    struct fmux_rx_held spilled[FMUX_URING_HOLD];
+    int n = 0;
+    pthread_mutex_lock(&(handle->rx_inq_lock));
+    size_t held = handle->rx_held_bytes, len = handle->rx_inq_len;
+    if (handle->rx_nheld > 0) {
+        if (held + len > handle->rx_inq_cap) {
+            size_t cap = handle->rx_inq_cap ? handle->rx_inq_cap : FMUX_RX_BUFFER;
+            while (cap < held + len) cap *= 2;
+            handle->rx_inq = realloc(handle->rx_inq, cap);
+            handle->rx_inq_cap = cap;
+        }
+        memmove(handle->rx_inq + held, handle->rx_inq + handle->rx_inq_start, len);
+        handle->rx_inq_start = 0;
+        size_t off = 0;
+        while (fmux_rx_unhold(handle, &(spilled[n]))) {
+            memcpy(handle->rx_inq + off, spilled[n].data, spilled[n].len);
+            off += spilled[n++].len;
+        }
+        __atomic_store_n(&(handle->rx_inq_len), len + held, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&(handle->rx_inq_lock));
+    for (int i = 0; i < n; i++) fmux_uring_give_back(spilled[i].pump, spilled[i].bid);
+}
+
+/* PRIVATE */ void
+fmux_rx_inq_eof(fmux_handle* handle)
+{
+    pthread_mutex_lock(&(handle->rx_inq_lock));
+    __atomic_store_n(&(handle->rx_inq_eof), 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&(handle->rx_inq_lock));
+}
+
+/* PRIVATE */ ssize_t
+fmux_rx_read(fmux_handle* handle, void* buf, size_t nbyte)
+{
+    //read() from the underlying fd, except that whatever an io_uring pump
+    //has already received comes first. While the pump is receiving, there is
+    //nothing to read until it queues more (EAGAIN).
+    if (handle->shm_rx != NULL) return fmux_shm_read(handle, buf, nbyte);
+    if (__atomic_load_n(&(handle->rx_nheld), __ATOMIC_ACQUIRE) > 0) {
+        //Copied out of the oldest held buffer, for callers that need the data
+        //somewhere in particular (fmux_service_reads lends them instead)
+        pthread_mutex_lock(&(handle->rx_inq_lock));
+        struct fmux_rx_held* held = &(handle->rx_held[handle->rx_held_start]);
+        struct fmux_rx_held done = {.data = NULL};
+        size_t n = 0;
+        if (handle->rx_nheld > 0) {
+            n = (nbyte < held->len) ? nbyte : held->len;
+            memcpy(buf, held->data, n);
+            held->data += n;
+            held->len -= n;
+            __atomic_sub_fetch(&(handle->rx_held_bytes), n, __ATOMIC_ACQ_REL);
+            if (held->len == 0) fmux_rx_unhold(handle, &done);
+        }
+        pthread_mutex_unlock(&(handle->rx_inq_lock));
+        if (done.data != NULL) fmux_uring_give_back(done.pump, done.bid);
+        if (n > 0 || nbyte == 0) return n;
+    }
+    if (__atomic_load_n(&(handle->rx_uring), __ATOMIC_ACQUIRE) ||
+        __atomic_load_n(&(handle->rx_inq_len), __ATOMIC_ACQUIRE) > 0 ||
+        __atomic_load_n(&(handle->rx_inq_eof), __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&(handle->rx_inq_lock));
+        size_t n = (nbyte < handle->rx_inq_len) ? nbyte : handle->rx_inq_len;
+        if (n > 0) memcpy(buf, handle->rx_inq + handle->rx_inq_start, n);
+        handle->rx_inq_start += n;
+        __atomic_store_n(&(handle->rx_inq_len), handle->rx_inq_len - n, __ATOMIC_RELEASE);
+        if (handle->rx_inq_len == 0) handle->rx_inq_start = 0;
+        int resume = handle->rx_inq_paused && handle->rx_inq_len <= FMUX_URING_INQ_MAX / 2;
+        if (resume) __atomic_store_n(&(handle->rx_inq_paused), 0, __ATOMIC_RELEASE);
+        int eof = handle->rx_inq_eof;
+        pthread_mutex_unlock(&(handle->rx_inq_lock));
+
+        fmux_pump* pump = handle->pump;
+        if (resume && pump != NULL && pump->uring != NULL)
+            fmux_uring_touch(pump, &(handle->watch));
+        if (n > 0) return n;
+        if (eof) return 0;
+        if (__atomic_load_n(&(handle->rx_uring), __ATOMIC_ACQUIRE)) {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+    ssize_t n;
+    do {
+        n = read(handle->fd, buf, nbyte);
+        fmux_stat_add(&(handle->stats.reads), 1);
+    } while (n < 0 && errno == EINTR);
+    return n;
+}
+
+/* PRIVATE */ int
+fmux_rx_ready(fmux_handle* handle)
+{
+    //Whether fmux_rx_read has something (or EOF) to return right away
+    if (handle->shm_rx != NULL) return fmux_shm_ready(handle);
+    if (__atomic_load_n(&(handle->rx_nheld), __ATOMIC_ACQUIRE) > 0 ||
+        __atomic_load_n(&(handle->rx_inq_len), __ATOMIC_ACQUIRE) > 0 ||
+        __atomic_load_n(&(handle->rx_inq_eof), __ATOMIC_ACQUIRE))
+        return 1;
+    if (__atomic_load_n(&(handle->rx_uring), __ATOMIC_ACQUIRE)) return 0;
+    struct pollfd pfd = {.fd = handle->fd, .events = POLLIN };
+    return poll(&pfd, 1, 0) == 1;
+}
+
+/* PRIVATE */ void
+fmux_rx_unlend(fmux_handle* handle)
+{
+    //Back to rx_buf's own memory, with whatever the demuxer left of the lent
+    //buffer (at most one buffer and its headroom, so it fits)
+    if (handle->rx_lent.data == NULL) return;
+    size_t left = fmux_rx_avail(handle);
+    memcpy(handle->rx_own, handle->rx_buf + handle->rx_start, left);
+    fmux_uring_give_back(handle->rx_lent.pump, handle->rx_lent.bid);
+    handle->rx_lent.data = NULL;
+    handle->rx_buf = handle->rx_own;
+    handle->rx_cap = handle->rx_own_cap;
+    handle->rx_start = 0;
+    handle->rx_end = left;
+}
+
+/* PRIVATE */ ssize_t
+fmux_rx_lend(fmux_handle* handle, size_t* asked)
+{
+    //Points rx_buf at the oldest buffer an io_uring pump received into, so
+    //the demuxer parses it where it is instead of copying it into rx_buf.
+    //Whatever is left unparsed goes in the headroom in front of it. Returns
+    //its length, or -2 if there's none or what's left is too long (then
+    //fmux_rx_fill copies it, like before). Only fmux_service_reads lends,
+    //and it calls fmux_rx_unlend before it lets go of rx_lock.
+    size_t left = fmux_rx_avail(handle);
+    if (handle->rx_eof || left > FMUX_URING_HEADROOM ||
+        __atomic_load_n(&(handle->rx_nheld), __ATOMIC_ACQUIRE) == 0)
+        return -2;
+    struct fmux_rx_held held;
+    pthread_mutex_lock(&(handle->rx_inq_lock));
+    int found = fmux_rx_unhold(handle, &held);
+    int more = handle->rx_nheld > 0 || handle->rx_inq_len > 0;
+    pthread_mutex_unlock(&(handle->rx_inq_lock));
+    if (!found) return -2;
+
+    char* start = held.data - left;
+    memcpy(start, handle->rx_buf + handle->rx_start, left);
+    if (handle->rx_lent.data != NULL) {
+        fmux_uring_give_back(handle->rx_lent.pump, handle->rx_lent.bid);
+    } else {
+        handle->rx_own = handle->rx_buf;
+        handle->rx_own_cap = handle->rx_cap;
+    }
+    handle->rx_lent = held;
+    handle->rx_buf = start;
+    handle->rx_start = 0;
+    handle->rx_end = handle->rx_cap = left + held.len;
+    //A short read tells fmux_service_reads there's nothing more to come
+    if (asked != NULL) *asked = more ? held.len : held.len + 1;
+    return held.len;
+}
+
+/* PRIVATE */ int
+fmux_rx_fill(fmux_handle* handle, size_t* asked)
+{
+    //One read into the free space at the end of the buffer. Returns bytes
+    //read, 0 at EOF or -1 on error (including EAGAIN on non-blocking fds).
+    //How much it tried to read goes in *asked, unless that's NULL.
+    if (handle->rx_eof) return 0;
+    fmux_rx_unlend(handle);
+    if (handle->rx_start == handle->rx_end) {
+        handle->rx_start = handle->rx_end = 0;
+    } else if (handle->rx_end == handle->rx_cap) {
+        memmove(handle->rx_buf, handle->rx_buf + handle->rx_start, fmux_rx_avail(handle));
+        handle->rx_end -= handle->rx_start;
+        handle->rx_start = 0;
+    }
+    if (handle->rx_end == handle->rx_cap) { errno = ENOBUFS; return -1; }
+    size_t want = handle->rx_cap - handle->rx_end;
+    //Splicing, stop early enough to see large payloads coming (the end of
+    //a read is usually the start of the next frame)
+    if (handle->rx_pipe[0] >= 0 && want > FMUX_SPLICE_MIN) want = FMUX_SPLICE_MIN;
+    if (asked != NULL) *asked = want;
+    ssize_t n = fmux_rx_read(handle, handle->rx_buf + handle->rx_end, want);
+    if (n == 0) __atomic_store_n(&(handle->rx_eof), 1, __ATOMIC_SEQ_CST);
+    if (n <= 0) return n;
+    handle->rx_end += n;
+    return n;
+}
+
+/* PRIVATE */ ssize_t
+fmux_rx_splice(fmux_handle* handle)
+{
+    //Large payloads for socket channels skip rx_buf: they go from the fd to
+    //the channel through rx_pipe (see fmux_set_splice). Only once everything
+    //buffered has been delivered, so nothing gets ahead of it; the demuxer
+    //finishes the frame as usual. Returns bytes moved, 0 at EOF or -1 on
+    //error, like fmux_rx_fill, or -2 if this has to be read normally.
+    if (handle->rx_pipe[0] < 0 || !handle->rx_in_frame || fmux_rx_avail(handle) > 0 ||
+        handle->rx_remaining < FMUX_SPLICE_MIN || handle->window || handle->rx_eof ||
+        fmux_capturing(handle) ||
+        __atomic_load_n(&(handle->rx_uring), __ATOMIC_ACQUIRE) ||
+        __atomic_load_n(&(handle->rx_inq_len), __ATOMIC_ACQUIRE) > 0)
+        return -2;
+    fmux_channel* channel = fmux_channel_lookup(handle, handle->rx_channel);
+    if (channel == NULL || channel->ring != NULL || channel->type == FMUX_CHANTYPE_BIN) return -2;
+
+    size_t want = (handle->rx_remaining < handle->pipe_cap) ? handle->rx_remaining : handle->pipe_cap;
+    ssize_t n;
+    do {
+        n = splice(handle->fd, NULL, handle->rx_pipe[1], NULL, want, SPLICE_F_MOVE);
+        fmux_stat_add(&(handle->stats.reads), 1);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && errno == EINVAL) {
+        //Not something splice works on after all
+        fmux_splice_close(handle->rx_pipe);
+        return -2;
+    }
+    if (n == 0) __atomic_store_n(&(handle->rx_eof), 1, __ATOMIC_SEQ_CST);
+    if (n <= 0) return n;
+    if (fmux_splice_fully(handle->rx_pipe[0], channel->sock[1], n, NULL) < 0) return -1;
+    fmux_rx_count(handle, channel, n);
+    handle->rx_remaining -= n;
+    return n;
+}
+
+/* Frame headers. v1 is the channel id and the payload length as big-endian
+ * uint32s. v2 (see fmux_open_v2) is each as a little-endian base 128 varint,
+ * so small frames on low channels cost 2 bytes instead of 8. A varint may be
+ * padded out with continuation bytes, which lets a header be written ahead
+ * of a payload whose exact length isn't known yet. */
+
+/* PRIVATE */ int
+fmux_has_control(fmux_handle* handle)
+{
+    //Whether frames on FMUX_CONTROL_CHANNEL are for the library
+    return handle->window;
+}
+
+/* PRIVATE */ size_t
+fmux_varint_len(uint32_t value)
+{
+    size_t n = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        n++;
+    }
+    return n;
+}
+
+/* PRIVATE */ size_t
+fmux_header_len(fmux_handle* handle, uint32_t channel_id, uint32_t most)
+{
+    //Of the header for a payload of up to most bytes; under lock
+    if (!handle->tx_v2) return 2 * sizeof(uint32_t);
+    return fmux_varint_len(channel_id) + fmux_varint_len(most);
+}
+
+/* PRIVATE */ size_t
+fmux_header_put(fmux_handle* handle, char* buf, uint32_t channel_id, uint32_t nbytes, uint32_t most)
+{
+    //Writes the header into buf (FMUX_HEADER_MAX bytes), the same length as
+    //for a payload of most bytes. Returns its length. Under lock.
+    if (!handle->tx_v2) {
+        uint32_t header[2] = { htonl(channel_id), htonl(nbytes) };
+        memcpy(buf, header, sizeof(header));
+        return sizeof(header);
+    }
+    uint32_t values[2] = { channel_id, nbytes };
+    size_t widths[2] = { fmux_varint_len(channel_id), fmux_varint_len(most) };
+    size_t n = 0;
+    for (int k = 0; k < 2; k++) {
+        for (size_t i = 1; i < widths[k]; i++) {
+            buf[n++] = (char)(0x80 | (values[k] & 0x7f));
+            values[k] >>= 7;
+        }
+        buf[n++] = (char)values[k];
+    }
+    return n;
+}
+
+/* PRIVATE */ int
+fmux_rx_header(fmux_handle* handle)
+{
+    //Start a new frame if a whole header is buffered. Returns 1 if it did.
+    if (handle->rx_v2) {
+        const unsigned char* p = (const unsigned char*)handle->rx_buf + handle->rx_start;
+        size_t avail = fmux_rx_avail(handle), off = 0;
+        uint32_t values[2] = {0, 0};
+        for (int k = 0; k < 2; k++) {
+            for (int shift = 0;; shift += 7) {
+                if (off == avail) return 0;
+                if (shift > 28) {
+                    //Garbage; nothing after it can be trusted
+                    __atomic_store_n(&(handle->rx_eof), 1, __ATOMIC_SEQ_CST);
+                    return 0;
+                }
+                values[k] |= (uint32_t)(p[off] & 0x7f) << shift;
+                if (!(p[off++] & 0x80)) break;
+            }
+        }
+        handle->rx_start += off;
+        handle->rx_channel = values[0];
+        handle->rx_remaining = values[1];
+        handle->rx_frame_len = handle->rx_remaining;
+        handle->rx_in_frame = 1;
+        return 1;
+    }
+    if (fmux_rx_avail(handle) < 8) return 0;
+    uint32_t header[2];
+    memcpy(header, handle->rx_buf + handle->rx_start, sizeof(header));
+    handle->rx_start += sizeof(header);
+    handle->rx_channel = ntohl(header[0]);
+    handle->rx_remaining = ntohl(header[1]);
+    handle->rx_frame_len = handle->rx_remaining;
+    handle->rx_in_frame = 1;
+    return 1;
+}
+
+/* PRIVATE */ int
+fmux_pop_locked(fmux_handle* handle, fmux_message** message, int pooled)
+{
+    //Blocks until a whole frame is available. If fmux_flush_reads already
+    //delivered the front of the current frame, the rest of it is returned.
+    for (;;) {
+        while (!handle->rx_in_frame && !fmux_rx_header(handle)) {
+            int n = fmux_rx_fill(handle, NULL);
+            if (n <= 0) return n;
+        }
+        //Negotiation frames are for us, and never handed out
+        if (handle->rx_channel != FMUX_PROTO_CHANNEL) break;
+        while (fmux_rx_avail(handle) < handle->rx_remaining && handle->rx_remaining <= FMUX_CTL_MAX) {
+            int n = fmux_rx_fill(handle, NULL);
+            if (n <= 0) return n;
+        }
+        if (handle->rx_remaining <= FMUX_CTL_MAX)
+            fmux_rx_control(handle, handle->rx_buf + handle->rx_start, handle->rx_remaining);
+        while (handle->rx_remaining > 0) {
+            size_t chunk = fmux_rx_avail(handle);
+            if (chunk > handle->rx_remaining) chunk = handle->rx_remaining;
+            if (chunk == 0) {
+                int n = fmux_rx_fill(handle, NULL);
+                if (n <= 0) return n;
+                continue;
+            }
+            fmux_capture_rx(handle, handle->rx_buf + handle->rx_start, chunk);
+            handle->rx_start += chunk;
+            handle->rx_remaining -= chunk;
+        }
+        handle->rx_in_frame = 0;
+    }
+
+    uint32_t len = handle->rx_remaining;
+    if (!pooled) {
+        *message = realloc(*message, len + 2*sizeof(uint32_t));
+    } else if (*message == NULL || !fmux_message_fits(*message, len)) {
+        fmux_message_release(*message);
+        *message = fmux_message_alloc(handle, len);
+    }
+    if (*message == NULL) return -1;
+    (*message)->channel_id = handle->rx_channel;
+    (*message)->nbytes = len;
+
+    //Whatever is buffered, then straight from the fd into the message
+    size_t have = fmux_rx_avail(handle);
+    if (have > len) have = len;
+    memcpy((*message)->data, handle->rx_buf + handle->rx_start, have);
+    handle->rx_start += have;
+    while (have < len) {
+        ssize_t n = fmux_rx_read(handle, (*message)->data + have, len - have);
+        if (n <= 0) {
+            if (n == 0) handle->rx_eof = 1;
+            //The frame is lost either way; keep the stream in sync
+            handle->rx_remaining = len - have;
+            return -1;
+        }
+        have += n;
+    }
+    fmux_capture_rx(handle, (*message)->data, len);
+    handle->rx_in_frame = 0;
+    handle->rx_remaining = 0;
+    fmux_stat_add(&(handle->stats.frames_in), 1);
+    fmux_stat_add(&(handle->stats.bytes_in), len);
+    return 1;
+}
+
+int
+fmux_pop(fmux_handle* handle, fmux_message** message)
+{
+    if (pthread_mutex_lock(&(handle->rx_lock)) != 0) return -1;
+    int ret = fmux_pop_locked(handle, message, 0);
+    pthread_mutex_unlock(&(handle->rx_lock));
+    fmux_proto_check(handle);
+    return ret;
+}
+
+int
+fmux_pop_pooled(fmux_handle* handle, fmux_message** message)
+{
+    if (pthread_mutex_lock(&(handle->rx_lock)) != 0) return -1;
+    int ret = fmux_pop_locked(handle, message, 1);
+    pthread_mutex_unlock(&(handle->rx_lock));
+    fmux_proto_check(handle);
+    return ret;
+}
+
+/* PRIVATE */ void
+fmux_rx_eof_notify(fmux_handle* handle)
+{
+    //Readers blocked on ring channels won't get anything else
+    __atomic_store_n(&(handle->rx_eof), 1, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < handle->nactive; i++) {
+        fmux_channel* channel = handle->active[i];
+        if (channel->ring != NULL)
+            fmux_ring_notify(channel->ring);
+    }
+    //Neither will writers waiting on credit
+    pthread_mutex_lock(&(handle->credit_lock));
+    pthread_cond_broadcast(&(handle->credit_cond));
+    pthread_mutex_unlock(&(handle->credit_lock));
+}
+
+/* Flow control. With a window set, the demuxer never blocks on a channel:
+ * whatever a channel has no room for goes to its backlog, which stays small
+ * because the peer only sends what it has credit for. Credit goes back to the
+ * peer in FMUX_CTL_WINDOW frames as the application reads. */
+
+/* PRIVATE */ int
+fmux_send_window(fmux_handle* handle, uint32_t (*updates)[2], int n)
+{
+    char payload[FMUX_CTL_MAX];
+    payload[0] = FMUX_CTL_WINDOW;
+    for (int i = 0; i < n; i++) {
+        uint32_t pair[2] = { htonl(updates[i][0]), htonl(updates[i][1]) };
+        memcpy(payload + 1 + i * sizeof(pair), pair, sizeof(pair));
+    }
+    struct iovec iov = {.iov_base = payload, .iov_len = 1 + n * 2 * sizeof(uint32_t)};
+    if (pthread_mutex_lock(&(handle->lock)) != 0) return -1;
+    int err = fmux_send_frame_locked(handle, FMUX_CONTROL_CHANNEL, &iov, 1);
+    //Credit doesn't wait for cork mode; the peer's writers might be stuck
+    if (err >= 0 && fmux_tx_flush_locked(handle) < 0) err = -1;
+    fmux_tx_unlock(handle);
+    return err;
+}
+
+/* PRIVATE */ void
+fmux_proto_check(fmux_handle* handle)
+{
+    //Once the peer's hello is in, our headers switch to v2, starting right
+    //after a marker frame (sent v1) so the peer knows where. Called without
+    //rx_lock, since it takes lock.
+    if (!__atomic_exchange_n(&(handle->proto_upgrade), 0, __ATOMIC_ACQ_REL)) return;
+    if (pthread_mutex_lock(&(handle->lock)) != 0) return;
+    if (!handle->tx_v2) {
+        char marker = FMUX_CTL_V2;
+        struct iovec iov = {.iov_base = &marker, .iov_len = 1};
+        if (fmux_send_frame_locked(handle, FMUX_PROTO_CHANNEL, &iov, 1) >= 0)
+            handle->tx_v2 = 1;
+    }
+    fmux_tx_unlock(handle);
+}
+
+/* PRIVATE */ void
+fmux_rx_queue_credit(fmux_handle* handle, uint32_t channel_id, uint32_t increment)
+{
+    //Collected under rx_lock; fmux_service_reads sends them once it lets go
+    if (handle->nacks > 0 && handle->acks[handle->nacks - 1][0] == channel_id) {
+        handle->acks[handle->nacks - 1][1] += increment;
+        return;
+    }
+    if (handle->nacks == FMUX_CTL_UPDATES) {
+        fmux_send_window(handle, handle->acks, handle->nacks);
+        handle->nacks = 0;
+    }
+    handle->acks[handle->nacks][0] = channel_id;
+    handle->acks[handle->nacks][1] = increment;
+    handle->nacks++;
+}
+
+/* PRIVATE */ uint32_t
+fmux_credit_due(fmux_channel* channel)
+{
+    //Claims whatever the application has read since credit was last given
+    //back, once that's at least half a window. Safe from any thread.
+    uint32_t window = channel->handle->window;
+    uint64_t acked = __atomic_load_n(&(channel->rx_acked), __ATOMIC_ACQUIRE);
+    uint64_t consumed;
+    if (channel->ring != NULL) {
+        //Exact, and may be ahead of rx_total for a moment
+        consumed = __atomic_load_n(&(channel->ring->tail), __ATOMIC_ACQUIRE);
+    } else if (channel->type == FMUX_CHANTYPE_BIN) {
+        //(FIONREAD only sees the next message)
+        consumed = __atomic_load_n(&(channel->msg_consumed), __ATOMIC_ACQUIRE);
+    } else {
+        //Whatever isn't sitting in sock[0] anymore has been read. Check that
+        //enough could have been before making the syscall.
+        uint64_t total = __atomic_load_n(&(channel->rx_total), __ATOMIC_ACQUIRE);
+        if (total - acked < window / 2) return 0;
+        int queued;
+        if (ioctl(channel->sock[0], FIONREAD, &queued) < 0) return 0;
+        if ((uint64_t)queued > total - acked) return 0;
+        consumed = total - queued;
+    }
+    if (consumed - acked < window / 2) return 0;
+    if (!__atomic_compare_exchange_n(&(channel->rx_acked), &acked, consumed, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return 0; //Somebody else just claimed it
+    return consumed - acked;
+}
+
+/* PRIVATE */ void
+fmux_return_credit(fmux_channel* channel)
+{
+    //After the application read from the channel
+    fmux_handle* handle = channel->handle;
+    if (handle == NULL || handle->window == 0) return;
+    uint32_t update[1][2] = {{ channel->id, fmux_credit_due(channel) }};
+    if (update[0][1] > 0) fmux_send_window(handle, update, 1);
+}
+
+/* PRIVATE */ void
+fmux_rx_watch_credit(fmux_handle* handle, fmux_channel* channel)
+{
+    //Keep an eye on channels with a backlog to move, and on sockets with
+    //enough outstanding for credit to be due once they're read. Those may be
+    //read through their fd at any time, where fmux_read can't see it.
+    uint64_t unacked = __atomic_load_n(&(channel->rx_total), __ATOMIC_ACQUIRE) -
+                       __atomic_load_n(&(channel->rx_acked), __ATOMIC_ACQUIRE);
+    int watch = channel->backlog_len > 0 ||
+                (channel->ring == NULL && unacked >= handle->window / 2);
+    if (watch == channel->credit_watch) return;
+    __atomic_store_n(&(channel->credit_watch), watch, __ATOMIC_RELAXED);
+    handle->credit_watches += watch ? 1 : -1;
+    fmux_pump_watch_credit(handle, channel);
+}
+
+/* PRIVATE */ size_t
+fmux_rx_put(fmux_channel* channel, const char* data, size_t nbyte)
+{
+    //As much of data as the channel will take without blocking
+    size_t n = 0;
+    if (channel->ring != NULL) {
+        n = fmux_ring_push(channel->ring, data, nbyte);
+        if (n > 0) fmux_select_mark(channel);
+    } else {
+        while (n < nbyte) {
+            ssize_t w = write(channel->sock[1], data + n, nbyte - n);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) break;
+            n += w;
+        }
+    }
+    __atomic_add_fetch(&(channel->rx_total), n, __ATOMIC_ACQ_REL);
+    return n;
+}
+
+/* PRIVATE */ void
+fmux_rx_backlog(fmux_handle* handle, fmux_channel* channel, const char* data, size_t nbyte)
+{
+    if (channel->backlog_len + nbyte > channel->backlog_cap) {
+        size_t cap = channel->backlog_cap ? channel->backlog_cap : handle->window;
+        while (cap < channel->backlog_len + nbyte) cap *= 2;
+        char* backlog = realloc(channel->backlog, cap);
+        if (backlog == NULL) { perror("Growing channel backlog"); return; }
+        channel->backlog = backlog;
+        channel->backlog_cap = cap;
+    }
+    if (channel->backlog_len == 0) __atomic_add_fetch(&(handle->backlogged), 1, __ATOMIC_RELAXED);
+    memcpy(channel->backlog + channel->backlog_len, data, nbyte);
+    __atomic_store_n(&(channel->backlog_len), channel->backlog_len + nbyte, __ATOMIC_RELAXED);
+}
+
+/* PRIVATE */ int
+fmux_rx_send_msg(fmux_channel* channel, const char* data, size_t nbyte)
+{
+    //One message into a message channel's socket, whole or not at all.
+    //Returns 0 if there was no room for it.
+    ssize_t n;
+    do {
+        n = send(channel->sock[1], data, nbyte, MSG_NOSIGNAL | MSG_DONTWAIT);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    //(Anything else, the reader is gone; the message is as good as delivered)
+    __atomic_add_fetch(&(channel->rx_total), nbyte, __ATOMIC_ACQ_REL);
+    return 1;
+}
+
+/* PRIVATE */ size_t
+fmux_rx_put_msgs(fmux_channel* channel, const char* data, size_t nbyte)
+{
+    //fmux_rx_put for a message channel's backlog, which holds each message
+    //behind its length (a uint32). Returns the bytes of whole records taken.
+    size_t off = 0;
+    while (off + sizeof(uint32_t) <= nbyte) {
+        uint32_t len;
+        memcpy(&len, data + off, sizeof(len));
+        if (!fmux_rx_send_msg(channel, data + off + sizeof(len), len)) break;
+        off += sizeof(len) + len;
+    }
+    return off;
+}
+
+/* PRIVATE */ void
+fmux_rx_flush_backlogs(fmux_handle* handle)
+{
+    for (int i = 0; i < handle->nactive; i++) {
+        fmux_channel* channel = handle->active[i];
+        if (channel->backlog_len == 0) continue;
+        size_t n = (channel->type == FMUX_CHANTYPE_BIN) ?
+                   fmux_rx_put_msgs(channel, channel->backlog, channel->backlog_len) :
+                   fmux_rx_put(channel, channel->backlog, channel->backlog_len);
+        __atomic_store_n(&(channel->backlog_len), channel->backlog_len - n, __ATOMIC_RELAXED);
+        memmove(channel->backlog, channel->backlog + n, channel->backlog_len);
+        if (channel->backlog_len == 0) __atomic_sub_fetch(&(handle->backlogged), 1, __ATOMIC_RELAXED);
+        fmux_rx_watch_credit(handle, channel);
+    }
+}
+
+/* PRIVATE */ void
+fmux_rx_check_credit(fmux_handle* handle)
+{
+    //See whether the application got around to reading the channels we're
+    //watching through their fds
+    for (int i = 0; i < handle->nactive; i++) {
+        fmux_channel* channel = handle->active[i];
+        if (!channel->credit_watch) continue;
+        uint32_t due = fmux_credit_due(channel);
+        if (due > 0) fmux_rx_queue_credit(handle, channel->id, due);
+        fmux_rx_watch_credit(handle, channel);
+    }
+}
+
+/* PRIVATE */ void
+fmux_add_credit(fmux_handle* handle, uint32_t channel_id, uint32_t increment)
+{
+    fmux_channel* channel = fmux_channel_lookup(handle, channel_id);
+    if (channel == NULL) return;
+    __atomic_add_fetch(&(channel->tx_credit), increment, __ATOMIC_ACQ_REL);
+    pthread_mutex_lock(&(handle->credit_lock));
+    pthread_cond_broadcast(&(handle->credit_cond));
+    pthread_mutex_unlock(&(handle->credit_lock));
+    //Data the application wrote to the channel fd may be waiting on this
+    if (channel->fd_out) fmux_kick_writes(channel->link, channel);
+}
+
+/* PRIVATE */ void
+fmux_rx_control(fmux_handle* handle, const char* data, uint32_t nbyte)
+{
+    if (nbyte < 1) return;
+    if (data[0] == FMUX_CTL_HELLO) {
+        //Answered once rx_lock is let go; see fmux_proto_check
+        if (nbyte >= 2 && data[1] >= FMUX_PROTO_V2 && handle->proto_offered)
+            __atomic_store_n(&(handle->proto_upgrade), 1, __ATOMIC_RELEASE);
+        return;
+    }
+    if (data[0] == FMUX_CTL_V2) {
+        if (handle->proto_offered) handle->rx_v2 = 1;
+        return;
+    }
+    //Unknown; ignore it
+    if (data[0] != FMUX_CTL_WINDOW || handle->rx_channel != FMUX_CONTROL_CHANNEL) return;
+    for (uint32_t off = 1; off + 2 * sizeof(uint32_t) <= nbyte; off += 2 * sizeof(uint32_t)) {
+        uint32_t pair[2];
+        memcpy(pair, data + off, sizeof(pair));
+        fmux_add_credit(handle, ntohl(pair[0]), ntohl(pair[1]));
+    }
+}
+
+/* PRIVATE */ void
+fmux_rx_message(fmux_handle* handle, fmux_channel* channel, size_t chunk)
+{
+    //A chunk of a frame for a message channel. The whole frame goes into
+    //sock[1] as one record, straight from rx_buf if it's all there, or else
+    //once msg_buf has all of it. Empty and oversized frames are dropped.
+    const char* data = handle->rx_buf + handle->rx_start;
+    if (handle->rx_frame_len == 0 || handle->rx_frame_len > FMUX_MSG_MAX) {
+        if (handle->window && chunk > 0) fmux_rx_queue_credit(handle, channel->id, chunk);
+        return;
+    }
+    if (chunk < handle->rx_remaining || channel->msg_len > 0) {
+        if (channel->msg_cap < handle->rx_frame_len) {
+            char* buf = realloc(channel->msg_buf, handle->rx_frame_len);
+            if (buf == NULL) { perror("Growing message buffer"); return; }
+            channel->msg_buf = buf;
+            channel->msg_cap = handle->rx_frame_len;
+        }
+        memcpy(channel->msg_buf + channel->msg_len, data, chunk);
+        channel->msg_len += chunk;
+        if (chunk < handle->rx_remaining) return;
+        data = channel->msg_buf;
+        channel->msg_len = 0;
+    }
+    //A record can't be written in pieces. With flow control, one that
+    //doesn't fit (or anything behind a backlog) waits in the backlog, like
+    //stream data, so the demuxer never blocks on the channel; without it,
+    //wait for room for all of it.
+    uint32_t len = handle->rx_frame_len;
+    if (handle->window) {
+        if (channel->backlog_len > 0 || !fmux_rx_send_msg(channel, data, len)) {
+            char* record = malloc(sizeof(len) + len);
+            if (record == NULL) { perror("Backlogging message"); return; }
+            memcpy(record, &len, sizeof(len));
+            memcpy(record + sizeof(len), data, len);
+            fmux_rx_backlog(handle, channel, record, sizeof(len) + len);
+            free(record);
+        }
+        fmux_rx_watch_credit(handle, channel);
+        return;
+    }
+    while (!fmux_rx_send_msg(channel, data, len)) {
+        struct pollfd pfd = {.fd = channel->sock[1], .events = POLLOUT};
+        poll(&pfd, 1, -1);
+    }
+}
+
+/* PRIVATE */ void
+fmux_rx_flush_out(fmux_handle* handle)
+{
+    //Writes what fmux_rx_deliver gathered for socket channels, one writev
+    //per channel, in the order it arrived
+    struct iovec iov[FMUX_BATCH_IOV];
+    for (int i = 0; i < handle->rx_nout; i++) {
+        fmux_channel* channel = handle->rx_out[i].channel;
+        if (channel == NULL) continue;
+        int n = 0;
+        for (int j = i; j < handle->rx_nout; j++) {
+            if (handle->rx_out[j].channel != channel) continue;
+            iov[n++] = handle->rx_out[j].iov;
+            handle->rx_out[j].channel = NULL;
+        }
+        fmux_writev_fully(channel->sock[1], iov, n, &(handle->stats.deliveries));
+    }
+    handle->rx_nout = 0;
+}
+
+/* PRIVATE */ int
+fmux_rx_deliver(fmux_handle* handle)
+{
+    //Hand everything buffered to the channels it belongs to. Payloads are
+    //streamed, so a frame doesn't have to fit in the buffer. Returns the
+    //number of frames completed for open channels.
+    int m_read = 0;
+    while (handle->rx_in_frame || fmux_rx_header(handle)) {
+        size_t chunk = fmux_rx_avail(handle);
+        if (chunk > handle->rx_remaining) chunk = handle->rx_remaining;
+        if (chunk == 0 && handle->rx_remaining > 0) break;
+
+        fmux_channel* channel = NULL;
+        if (fmux_rx_is_control(handle)) {
+            //Control frames are acted on whole; anything too big is junk
+            if (handle->rx_remaining <= FMUX_CTL_MAX) {
+                if (fmux_rx_avail(handle) < handle->rx_remaining) break;
+                fmux_rx_control(handle, handle->rx_buf + handle->rx_start, handle->rx_remaining);
+                chunk = handle->rx_remaining;
+            }
+        } else {
+            channel = fmux_channel_lookup(handle, handle->rx_channel);
+        }
+        //Frames for channels we don't have open are silently dropped
+        if (channel == NULL && handle->window && chunk > 0 && !fmux_rx_is_control(handle)) {
+            //...and the sender gets its credit back right away
+            fmux_rx_queue_credit(handle, handle->rx_channel, chunk);
+        } else if (channel != NULL && channel->type == FMUX_CHANTYPE_BIN) {
+            fmux_rx_message(handle, channel, chunk);
+        } else if (channel != NULL && handle->window) {
+            //Behind a backlog, everything goes to the backlog to keep order
+            const char* data = handle->rx_buf + handle->rx_start;
+            size_t put = (channel->backlog_len > 0) ? 0 : fmux_rx_put(channel, data, chunk);
+            if (put < chunk) fmux_rx_backlog(handle, channel, data + put, chunk - put);
+            fmux_rx_watch_credit(handle, channel);
+        } else if (channel != NULL && channel->ring != NULL) {
+            //Never block on a full ring; pick up here once it's been read
+            size_t pushed = fmux_ring_push(channel->ring, handle->rx_buf + handle->rx_start, chunk);
+            if (pushed > 0) fmux_select_mark(channel);
+            if (pushed < chunk) {
+                fmux_capture_rx(handle, handle->rx_buf + handle->rx_start, pushed);
+                fmux_rx_count(handle, channel, pushed);
+                handle->rx_start += pushed;
+                handle->rx_remaining -= pushed;
+                //The reader kicks us if it sees this flag after making room;
+                //if it made room before we set it, we have to notice here.
+                __atomic_store_n(&(handle->rx_stalled), 1, __ATOMIC_SEQ_CST);
+                if (fmux_ring_used(channel->ring) <= channel->ring->mask) {
+                    __atomic_store_n(&(handle->rx_stalled), 0, __ATOMIC_SEQ_CST);
+                    continue;
+                }
+                break;
+            }
+        } else if (channel != NULL && chunk > 0) {
+            //rx_buf stays put until we return
+            if (handle->rx_nout == FMUX_BATCH_IOV) fmux_rx_flush_out(handle);
+            struct fmux_rx_out* out = &(handle->rx_out[handle->rx_nout++]);
+            out->channel = channel;
+            out->iov.iov_base = handle->rx_buf + handle->rx_start;
+            out->iov.iov_len = chunk;
+        }
+        fmux_capture_rx(handle, handle->rx_buf + handle->rx_start, chunk);
+        fmux_rx_count(handle, channel, chunk);
+        handle->rx_start += chunk;
+        handle->rx_remaining -= chunk;
+        if (handle->rx_remaining == 0) {
+            handle->rx_in_frame = 0;
+            fmux_rx_count_frame(handle, channel);
+            if (channel != NULL) m_read++;
+        }
+    }
+    fmux_rx_flush_out(handle);
+    return m_read;
+}
+
+/* PRIVATE */ int
+fmux_service_reads(fmux_handle* handle, int readable)
+{
+    //Pump threads in a pool may race each other (and fmux_read) here
+    if (pthread_mutex_lock(&(handle->rx_lock)) != 0) return -1;
+
+    __atomic_store_n(&(handle->rx_stalled), 0, __ATOMIC_SEQ_CST);
+    if (handle->window) {
+        if (__atomic_load_n(&(handle->backlogged), __ATOMIC_RELAXED) > 0)
+            fmux_rx_flush_backlogs(handle);
+        if (handle->credit_watches > 0)
+            fmux_rx_check_credit(handle);
+    }
+    int m_read = fmux_rx_deliver(handle);
+    //Unless the pump has told us the fd is readable, check first, since the
+    //fd is usually blocking. With shared memory, the fd being readable only
+    //means a doorbell rang, maybe for data that was read already.
+    if (handle->shm_rx != NULL) readable = 0;
+    if (!handle->rx_eof && !handle->rx_stalled && (readable || fmux_rx_ready(handle))) {
+        int n;
+        //A short read means the fd has been drained (which is also all
+        //edge-triggered epoll needs before it will report it again). After
+        //a full one, there may be nothing left, and reading a blocking fd
+        //again would wait for the peer.
+        do {
+            //(Splices come up short whenever the pipe fills)
+            size_t asked = 0;
+            ssize_t got = fmux_rx_lend(handle, &asked);
+            if (got == -2) got = fmux_rx_splice(handle);
+            n = (got == -2) ? fmux_rx_fill(handle, &asked) : got;
+            m_read += fmux_rx_deliver(handle);
+            if (n > 0 && (size_t)n < asked) break;
+        } while (n > 0 && !handle->rx_stalled && fmux_rx_ready(handle));
+        if (n == 0) fmux_rx_eof_notify(handle);
+    }
+    fmux_rx_unlend(handle);
+    //Until a reader makes room, whatever the pump receives waits in rx_inq
+    if (handle->rx_stalled) fmux_rx_spill(handle);
+
+    //Credit goes out after letting go of the link's read side
+    uint32_t acks[FMUX_CTL_UPDATES][2];
+    int nacks = handle->nacks;
+    memcpy(acks, handle->acks, nacks * sizeof(acks[0]));
+    handle->nacks = 0;
+    pthread_mutex_unlock(&(handle->rx_lock));
+    if (nacks > 0) fmux_send_window(handle, acks, nacks);
+    fmux_proto_check(handle);
+    return m_read;
+}
+
+/* PRIVATE */ int
+fmux_flush_reads(fmux_handle* handle)
+{
+    int m_read = 0;
+    for (int i = 0; i < __atomic_load_n(&(handle->nlinks), __ATOMIC_ACQUIRE); i++) {
+        int n = fmux_service_reads(handle->links[i], 0);
+        if (n > 0) m_read += n;
+    }
+    return m_read;
+}
+
+/* PRIVATE */ int
+fmux_rx_any_stalled(fmux_handle* handle)
+{
+    for (int i = 0; i < __atomic_load_n(&(handle->nlinks), __ATOMIC_ACQUIRE); i++) {
+        if (__atomic_load_n(&(handle->links[i]->rx_stalled), __ATOMIC_SEQ_CST)) return 1;
+    }
+    return 0;
+}
+
+/* PRIVATE */ int
+fmux_rx_wait_links(fmux_handle* handle)
+{
+    //Blocks until one of the links has something to read
+    struct pollfd pfds[FMUX_MAX_LINKS];
+    int n = __atomic_load_n(&(handle->nlinks), __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n; i++) {
+        if (fmux_rx_ready(handle->links[i])) return 0;
+        pfds[i].fd = handle->links[i]->fd;
+        pfds[i].events = POLLIN;
+    }
+    return (poll(pfds, n, -1) < 0 && errno != EINTR) ? -1 : 0;
+}
+
+/* Readiness for fmux_select. Socket channels stay registered with a per-handle
+ * epoll set from the first call on, so a call costs as much as the number of
+ * ready channels rather than the number of channels (and any fd number
+ * works, unlike with an fd_set). Ring channels have no fd to watch; the
+ * demuxer queues them on sel_head instead, and wakes a blocked selector
+ * through sel_evfd. */
+
+void
+fmux_select_watch(fmux_handle* handle, fmux_channel* channel)
+{
+    //Holding chan_lock
+    if (handle->sel_epfd < 0 || channel->sock[0] < 0) return;
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = channel};
+    epoll_ctl(handle->sel_epfd, EPOLL_CTL_ADD, channel->sock[0], &ev);
+}
+
+/* PRIVATE */ int
+fmux_select_queue(fmux_handle* handle, fmux_channel* channel)
+{
+    //Returns 1 if it wasn't queued already
+    if (__atomic_exchange_n(&(channel->sel_queued), 1, __ATOMIC_SEQ_CST)) return 0;
+    pthread_mutex_lock(&(handle->sel_lock));
+    channel->sel_next = handle->sel_head;
+    handle->sel_head = channel;
+    pthread_mutex_unlock(&(handle->sel_lock));
+    return 1;
+}
+
+void
+fmux_select_mark(fmux_channel* channel)
+{
+    fmux_handle* handle = channel->handle;
+    if (fmux_select_queue(handle, channel) &&
+        __atomic_load_n(&(handle->sel_waiting), __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        write(handle->sel_evfd, &one, sizeof(one));
+    }
+}
+
+/* PRIVATE */ int
+fmux_select_init(fmux_handle* handle)
+{
+    pthread_mutex_lock(&(handle->chan_lock));
+    if (handle->sel_epfd >= 0) {
+        pthread_mutex_unlock(&(handle->chan_lock));
+        return 0;
+    }
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        pthread_mutex_unlock(&(handle->chan_lock));
+        return -1;
+    }
+    handle->sel_evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    epoll_ctl(epfd, EPOLL_CTL_ADD, handle->sel_evfd, &ev);
+    handle->sel_epfd = epfd;
+    for (int i = 0; i < handle->nactive; i++)
+        fmux_select_watch(handle, handle->active[i]);
+    pthread_mutex_unlock(&(handle->chan_lock));
+    return 0;
+}
+
+/* PRIVATE */ int
+fmux_select_rings(fmux_handle* handle, fmux_channel** ready, int j)
+{
+    //Queued ring channels that still have data. Each is unqueued before
+    //looking, so data pushed meanwhile queues it again.
+    pthread_mutex_lock(&(handle->sel_lock));
+    fmux_channel* cur = handle->sel_head;
+    handle->sel_head = NULL;
+    pthread_mutex_unlock(&(handle->sel_lock));
+    while (cur != NULL) {
+        fmux_channel* channel = cur;
+        cur = cur->sel_next;
+        __atomic_store_n(&(channel->sel_queued), 0, __ATOMIC_SEQ_CST);
+        //Closed channels are left off for good
+        if (channel->handle != handle || fmux_ring_used(channel->ring) == 0) continue;
+        //Still ready until it's read
+        fmux_select_queue(handle, channel);
+        if (ready != NULL) ready[j] = channel;
+        j++;
+    }
+    return j;
+}
+
+/* PRIVATE */ int
+fmux_channel_cmp(const void* a, const void* b)
+{
+    uint32_t x = (*(fmux_channel* const*)a)->id, y = (*(fmux_channel* const*)b)->id;
+    return (x > y) - (x < y);
+}
+
+int
+fmux_select(fmux_handle* handle, fmux_channel** ready, struct timeval *restrict timeout)
+{
+    if (handle->sync_read)
+        fmux_flush_reads(handle);
+    if (handle->sel_epfd < 0 && fmux_select_init(handle) < 0) return -1;
+
+    int ms = -1;
+    struct timespec deadline;
+    if (timeout != NULL) {
+        long long total = (long long)timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000;
+        ms = (total > INT_MAX) ? INT_MAX : total;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += ms / 1000;
+        deadline.tv_nsec += (ms % 1000) * 1000000L;
+    }
+
+    struct epoll_event events[FMUX_PUMP_EVENTS];
+    int j;
+    for (;;) {
+        //Announce we may block before the last look at the rings, so a ring
+        //filling up in between signals sel_evfd
+        __atomic_store_n(&(handle->sel_waiting), 1, __ATOMIC_SEQ_CST);
+        j = fmux_select_rings(handle, ready, 0);
+        int wait = (j > 0) ? 0 : ms;
+        //Batches of events until the ready list is exhausted. The set is
+        //level-triggered, so a socket that stays readable comes around
+        //again (epoll rotates through them); sel_mark keeps it from being
+        //counted twice, and a full batch with nothing new means they've all
+        //been seen.
+        uint64_t call = __atomic_add_fetch(&(handle->sel_calls), 1, __ATOMIC_RELAXED);
+        int woken = 0, nready, fresh;
+        do {
+            nready = epoll_wait(handle->sel_epfd, events, FMUX_PUMP_EVENTS, wait);
+            fresh = 0;
+            for (int i = 0; i < nready; i++) {
+                fmux_channel* channel = events[i].data.ptr;
+                if (channel == NULL) {
+                    uint64_t count;
+                    while (read(handle->sel_evfd, &count, sizeof(count)) > 0);
+                    woken = 1;
+                    continue;
+                }
+                if (channel->sel_mark == call) continue;
+                channel->sel_mark = call;
+                if (ready != NULL) ready[j] = channel;
+                j++;
+                fresh++;
+            }
+            wait = 0;
+        } while (nready == FMUX_PUMP_EVENTS && fresh > 0);
+        __atomic_store_n(&(handle->sel_waiting), 0, __ATOMIC_SEQ_CST);
+        if (nready < 0 && errno != EINTR) return -1;
+        if (j > 0 || (!woken && nready >= 0) || ms == 0) break;
+
+        //Woken by a ring channel (or a signal); look again with what's left
+        if (ms > 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long long left = (deadline.tv_sec - now.tv_sec) * 1000LL +
+                             (deadline.tv_nsec - now.tv_nsec) / 1000000;
+            if (left <= 0) break;
+            ms = left;
+        }
+    }
+
+    //Same order as the channels themselves
+    if (ready != NULL) qsort(ready, j, sizeof(fmux_channel*), &fmux_channel_cmp);
+    return j;
+}
+
+/* PRIVATE */ int
+fmux_read_ring(fmux_channel* channel, void* buf, size_t nbyte)
+{
+    //One memcpy out of the ring. Like read() on a socket, this blocks until
+    //at least one byte is available (or the link hits EOF).
+    fmux_handle* handle = channel->handle;
+    fmux_ring* ring = channel->ring;
+    for (;;) {
+        size_t n = fmux_ring_pop(ring, buf, nbyte);
+        if (n > 0) fmux_stat_read(channel, n);
+        if (n > 0 || nbyte == 0) {
+            //The demuxer stopped when this ring filled up (or left some of
+            //it in a backlog); get it going again
+            if (fmux_rx_any_stalled(handle) ||
+                __atomic_load_n(&(handle->backlogged), __ATOMIC_RELAXED) > 0)
+                fmux_kick_reads(handle);
+            fmux_return_credit(channel);
+            return n;
+        }
+        if (channel->handle == NULL || __atomic_load_n(&(handle->rx_eof), __ATOMIC_ACQUIRE))
+            return 0;
+        if (handle->sync_read) {
+            if (fmux_rx_wait_links(handle) < 0) return -1;
+            fmux_flush_reads(handle);
+        } else {
+            fmux_ring_wait(ring, handle);
+        }
+    }
+}
+
+/* PRIVATE */ int
+fmux_read_held(fmux_channel* channel, void* buf, size_t nbyte)
+{
+    if (!fmux_channel_is_good(channel)) return 0;
+
+    if (channel->handle->sync_read)
+        fmux_flush_reads(channel->handle);
+    if (channel->ring != NULL)
+        return fmux_read_ring(channel, buf, nbyte);
+    int n = read(channel->sock[0], buf, nbyte);
+    if (n > 0) {
+        fmux_stat_read(channel, n);
+        fmux_return_credit(channel);
+    }
+    return n;
+}
+
+int
+fmux_read(fmux_channel* channel, void* buf, size_t nbyte)
+{
+    if (!fmux_channel_is_good(channel)) return 0;
+    //Closing it wakes us up, but it has to stay around until we're gone
+    fmux_channel_hold(channel);
+    int ret = fmux_read_held(channel, buf, nbyte);
+    fmux_channel_drop(channel);
+    return ret;
+}
+
+/* Writing */
+
+/* PRIVATE */ int
+fmux_writev_fully(int fd, struct iovec* iov, int iovcnt, uint64_t* calls)
+{
+    //writev all of iov to a (possibly non-blocking) fd, picking up after
+    //short writes. iov is consumed in the process.
+    ssize_t total = 0;
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (calls != NULL) fmux_stat_add(calls, 1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+            struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+            poll(&pfd, 1, -1);
+            continue;
+        }
+        total += n;
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return total;
+}
+
+/* PRIVATE */ ssize_t
+fmux_txq_send(fmux_handle* handle, const struct iovec* iov, int iovcnt)
+{
+    //One sendmsg that won't wait. Returns bytes sent (0 if the fd is full)
+    //or -1 on error.
+    struct msghdr msg = {.msg_iov = (struct iovec*)iov, .msg_iovlen = iovcnt};
+    ssize_t n;
+    do {
+        n = sendmsg(handle->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        fmux_stat_add(&(handle->stats.writes), 1);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    return n;
+}
+
+int
+fmux_txq_drain_locked(fmux_handle* handle, int wait)
+{
+    //Send what's queued. Returns 0 once it has all gone, or -1 (EAGAIN if
+    //the fd filled up and wait is 0).
+    while (handle->txq_len > 0) {
+        struct iovec iov = {.iov_base = handle->txq + handle->txq_start, .iov_len = handle->txq_len};
+        ssize_t n = fmux_txq_send(handle, &iov, 1);
+        if (n < 0) return -1;
+        handle->txq_start += n;
+        __atomic_store_n(&(handle->txq_len), handle->txq_len - n, __ATOMIC_RELEASE);
+        if (n == 0) {
+            if (!wait) { errno = EAGAIN; return -1; }
+            struct pollfd pfd = {.fd = handle->fd, .events = POLLOUT};
+            poll(&pfd, 1, -1);
+        }
+    }
+    handle->txq_start = 0;
+    return 0;
+}
+
+/* PRIVATE */ void
+fmux_txq_append(fmux_handle* handle, const struct iovec* iov, int iovcnt, size_t skip)
+{
+    //Queue what's left of iov after its first skip bytes
+    size_t len = handle->txq_len, more = 0;
+    for (int i = 0; i < iovcnt; i++) more += iov[i].iov_len;
+    more -= skip;
+    if (handle->txq_start + len + more > handle->txq_cap) {
+        if (len > 0) memmove(handle->txq, handle->txq + handle->txq_start, len);
+        handle->txq_start = 0;
+        if (len + more > handle->txq_cap) {
+            size_t cap = handle->txq_cap ? handle->txq_cap : FMUX_TX_BATCH;
+            while (cap < len + more) cap *= 2;
+            handle->txq = realloc(handle->txq, cap);
+            handle->txq_cap = cap;
+        }
+    }
+    char* end = handle->txq + handle->txq_start + len;
+    for (int i = 0; i < iovcnt; i++) {
+        if (skip >= iov[i].iov_len) { skip -= iov[i].iov_len; continue; }
+        memcpy(end, (char*)iov[i].iov_base + skip, iov[i].iov_len - skip);
+        end += iov[i].iov_len - skip;
+        skip = 0;
+    }
+    __atomic_store_n(&(handle->txq_len), len + more, __ATOMIC_RELEASE);
+}
+
+/* PRIVATE */ int
+fmux_txq_writev(fmux_handle* handle, const struct iovec* iov, int iovcnt)
+{
+    //fmux_writev_fully for non-blocking mode: whatever the fd won't take
+    //right away waits in txq, behind anything already there, for the pump
+    //(or the next writer) to send once the fd is writable. Under lock.
+    size_t total = 0;
+    ssize_t sent = 0;
+    for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+    if (fmux_txq_drain_locked(handle, 0) == 0) {
+        sent = fmux_txq_send(handle, iov, iovcnt);
+        if (sent < 0) return -1;
+    } else if (errno != EAGAIN) {
+        return -1;
+    }
+    if ((size_t)sent < total) {
+        int was_empty = (handle->txq_len == 0);
+        fmux_txq_append(handle, iov, iovcnt, sent);
+        //Have the pump watch for the fd to be writable again
+        if (was_empty) fmux_pump_kick(handle, FMUX_EV_OUT);
+    }
+    return total;
+}
+
+/* PRIVATE */ int
+fmux_tx_over_water(fmux_handle* handle)
+{
+    //Non-blocking mode: whether new writes are turned away (EAGAIN) for now.
+    //Tries to get under the high-water mark first.
+    size_t mark = __atomic_load_n(&(handle->high_water), __ATOMIC_ACQUIRE);
+    if (mark == 0 || __atomic_load_n(&(handle->txq_len), __ATOMIC_ACQUIRE) < mark) return 0;
+    pthread_mutex_lock(&(handle->lock));
+    fmux_txq_drain_locked(handle, 0);
+    int over = handle->high_water > 0 && handle->txq_len >= handle->high_water;
+    fmux_tx_unlock(handle);
+    if (over) errno = EAGAIN;
+    return over;
+}
+
+/* PRIVATE */ int
+fmux_link_writev(fmux_handle* handle, struct iovec* iov, int iovcnt)
+{
+    //Everything sent to the peer goes out through here, under lock
+    if (handle->shm_tx != NULL) return fmux_shm_writev(handle, iov, iovcnt);
+    if (__atomic_load_n(&(handle->high_water), __ATOMIC_RELAXED)) return fmux_txq_writev(handle, iov, iovcnt);
+    return fmux_writev_fully(handle->fd, iov, iovcnt, &(handle->stats.writes));
+}
+
+/* PRIVATE */ int
+fmux_send_frame_locked(fmux_handle* handle, uint32_t channel_id,
+                       const struct iovec* payload, int iovcnt)
+{
+    //Emit the 8 byte header and the payload buffers in a single writev,
+    //without copying the payload anywhere first. In cork mode, frames that
+    //fit are copied into tx_buf instead, with everybody else's.
+    if (iovcnt < 0 || iovcnt >= IOV_MAX) { errno = EINVAL; return -1; }
+    struct iovec iov[iovcnt + 1];
+    size_t nbytes = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        iov[i + 1] = payload[i];
+        nbytes += payload[i].iov_len;
+    }
+    if (nbytes > UINT32_MAX) { errno = EMSGSIZE; return -1; }
+
+    char header[FMUX_HEADER_MAX];
+    iov[0].iov_base = header;
+    iov[0].iov_len = fmux_header_put(handle, header, channel_id, nbytes, nbytes);
+    if (handle->cork_limit > 0 && nbytes <= handle->max_frame) {
+        if (handle->tx_cap - handle->tx_len < iov[0].iov_len + nbytes && fmux_tx_flush_locked(handle) < 0)
+            return -1;
+        for (int i = 0; i <= iovcnt; i++) {
+            memcpy(handle->tx_buf + handle->tx_len, iov[i].iov_base, iov[i].iov_len);
+            handle->tx_len += iov[i].iov_len;
+        }
+        fmux_stat_add(&(handle->stats.frames_out), 1);
+        fmux_stat_add(&(handle->stats.bytes_out), nbytes);
+        if (fmux_capturing(handle)) fmux_capture(handle, channel_id, FMUX_CAPTURE_OUT, payload, iovcnt);
+        return (fmux_tx_release_locked(handle) < 0) ? -1 : (int)nbytes;
+    }
+    //Whatever is held in tx_buf was there first
+    if (fmux_tx_flush_locked(handle) < 0) return -1;
+    if (fmux_link_writev(handle, iov, iovcnt + 1) < 0) return -1;
+    if (fmux_capturing(handle)) fmux_capture(handle, channel_id, FMUX_CAPTURE_OUT, payload, iovcnt);
+    fmux_stat_add(&(handle->stats.frames_out), 1);
+    fmux_stat_add(&(handle->stats.bytes_out), nbytes);
+    return nbytes;
+}
+
+/* PRIVATE */ int
+fmux_send_frames_locked(fmux_handle* handle, uint32_t channel_id,
+                        const struct iovec* payload, int iovcnt)
+{
+    //The large-message path: split the payload into frames of at most
+    //max_frame bytes that point straight into the caller's buffers, and
+    //write as many of them per writev as fit in one batch.
+    size_t left = 0;
+    for (int i = 0; i < iovcnt; i++) left += payload[i].iov_len;
+    if (left <= handle->max_frame)
+        return fmux_send_frame_locked(handle, channel_id, payload, iovcnt);
+    if (fmux_tx_flush_locked(handle) < 0) return -1;
+
+    char headers[FMUX_BATCH_IOV / 2][FMUX_HEADER_MAX];
+    struct iovec iov[FMUX_BATCH_IOV];
+    int niov = 0, nheaders = 0;
+    size_t total = left, off = 0;
+    uint64_t frames = 0;
+    int cur = 0;
+    while (left > 0) {
+        uint32_t frame = (left > handle->max_frame) ? handle->max_frame : left;
+        if (niov + 2 > FMUX_BATCH_IOV || nheaders == FMUX_BATCH_IOV / 2) {
+            if (fmux_link_writev(handle, iov, niov) < 0) return -1;
+            niov = nheaders = 0;
+        }
+        iov[niov].iov_len = fmux_header_put(handle, headers[nheaders], channel_id, frame, frame);
+        iov[niov++].iov_base = headers[nheaders++];
+        if (fmux_capturing(handle)) {
+            struct iovec part[iovcnt];
+            int nparts = fmux_iov_slice(payload, iovcnt, total - left, frame, part);
+            fmux_capture(handle, channel_id, FMUX_CAPTURE_OUT, part, nparts);
+        }
+
+        size_t need = frame;
+        while (need > 0) {
+            if (off == payload[cur].iov_len) { cur++; off = 0; continue; }
+            if (niov == FMUX_BATCH_IOV) {
+                //Mid-frame is fine; everything goes out in order under the lock
+                if (fmux_link_writev(handle, iov, niov) < 0) return -1;
+                niov = nheaders = 0;
+            }
+            size_t take = payload[cur].iov_len - off;
+            if (take > need) take = need;
+            iov[niov].iov_base = (char*)payload[cur].iov_base + off;
+            iov[niov++].iov_len = take;
+            off += take;
+            need -= take;
+        }
+        left -= frame;
+        frames++;
+    }
+    if (niov > 0 && fmux_link_writev(handle, iov, niov) < 0) return -1;
+    fmux_stat_add(&(handle->stats.frames_out), frames);
+    fmux_stat_add(&(handle->stats.bytes_out), total);
+    return total;
+}
+
+/* Pushing. fmux_push doesn't queue up on lock: pushers put their frames on
+ * a lock-free stack, and whoever has lock next (the first pusher to get it,
+ * another writer, or the pump) writes out everything waiting in as few
+ * writevs as it takes. The rest sleep until their frame is done. */
+
+struct fmux_push_req {
+    struct fmux_push_req* next;
+    fmux_message* message;
+    int result;
+    int error; //errno, if result is -1
+    int state; //FMUX_PUSH_*; atomic, and a futex
+};
+
+#define FMUX_PUSH_QUEUED 0
+#define FMUX_PUSH_SLEEPING 1
+#define FMUX_PUSH_DONE 2
+
+/* PRIVATE */ int
+fmux_push_locked(fmux_handle* handle, fmux_message* message)
+{
+    struct iovec iov = {.iov_base = message->data, .iov_len = message->nbytes};
+    size_t header = fmux_header_len(handle, message->channel_id, message->nbytes);
+    int err = fmux_send_frame_locked(handle, message->channel_id, &iov, 1);
+    return (err < 0) ? -1 : err + (int)header;
+}
+
+/* PRIVATE */ void
+fmux_push_done(struct fmux_push_req* req, int result)
+{
+    //req lives on its pusher's stack; it may be gone as soon as it's done
+    req->result = result;
+    req->error = errno;
+    if (__atomic_exchange_n(&(req->state), FMUX_PUSH_DONE, __ATOMIC_ACQ_REL) == FMUX_PUSH_SLEEPING)
+        syscall(SYS_futex, &(req->state), FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/* PRIVATE */ void
+fmux_push_drain_locked(fmux_handle* handle)
+{
+    //lock must be held. Writes out every frame pushed so far, oldest first.
+    struct fmux_push_req* req = __atomic_exchange_n(&(handle->push_head), NULL, __ATOMIC_ACQUIRE);
+    if (req == NULL) return;
+    struct fmux_push_req* fifo = NULL;
+    while (req != NULL) {
+        struct fmux_push_req* next = req->next;
+        req->next = fifo;
+        fifo = req;
+        req = next;
+    }
+    if (handle->cork_limit > 0) {
+        //They're gathered in tx_buf anyway
+        while (fifo != NULL) {
+            struct fmux_push_req* next = fifo->next;
+            fmux_push_done(fifo, fmux_push_locked(handle, fifo->message));
+            fifo = next;
+        }
+        return;
+    }
+
+    int err = fmux_tx_flush_locked(handle);
+    while (fifo != NULL) {
+        char headers[FMUX_BATCH_IOV / 2][FMUX_HEADER_MAX];
+        struct iovec iov[FMUX_BATCH_IOV];
+        struct fmux_push_req* batch = fifo;
+        int n = 0;
+        uint64_t bytes = 0;
+        for (; fifo != NULL && n < FMUX_BATCH_IOV / 2; fifo = fifo->next, n++) {
+            fmux_message* message = fifo->message;
+            iov[2 * n].iov_base = headers[n];
+            iov[2 * n].iov_len = fmux_header_put(handle, headers[n], message->channel_id,
+                                                 message->nbytes, message->nbytes);
+            iov[2 * n + 1].iov_base = message->data;
+            iov[2 * n + 1].iov_len = message->nbytes;
+            bytes += message->nbytes;
+        }
+        if (err >= 0) err = fmux_link_writev(handle, iov, 2 * n);
+        if (err >= 0) {
+            fmux_stat_add(&(handle->stats.frames_out), n);
+            fmux_stat_add(&(handle->stats.bytes_out), bytes);
+        }
+        for (struct fmux_push_req* cur = batch; err >= 0 && cur != fifo && fmux_capturing(handle); cur = cur->next) {
+            struct iovec payload = {.iov_base = cur->message->data, .iov_len = cur->message->nbytes};
+            fmux_capture(handle, cur->message->channel_id, FMUX_CAPTURE_OUT, &payload, 1);
+        }
+        while (batch != fifo) {
+            struct fmux_push_req* next = batch->next;
+            fmux_message* message = batch->message;
+            fmux_push_done(batch, (err < 0) ? -1 : (int)(message->nbytes +
+                           fmux_header_len(handle, message->channel_id, message->nbytes)));
+            batch = next;
+        }
+    }
+}
+
+int
+fmux_push(fmux_handle* handle, fmux_message* message)
+{
+    if (message->channel_id == FMUX_PROTO_CHANNEL) { errno = EINVAL; return -1; }
+    if (__atomic_load_n(&(handle->nlinks), __ATOMIC_ACQUIRE) > 1) {
+        //Same link as the channel's other frames, so they stay in order
+        fmux_channel* channel = fmux_channel_find(handle, message->channel_id);
+        handle = (channel != NULL) ? channel->link :
+                 handle->links[message->channel_id % handle->nlinks];
+        if (channel != NULL) fmux_channel_drop(channel);
+    }
+    if (fmux_tx_over_water(handle)) return -1;
+    struct fmux_push_req req = {.message = message, .state = FMUX_PUSH_QUEUED};
+    req.next = __atomic_load_n(&(handle->push_head), __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&(handle->push_head), &(req.next), &req, 1,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+    //Whoever has lock writes our frame out before letting go of it
+    if (pthread_mutex_trylock(&(handle->lock)) == 0) fmux_tx_unlock(handle);
+    int state = FMUX_PUSH_QUEUED;
+    if (__atomic_compare_exchange_n(&(req.state), &state, FMUX_PUSH_SLEEPING, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        do {
+            syscall(SYS_futex, &(req.state), FUTEX_WAIT_PRIVATE, FMUX_PUSH_SLEEPING, NULL, NULL, 0);
+        } while (__atomic_load_n(&(req.state), __ATOMIC_ACQUIRE) != FMUX_PUSH_DONE);
+    }
+    if (req.result < 0) errno = req.error;
+    return req.result;
+}
+
+/* Priority. Writers take lock through fmux_tx_lock, which lets more urgent
+ * writers go first, and hand it back through fmux_tx_unlock. Long writes
+ * (and the scheduler) step aside in fmux_tx_yield between turns. */
+
+/* PRIVATE */ int
+fmux_tx_outranked(fmux_handle* handle, int priority)
+{
+    for (int p = priority + 1; p < FMUX_PRIORITY_LEVELS; p++) {
+        if (__atomic_load_n(&(handle->tx_waiting[p]), __ATOMIC_ACQUIRE) > 0) return 1;
+    }
+    return 0;
+}
+
+/* PRIVATE */ void
+fmux_tx_yield(fmux_handle* handle, int priority)
+{
+    //lock must be held. Waiting on tx_cond lets go of it.
+    while (fmux_tx_outranked(handle, priority))
+        pthread_cond_wait(&(handle->tx_cond), &(handle->lock));
+}
+
+/* PRIVATE */ int
+fmux_tx_lock(fmux_handle* handle, fmux_channel* channel, int priority, int resume)
+{
+    //Unless it's picking up its own write again, a writer also waits for
+    //anybody partway through a write on the same channel.
+    __atomic_add_fetch(&(handle->tx_waiting[priority]), 1, __ATOMIC_ACQ_REL);
+    int err = pthread_mutex_lock(&(handle->lock));
+    __atomic_sub_fetch(&(handle->tx_waiting[priority]), 1, __ATOMIC_ACQ_REL);
+    if (err != 0) return -1;
+    while ((!resume && channel->tx_active) || fmux_tx_outranked(handle, priority))
+        pthread_cond_wait(&(handle->tx_cond), &(handle->lock));
+    return 0;
+}
+
+/* PRIVATE */ void
+fmux_tx_unlock(fmux_handle* handle)
+{
+    //Every release of lock comes through here, so a pusher that couldn't
+    //get lock can sleep until its frame is done.
+    for (;;) {
+        fmux_push_drain_locked(handle); //Frames pushed while we had lock
+        pthread_cond_broadcast(&(handle->tx_cond));
+        pthread_mutex_unlock(&(handle->lock));
+        //Anybody who pushed since the drain may have found lock taken.
+        //(A compare-exchange, so it can't be ordered before the unlock.)
+        struct fmux_push_req* none = NULL;
+        if (__atomic_compare_exchange_n(&(handle->push_head), &none, NULL, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            return;
+        //If somebody else has lock, it's theirs to drain
+        if (pthread_mutex_trylock(&(handle->lock)) != 0) return;
+    }
+}
+
+/* PRIVATE */ int
+fmux_tx_flush_locked(fmux_handle* handle)
+{
+    //Write out the frames gathered in tx_buf
+    if (handle->tx_len == 0) return 0;
+    struct iovec iov = {.iov_base = handle->tx_buf, .iov_len = handle->tx_len};
+    int err = fmux_link_writev(handle, &iov, 1);
+    handle->tx_len = 0;
+    handle->cork_since = 0;
+    return (err < 0) ? -1 : 0;
+}
+
+/* PRIVATE */ void
+fmux_cork_arm(fmux_handle* handle, uint64_t ns)
+{
+    int fd = __atomic_load_n(&(handle->cork_timerfd), __ATOMIC_ACQUIRE);
+    if (fd < 0) return;
+    struct itimerspec when = {0};
+    when.it_value.tv_sec = ns / 1000000000;
+    when.it_value.tv_nsec = ns % 1000000000;
+    timerfd_settime(fd, 0, &when, NULL);
+}
+
+int
+fmux_tx_release_locked(fmux_handle* handle)
+{
+    //Done adding frames to tx_buf for now. Out they go, unless cork mode
+    //says to hold on to them a while longer.
+    if (handle->cork_limit == 0 || handle->tx_len >= handle->cork_limit)
+        return fmux_tx_flush_locked(handle);
+    if (handle->tx_len == 0 || handle->cork_delay == 0) return 0;
+    uint64_t now = fmux_now_ns();
+    if (handle->cork_since == 0) {
+        handle->cork_since = now;
+        fmux_cork_arm(handle, handle->cork_delay);
+        return 0;
+    }
+    if (now - handle->cork_since >= handle->cork_delay) return fmux_tx_flush_locked(handle);
+    return 0;
+}
+
+/* PRIVATE */ void
+fmux_cork_expired(fmux_handle* handle)
+{
+    //The pump's timer went off. It may have been armed for frames that have
+    //gone out since, so check.
+    uint64_t count;
+    while (read(handle->cork_timerfd, &count, sizeof(count)) > 0);
+    pthread_mutex_lock(&(handle->lock));
+    if (handle->cork_since != 0) {
+        uint64_t waited = fmux_now_ns() - handle->cork_since;
+        if (waited >= handle->cork_delay) fmux_tx_flush_locked(handle);
+        else fmux_cork_arm(handle, handle->cork_delay - waited);
+    }
+    fmux_tx_unlock(handle);
+}
+
+/* PRIVATE */ int
+fmux_splice_channel_locked(fmux_handle* handle, fmux_channel* channel, size_t want)
+{
+    //Send a chunk of the channel's outbound data without copying it: the
+    //payload goes from sock[1] through tx_pipe to the fd, and only the header
+    //is written from here. Returns bytes sent, -1 on error, or -2 if there
+    //isn't enough waiting to be worth it.
+    int queued = 0;
+    if (want < FMUX_SPLICE_MIN || ioctl(channel->sock[1], FIONREAD, &queued) < 0 ||
+        queued < FMUX_SPLICE_MIN)
+        return -2;
+    if (want > handle->pipe_cap) want = handle->pipe_cap;
+    if (fmux_tx_flush_locked(handle) < 0) return -1;
+    ssize_t n;
+    do {
+        n = splice(channel->sock[1], NULL, handle->tx_pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && errno == EINVAL) {
+        fmux_splice_close(handle->tx_pipe);
+        return -2;
+    }
+    if (n <= 0) return (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) ? -1 : 0;
+    char header[FMUX_HEADER_MAX];
+    size_t len = fmux_header_put(handle, header, channel->id, n, n);
+    if (fmux_write_fully(handle->fd, header, len, &(handle->stats.writes)) < 0 ||
+        fmux_splice_fully(handle->tx_pipe[0], handle->fd, n, &(handle->stats.writes)) < 0)
+        return -1;
+    return n;
+}
+
+/* PRIVATE */ int
+fmux_gather_message_locked(fmux_handle* handle, fmux_channel* channel)
+{
+    //fmux_gather_channel_locked for message channels: the next record in
+    //sock[1] becomes a frame of its own, whatever its size. Records too big
+    //for tx_buf are sent on their own. Empty ones are skipped.
+    ssize_t size;
+    char dummy;
+    while ((size = recv(channel->sock[1], NULL, 0, MSG_PEEK | MSG_TRUNC | MSG_DONTWAIT)) == 0)
+        recv(channel->sock[1], &dummy, 0, MSG_DONTWAIT);
+    if (size < 0) return (errno != EAGAIN && errno != EWOULDBLOCK) ? -1 : 0;
+    if (handle->window && __atomic_load_n(&(channel->tx_credit), __ATOMIC_ACQUIRE) < size) return 0;
+    size_t header = fmux_header_len(handle, channel->id, size);
+    if (handle->tx_cap - handle->tx_len < header + size && fmux_tx_flush_locked(handle) < 0)
+        return -1;
+    char* spill = (handle->tx_cap < header + size) ? malloc(header + size) : NULL;
+    char* frame = (spill != NULL) ? spill : handle->tx_buf + handle->tx_len;
+    ssize_t bytes = recv(channel->sock[1], frame + header, size, MSG_DONTWAIT);
+    if (bytes <= 0) {
+        free(spill);
+        return (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK) ? -1 : 0;
+    }
+    fmux_header_put(handle, frame, channel->id, bytes, size);
+    if (fmux_capturing(handle)) {
+        struct iovec payload = {.iov_base = frame + header, .iov_len = bytes};
+        fmux_capture(handle, channel->id, FMUX_CAPTURE_OUT, &payload, 1);
+    }
+    if (spill != NULL) {
+        struct iovec iov = {.iov_base = spill, .iov_len = header + bytes};
+        int err = fmux_link_writev(handle, &iov, 1);
+        free(spill);
+        if (err < 0) return -1;
+    } else {
+        handle->tx_len += header + bytes;
+    }
+    fmux_stat_add(&(handle->stats.frames_out), 1);
+    fmux_stat_add(&(handle->stats.bytes_out), bytes);
+    fmux_stat_add(&(channel->stats.frames_out), 1);
+    fmux_stat_add(&(channel->stats.bytes_out), bytes);
+    if (handle->window) __atomic_sub_fetch(&(channel->tx_credit), bytes, __ATOMIC_ACQ_REL);
+    return bytes;
+}
+
+/* PRIVATE */ int
+fmux_gather_channel_locked(fmux_handle* handle, fmux_channel* channel, size_t limit)
+{
+    //Read one chunk (of at most limit bytes) of outbound data from the
+    //channel into tx_buf, behind a frame header, so that the frames of many
+    //channels go out in a single write. Reading and gathering under the same
+    //lock keeps chunks of a channel in order. Large chunks may be spliced
+    //straight out instead.
+    //Returns bytes gathered, 0 if nothing was waiting, or -1 on error.
+    if (!fmux_channel_sends_on(channel, handle)) return 0;
+    if (channel->type == FMUX_CHANTYPE_BIN) return fmux_gather_message_locked(handle, channel);
+    size_t want = (limit < handle->max_frame) ? limit : handle->max_frame;
+    if (handle->window) {
+        //Out of credit, the data waits in sock[1] until fmux_add_credit
+        int64_t credit = __atomic_load_n(&(channel->tx_credit), __ATOMIC_ACQUIRE);
+        if (credit <= 0) return 0;
+        if ((uint64_t)credit < want) want = credit;
+    }
+    //(Splicing writes the fd directly, which would jump the queue in
+    //non-blocking mode, and the payload never passes through here to capture)
+    int bytes = (handle->tx_pipe[0] >= 0 && !handle->high_water && !fmux_capturing(handle)) ?
+                fmux_splice_channel_locked(handle, channel, want) : -2;
+    if (bytes == -2) {
+        //The header goes in front once the length is known, padded to fit
+        size_t header = fmux_header_len(handle, channel->id, want);
+        if (handle->tx_cap - handle->tx_len < header + want && fmux_tx_flush_locked(handle) < 0)
+            return -1;
+        char* frame = handle->tx_buf + handle->tx_len;
+        bytes = read(channel->sock[1], frame + header, want);
+        if (bytes <= 0) return (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK) ? -1 : 0;
+        fmux_header_put(handle, frame, channel->id, bytes, want);
+        handle->tx_len += header + bytes;
+        if (fmux_capturing(handle)) {
+            struct iovec payload = {.iov_base = frame + header, .iov_len = bytes};
+            fmux_capture(handle, channel->id, FMUX_CAPTURE_OUT, &payload, 1);
+        }
+    }
+    if (bytes <= 0) return bytes;
+    fmux_stat_add(&(handle->stats.frames_out), 1);
+    fmux_stat_add(&(handle->stats.bytes_out), bytes);
+    fmux_stat_add(&(channel->stats.frames_out), 1);
+    fmux_stat_add(&(channel->stats.bytes_out), bytes);
+    if (handle->window) __atomic_sub_fetch(&(channel->tx_credit), bytes, __ATOMIC_ACQ_REL);
+    return bytes;
+}
+
+/* PRIVATE */ int
+fmux_flush_channel_locked(fmux_handle* handle, fmux_channel* channel, size_t limit)
+{
+    //Move one chunk of outbound data from the channel onto the wire
+    int bytes = fmux_gather_channel_locked(handle, channel, limit);
+    if (bytes > 0 && fmux_tx_release_locked(handle) < 0) return -1;
+    return bytes;
+}
+
+/* PRIVATE */ int
+fmux_flush_writes(fmux_handle* handle)
+{
+    //One poll over every socket channel's sock[1]
+    pthread_mutex_lock(&(handle->chan_lock));
+    if (handle->tx_pollcap < handle->nactive) {
+        handle->tx_pollcap = handle->active_cap;
+        handle->tx_pollfds = realloc(handle->tx_pollfds, handle->tx_pollcap * sizeof(struct pollfd));
+    }
+    int nfds = 0;
+    for (int i = 0; i < handle->nactive; i++) {
+        if (handle->active[i]->sock[1] < 0) continue;
+        handle->tx_pollfds[nfds].fd = handle->active[i]->sock[1];
+        handle->tx_pollfds[nfds].events = POLLIN;
+        nfds++;
+    }
+    int n = poll(handle->tx_pollfds, nfds, 0);
+    //Every channel with data gets a turn, in priority order
+    for (int i = 0, k = 0; n > 0 && i < handle->nactive; i++) {
+        if (handle->active[i]->sock[1] < 0) continue;
+        if (handle->tx_pollfds[k++].revents != 0)
+            fmux_queue_out(handle->active[i]->link, handle->active[i], 0);
+    }
+    pthread_mutex_unlock(&(handle->chan_lock));
+    if (n <= 0) return (n == 0);
+    int err = 0;
+    for (int i = 0; i < __atomic_load_n(&(handle->nlinks), __ATOMIC_ACQUIRE) && err >= 0; i++) {
+        fmux_handle* link = handle->links[i];
+        pthread_mutex_lock(&(link->lock));
+        err = fmux_schedule_out_locked(link, 0);
+        fmux_tx_unlock(link);
+    }
+    return (err >= 0);
+}
+
+/* PRIVATE */ int
+fmux_iov_slice(const struct iovec* iov, int iovcnt, size_t off, size_t nbyte, struct iovec* out)
+{
+    //Points out at nbyte bytes of iov, starting off bytes in. Returns the
+    //number of iovecs used, which is never more than iovcnt.
+    int n = 0;
+    for (int i = 0; i < iovcnt && nbyte > 0; i++) {
+        if (off >= iov[i].iov_len) { off -= iov[i].iov_len; continue; }
+        size_t take = iov[i].iov_len - off;
+        if (take > nbyte) take = nbyte;
+        out[n].iov_base = (char*)iov[i].iov_base + off;
+        out[n++].iov_len = take;
+        nbyte -= take;
+        off = 0;
+    }
+    return n;
+}
+
+/* PRIVATE */ int
+fmux_wait_credit(fmux_channel* channel)
+{
+    //Returns -1 once credit can't come anymore
+    fmux_handle* handle = channel->handle;
+    if (handle->sync_read) {
+        //Nobody else may be reading the link, so look for window updates
+        //ourselves. Time out in case another reader gets to them first.
+        struct pollfd pfd = {.fd = handle->fd, .events = POLLIN};
+        if (poll(&pfd, 1, FMUX_CREDIT_WAIT_MS) < 0 && errno != EINTR) return -1;
+        fmux_flush_reads(handle);
+    } else {
+        //Timed, in case the handle leaves the pump while we're waiting
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += FMUX_CREDIT_WAIT_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&(handle->credit_lock));
+        if (__atomic_load_n(&(channel->tx_credit), __ATOMIC_ACQUIRE) <= 0 &&
+            channel->handle != NULL && !__atomic_load_n(&(handle->rx_eof), __ATOMIC_ACQUIRE))
+            pthread_cond_timedwait(&(handle->credit_cond), &(handle->credit_lock), &deadline);
+        pthread_mutex_unlock(&(handle->credit_lock));
+    }
+    if (channel->handle == NULL) return -1;
+    if (__atomic_load_n(&(channel->tx_credit), __ATOMIC_ACQUIRE) <= 0 &&
+        __atomic_load_n(&(handle->rx_eof), __ATOMIC_ACQUIRE)) {
+        errno = EPIPE;
+        return -1;
+    }
+    return 0;
+}
+
+/* PRIVATE */ int
+fmux_writev_held(fmux_channel* channel, const struct iovec* iov, int iovcnt)
+{
+    if (!fmux_channel_is_good(channel)) return 0;
+    fmux_handle* bond = channel->handle;
+    fmux_handle* handle = channel->link;
+    //With flow control on, the peer would take it for control frames
+    if (fmux_has_control(handle) && channel->id == FMUX_CONTROL_CHANNEL) { errno = EINVAL; return -1; }
+    if (iovcnt < 0 || iovcnt >= IOV_MAX) { errno = EINVAL; return -1; }
+    size_t total = 0, sent = 0;
+    for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+    if (total > INT_MAX) { errno = EMSGSIZE; return -1; }
+    //An empty frame would mean nothing to the peer
+    if (total == 0) return 0;
+    if (fmux_tx_over_water(handle)) return -1;
+    struct iovec slice[iovcnt + 1];
+    //A turn's worth at a time, so more urgent channels can cut in. With
+    //flow control, no more than the channel has credit for either; the lock
+    //is let go while waiting for more, so other channels keep going.
+    int priority = channel->priority;
+    size_t turn = (size_t)FMUX_QUANTUM * channel->weight;
+
+    if (fmux_tx_lock(handle, channel, priority, 0) != 0) return -1;
+    int err = 0;
+    for (;;) {
+        //Whatever was written into the channel fd has to go out first
+        if (channel->fd_out) {
+            while ((err = fmux_flush_channel_locked(handle, channel, SIZE_MAX)) > 0);
+        }
+        size_t n = total - sent;
+        if (n > turn) n = turn;
+        if (handle->window) {
+            int64_t credit = __atomic_load_n(&(channel->tx_credit), __ATOMIC_ACQUIRE);
+            if (credit < (int64_t)n) n = (credit > 0) ? credit : 0;
+        }
+        if (err >= 0 && n > 0) {
+            int cnt = fmux_iov_slice(iov, iovcnt, sent, n, slice);
+            err = fmux_send_frames_locked(handle, channel->id, slice, cnt);
+            if (err >= 0) {
+                fmux_stat_add(&(channel->stats.frames_out), (n - 1) / handle->max_frame + 1);
+                fmux_stat_add(&(channel->stats.bytes_out), n);
+                if (handle->window) __atomic_sub_fetch(&(channel->tx_credit), n, __ATOMIC_ACQ_REL);
+                sent += n;
+            }
+        }
+        if (err < 0 || sent == total) break;
+        channel->tx_active = 1;
+        if (n > 0) {
+            fmux_tx_yield(handle, priority);
+            continue;
+        }
+        if (handle->high_water) {
+            //Non-blocking mode doesn't wait for credit either
+            errno = EAGAIN;
+            err = -1;
+            break;
+        }
+        fmux_tx_unlock(handle);
+        err = fmux_wait_credit(channel);
+        if (fmux_tx_lock(handle, channel, priority, 1) != 0) return -1;
+        if (err < 0) break;
+    }
+    channel->tx_active = 0;
+    fmux_tx_unlock(handle);
+    if (err < 0) return (sent > 0) ? (int)sent : -1;
+
+    //Without a pump, writing is the only thing that moves data applications
+    //put straight into the channel fds.
+    if (bond->sync_read && bond->fd_out_channels > 0 && !fmux_flush_writes(bond))
+        return -1;
+    return sent;
+}
+
+int
+fmux_writev(fmux_channel* channel, const struct iovec* iov, int iovcnt)
+{
+    if (!fmux_channel_is_good(channel)) return 0;
+    //It may be closed while we wait for credit
+    fmux_channel_hold(channel);
+    int ret = fmux_writev_held(channel, iov, iovcnt);
+    fmux_channel_drop(channel);
+    return ret;
+}
+
+int
+fmux_channel_set_priority(fmux_channel* channel, int priority, uint32_t weight)
+{
+    if (!fmux_channel_is_good(channel)) return -1;
+    if (priority < 0 || priority >= FMUX_PRIORITY_LEVELS) return -1;
+    if (weight < 1 || weight > FMUX_MAX_WEIGHT) return -1;
+
+    //If it's waiting to be drained, it moves to the back of its new level
+    fmux_handle* handle = channel->link;
+    pthread_mutex_lock(&(handle->lock));
+    int queued = channel->out_queued;
+    if (queued) fmux_unqueue_out(handle, channel);
+    channel->priority = priority;
+    channel->weight = weight;
+    channel->deficit = 0;
+    if (queued) fmux_queue_out(handle, channel, 0);
+    fmux_tx_unlock(handle);
+    return 0;
+}
+
+int
+fmux_set_max_frame(fmux_handle* handle, uint32_t nbytes)
+{
+    if (nbytes < FMUX_MIN_FRAME || nbytes > FMUX_MAX_FRAME) return -1;
+    for (int i = 1; i < __atomic_load_n(&(handle->nlinks), __ATOMIC_ACQUIRE); i++) {
+        if (fmux_set_max_frame(handle->links[i], nbytes) < 0) return -1;
+    }
+
+    //The receive side streams payloads of any size, so this only changes
+    //how we cut up what we send.
+    if (pthread_mutex_lock(&(handle->lock)) != 0) return -1;
+    if (fmux_tx_flush_locked(handle) < 0) {
+        fmux_tx_unlock(handle);
+        return -1;
+    }
+    size_t cap = (nbytes + FMUX_HEADER_MAX > FMUX_TX_BATCH) ? nbytes + FMUX_HEADER_MAX : FMUX_TX_BATCH;
+    char* buf = realloc(handle->tx_buf, cap);
+    if (buf != NULL) {
+        handle->tx_buf = buf;
+        handle->tx_cap = cap;
+        handle->max_frame = nbytes;
+    }
+    fmux_tx_unlock(handle);
+    return (buf != NULL) ? 0 : -1;
+}
+
+uint32_t
+fmux_get_max_frame(fmux_handle* handle)
+{
+    return handle->max_frame;
+}
+
+int
+fmux_set_cork(fmux_handle* handle, size_t limit, uint32_t delay_us)
+{
+    if (handle == NULL) return -1;
+    if (limit > 0 && fmux_is_bonded(handle)) { errno = EINVAL; return -1; }
+    if (pthread_mutex_lock(&(handle->lock)) != 0) return -1;
+    int created = 0;
+    if (limit > 0 && delay_us > 0 && handle->cork_timerfd < 0) {
+        int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (fd < 0) {
+            fmux_tx_unlock(handle);
+            return -1;
+        }
+        __atomic_store_n(&(handle->cork_timerfd), fd, __ATOMIC_RELEASE);
+        created = 1;
+    }
+    handle->cork_limit = limit;
+    handle->cork_delay = (uint64_t)delay_us * 1000;
+    //Whatever was held under the old settings goes out now
+    int err = fmux_tx_flush_locked(handle);
+    fmux_tx_unlock(handle);
+
+    //A pump we're already on has to start watching the timer
+    fmux_pump* pump = handle->pump;
+    if (created && pump != NULL) {
+        pthread_mutex_lock(&(pump->lock));
+        if (handle->pump == pump) fmux_pump_watch_cork(pump, handle);
+        pthread_mutex_unlock(&(pump->lock));
+    }
+    return err;
+}
+
+int
+fmux_flush(fmux_handle* handle)
+{
+    if (handle == NULL) return -1;
+    if (pthread_mutex_lock(&(handle->lock)) != 0) return -1;
+    int err = fmux_tx_flush_locked(handle);
+    if (err == 0 && handle->high_water) err = fmux_txq_drain_locked(handle, 0);
+    fmux_tx_unlock(handle);
+    return err;
+}
+
+int
+fmux_set_nonblocking(fmux_handle* handle, size_t high_water)
+{
+    if (handle == NULL) return -1;
+    struct stat st;
+    if (high_water > 0 && (handle->shm_tx != NULL || fmux_is_bonded(handle) ||
+                           fstat(handle->fd, &st) < 0 || !S_ISSOCK(st.st_mode))) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&(handle->lock));
+    //Turning it off, the queue has to be out of the way first
+    int err = (high_water == 0) ? fmux_txq_drain_locked(handle, 1) : 0;
+    if (err == 0) __atomic_store_n(&(handle->high_water), high_water, __ATOMIC_RELEASE);
+    fmux_tx_unlock(handle);
+    return err;
+}
+
+int
+fmux_set_splice(fmux_handle* handle, int on)
+{
+    if (handle == NULL) return -1;
+    struct stat st;
+    if (on && (handle->shm_tx != NULL || fmux_is_bonded(handle) || fstat(handle->fd, &st) < 0 ||
+               !(S_ISSOCK(st.st_mode) || S_ISFIFO(st.st_mode) || S_ISREG(st.st_mode)))) {
+        errno = EINVAL;
+        return -1;
+    }
+    //The same order as the demuxer, which sends credit under rx_lock
+    pthread_mutex_lock(&(handle->rx_lock));
+    pthread_mutex_lock(&(handle->lock));
+    int err = 0;
+    if (!on) {
+        fmux_splice_close(handle->rx_pipe);
+        fmux_splice_close(handle->tx_pipe);
+    } else if (handle->rx_pipe[0] < 0 || handle->tx_pipe[0] < 0) {
+        fmux_splice_close(handle->rx_pipe);
+        fmux_splice_close(handle->tx_pipe);
+        err = pipe2(handle->rx_pipe, O_CLOEXEC);
+        if (err == 0) err = pipe2(handle->tx_pipe, O_CLOEXEC);
+        if (err == 0) {
+            int cap = fcntl(handle->rx_pipe[0], F_GETPIPE_SZ);
+            handle->pipe_cap = (cap > 0) ? (size_t)cap : FMUX_SPLICE_MIN;
+        } else {
+            fmux_splice_close(handle->rx_pipe);
+            fmux_splice_close(handle->tx_pipe);
+        }
+    }
+    fmux_tx_unlock(handle);
+    pthread_mutex_unlock(&(handle->rx_lock));
+    return err;
+}
+
+int
+fmux_get_protocol(fmux_handle* handle)
+{
+    pthread_mutex_lock(&(handle->lock));
+    int v2 = handle->tx_v2;
+    fmux_tx_unlock(handle);
+    return v2 ? FMUX_PROTO_V2 : FMUX_PROTO_V1;
+}
+
+int
+fmux_set_flow_control(fmux_handle* handle, uint32_t window)
+{
+    if (window < FMUX_MIN_WINDOW || window > FMUX_MAX_WINDOW) return -1;
+    if (fmux_is_bonded(handle)) { errno = EINVAL; return -1; }
+
+    //Each end starts out assuming the other has a whole window free on every
+    //channel, which only holds if nothing has been sent yet.
+    pthread_mutex_lock(&(handle->rx_lock));
+    pthread_mutex_lock(&(handle->lock));
+    handle->window = window;
+    for (int i = 0; i < handle->nactive; i++)
+        handle->active[i]->tx_credit = window;
+    fmux_tx_unlock(handle);
+    pthread_mutex_unlock(&(handle->rx_lock));
+    return 0;
+}
+
+uint32_t
+fmux_get_flow_control(fmux_handle* handle)
+{
+    return handle->window;
+}
+
+int
+fmux_write(fmux_channel* channel, const void* buf, size_t nbyte)
+{
+    struct iovec iov = {.iov_base = (void*)buf, .iov_len = nbyte};
+    return fmux_writev(channel, &iov, 1);
+}
+
+/* PRIVATE */ int
+fmux_send_msg_held(fmux_channel* channel, const void* buf, size_t nbyte)
+{
+    if (!fmux_channel_is_good(channel)) return -1;
+    fmux_handle* handle = channel->link;
+    if (channel->type != FMUX_CHANTYPE_BIN || nbyte == 0) { errno = EINVAL; return -1; }
+    if (nbyte > FMUX_MSG_MAX || (handle->window && nbyte > handle->window)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (fmux_tx_over_water(handle)) return -1;
+    struct iovec iov = {.iov_base = (void*)buf, .iov_len = nbyte};
+    int priority = channel->priority;
+
+    if (fmux_tx_lock(handle, channel, priority, 0) != 0) return -1;
+    int err = 0;
+    //Whatever was written into the channel fd has to go out first
+    if (channel->fd_out) {
+        while ((err = fmux_flush_channel_locked(handle, channel, SIZE_MAX)) > 0);
+    }
+    //A message is never split up, so it waits for credit for all of it
+    while (err >= 0 && handle->window &&
+           __atomic_load_n(&(channel->tx_credit), __ATOMIC_ACQUIRE) < (int64_t)nbyte) {
+        if (handle->high_water) {
+            errno = EAGAIN;
+            err = -1;
+            break;
+        }
+        channel->tx_active = 1;
+        fmux_tx_unlock(handle);
+        err = fmux_wait_credit(channel);
+        if (fmux_tx_lock(handle, channel, priority, 1) != 0) return -1;
+    }
+    if (err >= 0) err = fmux_send_frame_locked(handle, channel->id, &iov, 1);
+    if (err >= 0) {
+        fmux_stat_add(&(channel->stats.frames_out), 1);
+        fmux_stat_add(&(channel->stats.bytes_out), nbyte);
+        if (handle->window) __atomic_sub_fetch(&(channel->tx_credit), nbyte, __ATOMIC_ACQ_REL);
+    }
+    channel->tx_active = 0;
+    fmux_tx_unlock(handle);
+    return (err < 0) ? -1 : (int)nbyte;
+}
+
+int
+fmux_send_msg(fmux_channel* channel, const void* buf, size_t nbyte)
+{
+    if (!fmux_channel_is_good(channel)) return -1;
+    //It may be closed while we wait for credit
+    fmux_channel_hold(channel);
+    int ret = fmux_send_msg_held(channel, buf, nbyte);
+    fmux_channel_drop(channel);
+    return ret;
+}
+
+/* PRIVATE */ int
+fmux_recv_msg_held(fmux_channel* channel, void* buf, size_t nbyte)
+{
+    if (!fmux_channel_is_good(channel)) return 0;
+    if (channel->type != FMUX_CHANTYPE_BIN) { errno = EINVAL; return -1; }
+
+    if (channel->handle->sync_read)
+        fmux_flush_reads(channel->handle);
+    ssize_t n;
+    do {
+        n = recv(channel->sock[0], buf, nbyte, MSG_TRUNC);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0) {
+        fmux_stat_read(channel, n);
+        __atomic_add_fetch(&(channel->msg_consumed), n, __ATOMIC_ACQ_REL);
+        fmux_return_credit(channel);
+    }
+    return n;
+}
+
+int
+fmux_recv_msg(fmux_channel* channel, void* buf, size_t nbyte)
+{
+    if (!fmux_channel_is_good(channel)) return 0;
+    //Closing it wakes us up, but it has to stay around until we're gone
+    fmux_channel_hold(channel);
+    int ret = fmux_recv_msg_held(channel, buf, nbyte);
+    fmux_channel_drop(channel);
+    return ret;
+}
+
+/* A background process (optional) for continuously flushing the socket.
+ * This DOES NOT spawn its own thread; YOU should do that part.
+ */
+
+struct _fmux_pump_pool {
+    int nthreads;
+    fmux_pump* pumps;
+    pthread_t* threads;
+    int* cpus; //NULL if the workers aren't pinned
+};
+
+void
+fmux_pump_init(fmux_pump* pump)
+{
+    int engine = FMUX_DEFAULT_ENGINE;
+    const char* env = getenv("FMUX_ENGINE");
+    if (env != NULL && strcmp(env, "uring") == 0) engine = FMUX_ENGINE_URING;
+    if (env != NULL && strcmp(env, "epoll") == 0) engine = FMUX_ENGINE_EPOLL;
+    fmux_pump_init_engine(pump, engine);
+}
+
+int
+fmux_pump_init_engine(fmux_pump* pump, int engine)
+{
+    pump->run = 1;
+    pump->head = NULL;
+    pump->length = 0;
+    pump->generation = 0;
+    pump->batches = 0;
+    pump->pool = NULL;
+    pump->idle = 0;
+    pump->runq = NULL;
+    pump->runq_head = 0;
+    pump->runq_len = 0;
+    pump->runq_cap = 0;
+    pthread_mutex_init(&(pump->lock), NULL);
+    pump->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pump->wakefd < 0) perror("Creating pump eventfd");
+
+    pump->engine = FMUX_ENGINE_EPOLL;
+    pump->uring = NULL;
+    pump->epfd = -1;
+    if (engine == FMUX_ENGINE_URING) pump->uring = fmux_uring_create(pump);
+    if (pump->uring != NULL) {
+        pump->engine = FMUX_ENGINE_URING;
+        return pump->engine;
+    }
+
+    //Handles are registered with the epoll set once, when they are added, so
+    //each wakeup only costs as much as the number of handles that are ready.
+    pump->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (pump->epfd < 0) perror("Creating pump epoll set");
+
+    //data.ptr == NULL marks the wakeup eventfd
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    epoll_ctl(pump->epfd, EPOLL_CTL_ADD, pump->wakefd, &ev);
+    return pump->engine;
+}
+
+/* PRIVATE */ void
+fmux_pump_wake(fmux_pump* pump)
+{
+    uint64_t one = 1;
+    if (write(pump->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("Waking pump");
+}
+
+/* PRIVATE */ int
+fmux_pump_running(fmux_pump* pump)
+{
+    //pump->run is flipped by fmux_pump_stop from another thread
+    return __atomic_load_n(&(pump->run), __ATOMIC_ACQUIRE);
+}
+
+/* PRIVATE */ void
+fmux_pump_cleanup(fmux_pump* pump)
+{
+    if (pump->uring != NULL) fmux_uring_teardown(pump);
+
+    //fmux_pump_stop pokes the eventfd while holding the lock, so taking it
+    //here guarantees it is done with the eventfd before we close it.
+    pthread_mutex_lock(&(pump->lock));
+    fmux_handle_link* cur = pump->head;
+    while (cur != NULL) {
+        //Whatever is left goes back to reading synchronously
+        cur->data->pump = NULL;
+        cur->data->sync_read = 1;
+        __atomic_store_n(&(cur->data->rx_uring), 0, __ATOMIC_RELEASE);
+        void* to_free = cur;
+        cur = cur->next;
+        free(to_free);
+    }
+    pump->head = NULL;
+    free(pump->runq);
+    pump->runq = NULL;
+    pump->runq_len = 0;
+    if (pump->epfd >= 0) close(pump->epfd);
+    close(pump->wakefd);
+    pthread_mutex_unlock(&(pump->lock));
+
+    if (pump->uring != NULL) fmux_uring_destroy(pump->uring);
+    pump->uring = NULL;
+    pthread_mutex_destroy(&(pump->lock));
+}
+
+/* Run queue. Ready handles are queued here (under pump->lock) by the thread
+ * that waited on the epoll set, and are taken off the front by that thread or
+ * off the back by an idle sibling in the same pool. */
+
+/* PRIVATE */ void
+fmux_runq_push(fmux_pump* pump, fmux_handle* handle, int events)
+{
+    handle->events |= events;
+    if (handle->queued) return; //Already waiting to be serviced
+    if (pump->runq_len == pump->runq_cap) {
+        int cap = pump->runq_cap ? pump->runq_cap * 2 : FMUX_PUMP_EVENTS;
+        fmux_handle** runq = malloc(cap * sizeof(fmux_handle*));
+        for (int i = 0; i < pump->runq_len; i++)
+            runq[i] = pump->runq[(pump->runq_head + i) % pump->runq_cap];
+        free(pump->runq);
+        pump->runq = runq;
+        pump->runq_head = 0;
+        pump->runq_cap = cap;
+    }
+    pump->runq[(pump->runq_head + pump->runq_len) % pump->runq_cap] = handle;
+    __atomic_add_fetch(&(pump->runq_len), 1, __ATOMIC_RELAXED);
+    handle->queued = 1;
+}
+
+/* PRIVATE */ fmux_handle*
+fmux_runq_take(fmux_pump* pump, int from_back, int* events)
+{
+    if (pump->runq_len == 0) return NULL;
+    int idx;
+    if (from_back) {
+        idx = (pump->runq_head + pump->runq_len - 1) % pump->runq_cap;
+    } else {
+        idx = pump->runq_head;
+        pump->runq_head = (pump->runq_head + 1) % pump->runq_cap;
+    }
+    __atomic_sub_fetch(&(pump->runq_len), 1, __ATOMIC_RELAXED);
+    fmux_handle* handle = pump->runq[idx];
+    //Clear this BEFORE servicing so that input arriving meanwhile (a new
+    //edge) queues the handle again instead of being lost.
+    handle->queued = 0;
+    *events = handle->events;
+    handle->events = 0;
+    __atomic_add_fetch(&(handle->busy), 1, __ATOMIC_ACQ_REL);
+    return handle;
+}
+
+/* PRIVATE */ void
+fmux_runq_purge(fmux_pump* pump, fmux_handle* handle)
+{
+    int kept = 0;
+    for (int i = 0; i < pump->runq_len; i++) {
+        fmux_handle* cur = pump->runq[(pump->runq_head + i) % pump->runq_cap];
+        if (cur == handle) continue;
+        pump->runq[(pump->runq_head + kept) % pump->runq_cap] = cur;
+        kept++;
+    }
+    __atomic_store_n(&(pump->runq_len), kept, __ATOMIC_RELAXED);
+    handle->queued = 0;
+    handle->events = 0;
+}
+
+/* PRIVATE */ int
+fmux_pump_has_handle(fmux_pump* pump, fmux_handle* handle)
+{
+    for (fmux_handle_link* cur = pump->head; cur != NULL; cur = cur->next)
+        if (cur->data == handle) return 1;
+    return 0;
+}
+
+/* io_uring engine. Instead of an epoll set, the pump keeps requests armed on
+ * every fd it watches: a multishot receive into provided buffers for socket
+ * links, and multishot polls for everything else. The demuxer never reads a
+ * socket link itself: it parses the buffers in place (fmux_rx_hold), or
+ * their copies on the handle's rx_inq once it falls behind. Outbound frames
+ * still go out with write()/writev() from whoever drains the handle. Which
+ * requests a watch should have depends on state other threads change, so they
+ * just put the watch on the ring's dirty list (fmux_uring_touch) and the pump
+ * thread arms or cancels whatever changed before it next waits. Completions
+ * are reaped under pump->lock, like epoll events. */
+
+#ifdef FMUX_HAVE_URING
+
+struct _fmux_uring {
+    int fd;
+    //Submission queue
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local; //Tail of what has been queued but not submitted
+    unsigned sq_submitted;
+    struct io_uring_sqe* sqes;
+    //Completion queue
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+    void* sq_map;
+    size_t sq_map_len;
+    void* cq_map;
+    size_t cq_map_len;
+    size_t sqes_len;
+    //Provided buffers for multishot receives (each FMUX_URING_SLOT bytes,
+    //headroom first); given back once the demuxer is done with them, which
+    //any thread may do, under lock
+    struct io_uring_buf_ring* br;
+    size_t br_len;
+    unsigned short br_tail;
+    char* bufs;
+    //Pump thread only
+    int wake_armed; //A multishot poll on pump->wakefd
+    int woken; //It fired; drain the eventfd once pump->lock is let go
+    int nlive; //Watch requests in flight
+    int stopping; //Cancel everything; see fmux_uring_teardown
+    //Watches whose requests need arming or cancelling, oldest first
+    pthread_mutex_t lock;
+    struct fmux_watch* dirty;
+    struct fmux_watch* dirty_tail;
+    int running; //The pump thread is reconciling; under lock
+    pthread_t thread;
+};
+
+/* PRIVATE */ int
+fmux_is_socket(int fd)
+{
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode);
+}
+
+/* PRIVATE */ void
+fmux_uring_recycle(fmux_uring* ring, int bid)
+{
+    struct io_uring_buf* buf = &(ring->br->bufs[ring->br_tail & (FMUX_URING_BUFFERS - 1)]);
+    buf->addr = (uintptr_t)(ring->bufs + (size_t)bid * FMUX_URING_SLOT + FMUX_URING_HEADROOM);
+    buf->len = FMUX_URING_BUFSIZE;
+    buf->bid = bid;
+    ring->br_tail++;
+    __atomic_store_n(&(ring->br->tail), ring->br_tail, __ATOMIC_RELEASE);
+}
+
+void
+fmux_uring_give_back(fmux_pump* pump, int bid)
+{
+    fmux_uring* ring = pump->uring;
+    pthread_mutex_lock(&(ring->lock));
+    fmux_uring_recycle(ring, bid);
+    pthread_mutex_unlock(&(ring->lock));
+}
+
+/* PRIVATE */ void
+fmux_uring_unref(fmux_handle* handle)
+{
+    //One less request or dirty watch; the last one wakes fmux_uring_settle.
+    //handle may be gone as soon as that's done.
+    if (__atomic_sub_fetch(&(handle->uring_live), 1, __ATOMIC_ACQ_REL) == FMUX_URING_SETTLING)
+        syscall(SYS_futex, &(handle->uring_live), FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+fmux_uring*
+fmux_uring_create(fmux_pump* pump)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    //Multishot requests can complete many times per submission
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = FMUX_URING_ENTRIES * 16;
+    int fd = syscall(__NR_io_uring_setup, FMUX_URING_ENTRIES, &params);
+    if (fd < 0) return NULL;
+
+    fmux_uring* ring = calloc(1, sizeof(fmux_uring));
+    ring->fd = fd;
+    pthread_mutex_init(&(ring->lock), NULL);
+    ring->sq_map_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->sq_map_len = ring->cq_map_len = MAX(ring->sq_map_len, ring->cq_map_len);
+    ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->cq_map = ring->sq_map;
+    if (ring->sq_map != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP))
+        ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    ring->br_len = FMUX_URING_BUFFERS * sizeof(struct io_uring_buf);
+    ring->br = mmap(NULL, ring->br_len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED ||
+        ring->sqes == MAP_FAILED || ring->br == MAP_FAILED) {
+        fmux_uring_destroy(ring);
+        return NULL;
+    }
+
+    char* sq = ring->sq_map;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local = ring->sq_submitted = *(ring->sq_tail);
+    char* cq = ring->cq_map;
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    //Kernels without provided buffer rings (or multishot receives) are no
+    //use to us; the caller falls back to epoll
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)ring->br;
+    reg.ring_entries = FMUX_URING_BUFFERS;
+    reg.bgid = FMUX_URING_BGID;
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        fmux_uring_destroy(ring);
+        return NULL;
+    }
+    ring->bufs = malloc((size_t)FMUX_URING_BUFFERS * FMUX_URING_SLOT);
+    for (int i = 0; i < FMUX_URING_BUFFERS; i++)
+        fmux_uring_recycle(ring, i);
+
+    (void)pump;
+    return ring;
+}
+
+void
+fmux_uring_destroy(fmux_uring* ring)
+{
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_map != NULL && ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map)
+        munmap(ring->cq_map, ring->cq_map_len);
+    if (ring->sq_map != NULL && ring->sq_map != MAP_FAILED) munmap(ring->sq_map, ring->sq_map_len);
+    close(ring->fd); //Also unregisters the buffer ring
+    if (ring->br != NULL && ring->br != MAP_FAILED) munmap(ring->br, ring->br_len);
+    pthread_mutex_destroy(&(ring->lock));
+    free(ring->bufs);
+    free(ring);
+}
+
+/* PRIVATE */ int
+fmux_uring_enter(fmux_uring* ring, int wait)
+{
+    //Submit whatever has been queued, and optionally block for a completion
+    __atomic_store_n(ring->sq_tail, ring->sq_local, __ATOMIC_RELEASE);
+    unsigned submit = ring->sq_local - ring->sq_submitted;
+    int n = syscall(__NR_io_uring_enter, ring->fd, submit, wait ? 1 : 0,
+                    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (n > 0) ring->sq_submitted += n;
+    return n;
+}
+
+/* PRIVATE */ struct io_uring_sqe*
+fmux_uring_sqe(fmux_uring* ring)
+{
+    if (ring->sq_local - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries) {
+        //Full; hand what we have to the kernel to make room
+        fmux_uring_enter(ring, 0);
+        if (ring->sq_local - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries)
+            return NULL;
+    }
+    unsigned idx = ring->sq_local & ring->sq_mask;
+    struct io_uring_sqe* sqe = &(ring->sqes[idx]);
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[idx] = idx;
+    ring->sq_local++;
+    return sqe;
+}
+
+void
+fmux_uring_touch(fmux_pump* pump, struct fmux_watch* watch)
+{
+    //Have the pump thread look at watch's requests again. Every dirty watch
+    //counts towards handle->uring_live, like an armed request, so nobody
+    //lets go of the handle while the pump may still look at it.
+    fmux_uring* ring = pump->uring;
+    pthread_mutex_lock(&(ring->lock));
+    if (!watch->uring_dirty) {
+        watch->uring_dirty = 1;
+        watch->uring_next = NULL;
+        if (ring->dirty == NULL) ring->dirty = watch;
+        else ring->dirty_tail->uring_next = watch;
+        ring->dirty_tail = watch;
+        __atomic_add_fetch(&(watch->handle->uring_live), 1, __ATOMIC_ACQ_REL);
+    }
+    int wake = !ring->running || !pthread_equal(ring->thread, pthread_self());
+    pthread_mutex_unlock(&(ring->lock));
+    if (wake) fmux_pump_wake(pump);
+}
+
+int
+fmux_uring_quiet(fmux_pump* pump, struct fmux_watch* watch)
+{
+    //Holding pump->lock: nothing armed, cancelling or waiting to be looked
+    //at refers to watch anymore
+    if (watch->uring_armed || watch->uring_cancelling) return 0;
+    fmux_uring* ring = pump->uring;
+    pthread_mutex_lock(&(ring->lock));
+    int dirty = watch->uring_dirty;
+    pthread_mutex_unlock(&(ring->lock));
+    return !dirty;
+}
+
+/* PRIVATE */ void
+fmux_uring_touch_handle(fmux_pump* pump, fmux_handle* handle)
+{
+    fmux_uring_touch(pump, &(handle->watch));
+    if (__atomic_load_n(&(handle->cork_timerfd), __ATOMIC_ACQUIRE) >= 0)
+        fmux_uring_touch(pump, &(handle->cork_watch));
+    //A link's channels (the ones whose watches are its) are its bond's
+    fmux_handle* bond = handle->bond;
+    pthread_mutex_lock(&(bond->chan_lock));
+    for (int i = 0; i < bond->nactive; i++) {
+        if (bond->active[i]->sock[1] >= 0)
+            fmux_uring_touch(pump, &(bond->active[i]->watch));
+    }
+    for (fmux_channel* cur = bond->closed; cur != NULL; cur = cur->next_closed)
+        fmux_uring_touch(pump, &(cur->watch));
+    pthread_mutex_unlock(&(bond->chan_lock));
+}
 
-fmux_handle*
-fmux_open(int fd, int max_channels)
+/* PRIVATE */ int
+fmux_uring_want(fmux_pump* pump, struct fmux_watch* watch)
 {
-    fmux_handle* ret = malloc(sizeof(fmux_handle));
-    memset(ret, 0, sizeof(fmux_handle));
+    //Which requests watch should have armed, by kind
+    fmux_handle* handle = watch->handle;
+    if (pump->uring->stopping || handle->pump != pump) return 0;
+    if (watch->kind == FMUX_WATCH_CHANNEL) {
+        fmux_channel* channel = watch->channel;
+        if (!fmux_channel_sends_on(channel, handle) || channel->sock[1] < 0) return 0;
+        int want = 1 << FMUX_URING_POLLIN;
+        if (__atomic_load_n(&(channel->credit_watch), __ATOMIC_RELAXED))
+            want |= 1 << FMUX_URING_POLLOUT;
+        return want;
+    }
+    if (watch->kind == FMUX_WATCH_TIMER)
+        return (__atomic_load_n(&(handle->cork_timerfd), __ATOMIC_ACQUIRE) >= 0) ? 1 << FMUX_URING_POLLIN : 0;
+    int want = 0;
+    if (!__atomic_load_n(&(handle->rx_uring), __ATOMIC_ACQUIRE)) {
+        want |= 1 << FMUX_URING_POLLIN;
+    } else if (!__atomic_load_n(&(handle->rx_inq_paused), __ATOMIC_ACQUIRE) &&
+               !__atomic_load_n(&(handle->rx_inq_eof), __ATOMIC_ACQUIRE)) {
+        want |= 1 << FMUX_URING_RECV;
+    }
+    if (handle->out_blocked) want |= 1 << FMUX_URING_POLLOUT;
+    return want;
+}
 
-    ret->fd = fd;
-    ret->max_channels = max_channels;
-    ret->sync_read = 1;
-    ret->channels = malloc(max_channels * sizeof(fmux_channel*));
-    memset(ret->channels, 0, max_channels * sizeof(fmux_channel*));
+/* PRIVATE */ void
+fmux_uring_arm(fmux_uring* ring, struct fmux_watch* watch, int kind)
+{
+    struct io_uring_sqe* sqe = fmux_uring_sqe(ring);
+    if (sqe == NULL) return; //Stays unarmed; we'll notice next time it's touched
+    if (watch->kind == FMUX_WATCH_LINK) sqe->fd = watch->handle->fd;
+    else if (watch->kind == FMUX_WATCH_TIMER) sqe->fd = watch->handle->cork_timerfd;
+    else sqe->fd = watch->channel->sock[1];
+    sqe->user_data = (uintptr_t)watch | kind;
+    if (kind == FMUX_URING_RECV) {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = FMUX_URING_BGID;
+    } else {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->poll32_events = (kind == FMUX_URING_POLLIN) ? POLLIN : POLLOUT;
+    }
+    watch->uring_armed |= 1 << kind;
+    ring->nlive++;
+    __atomic_add_fetch(&(watch->handle->uring_live), 1, __ATOMIC_ACQ_REL);
+}
 
-    pthread_mutex_init(&(ret->lock), NULL);
+/* PRIVATE */ void
+fmux_uring_cancel(fmux_uring* ring, struct fmux_watch* watch, int kind)
+{
+    //The request's own (final) completion is what disarms it
+    struct io_uring_sqe* sqe = fmux_uring_sqe(ring);
+    if (sqe == NULL) return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uintptr_t)watch | kind;
+    sqe->user_data = 0;
+    watch->uring_cancelling |= 1 << kind;
+}
 
-    fmux_open_channel(ret, 0);
+/* PRIVATE */ void
+fmux_uring_reconcile(fmux_pump* pump)
+{
+    //Pump thread, holding pump->lock
+    fmux_uring* ring = pump->uring;
+    if (!ring->wake_armed && !ring->stopping) {
+        struct io_uring_sqe* sqe = fmux_uring_sqe(ring);
+        if (sqe != NULL) {
+            //A NULL watch marks the wakeup eventfd
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = pump->wakefd;
+            sqe->len = IORING_POLL_ADD_MULTI;
+            sqe->poll32_events = POLLIN;
+            sqe->user_data = FMUX_URING_POLLIN;
+            ring->wake_armed = 1;
+        }
+    }
+    for (;;) {
+        //One at a time: a watch may be touched again as soon as it's off
+        pthread_mutex_lock(&(ring->lock));
+        struct fmux_watch* watch = ring->dirty;
+        if (watch != NULL) {
+            ring->dirty = watch->uring_next;
+            watch->uring_dirty = 0;
+        }
+        pthread_mutex_unlock(&(ring->lock));
+        if (watch == NULL) break;
 
-    return ret;
+        int want = fmux_uring_want(pump, watch);
+        for (int kind = FMUX_URING_RECV; kind <= FMUX_URING_POLLOUT; kind++) {
+            int bit = 1 << kind;
+            if ((want & bit) && !(watch->uring_armed & bit))
+                fmux_uring_arm(ring, watch, kind);
+            else if (!(want & bit) && (watch->uring_armed & bit) && !(watch->uring_cancelling & bit))
+                fmux_uring_cancel(ring, watch, kind);
+        }
+        fmux_uring_unref(watch->handle);
+    }
 }
 
-void
-fmux_close(fmux_handle* handle)
+/* PRIVATE */ int
+fmux_uring_received(fmux_pump* pump, fmux_handle* handle, int res, unsigned flags)
 {
-    for (int i = 0; i < handle->max_channels; i++) {
-        if (handle->channels[i] == NULL)
-            continue;
-        fmux_close_channel(handle, i);
+    //A multishot receive completed; returns the FMUX_EV_* it means
+    fmux_uring* ring = pump->uring;
+    fmux_stat_add(&(handle->stats.reads), 1);
+    if (flags & IORING_CQE_F_BUFFER) {
+        int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        char* data = ring->bufs + (size_t)bid * FMUX_URING_SLOT + FMUX_URING_HEADROOM;
+        if (res <= 0 || !fmux_rx_hold(handle, pump, data, res, bid)) {
+            if (res > 0 && fmux_rx_inq_append(handle, data, res))
+                fmux_uring_touch(pump, &(handle->watch)); //Pause
+            fmux_uring_give_back(pump, bid);
+        }
     }
-    free(handle->channels);
-    handle->channels = NULL;
-    int err = pthread_mutex_destroy(&(handle->lock));
-    if (err < 0) perror("Destroying mutex");
-    close(handle->fd); //Should I do this? I don't open this file descriptor...
-    free(handle);
+    if (res > 0) return FMUX_EV_IN;
+    //Out of buffers or cancelled; it's re-armed if it's still wanted
+    if (res == -ENOBUFS || res == -ECANCELED) return 0;
+    if (res == -EINVAL || res == -ENOTSOCK || res == -EOPNOTSUPP) {
+        //No multishot receive for this fd after all; poll it instead
+        __atomic_store_n(&(handle->rx_uring), 0, __ATOMIC_RELEASE);
+        return FMUX_EV_IN;
+    }
+    //EOF or an error; the demuxer sees EOF once it has caught up either way
+    fmux_rx_inq_eof(handle);
+    return FMUX_EV_IN;
 }
 
-fmux_channel*
-fmux_open_channel(fmux_handle* handle, int channel_id)
+/* PRIVATE */ void
+fmux_uring_complete(fmux_pump* pump, uint64_t user_data, int res, unsigned flags)
 {
-    if (handle == NULL) return NULL;
-    if (channel_id >= handle->max_channels) return NULL;
+    fmux_uring* ring = pump->uring;
+    if (user_data == 0) return; //An IORING_OP_ASYNC_CANCEL
+    struct fmux_watch* watch = (struct fmux_watch*)(uintptr_t)(user_data & ~(uint64_t)FMUX_URING_KINDS);
+    int kind = user_data & FMUX_URING_KINDS;
+    if (watch == NULL) {
+        ring->woken = 1;
+        if (!(flags & IORING_CQE_F_MORE)) ring->wake_armed = 0;
+        return;
+    }
 
-    if (handle->channels[channel_id] != NULL) {
-        return handle->channels[channel_id];
+    fmux_handle* ready = watch->handle;
+    int attached = (ready->pump == pump);
+    int found = 0;
+    if (kind == FMUX_URING_RECV) {
+        found = fmux_uring_received(pump, ready, res, flags);
+    } else if (res > 0 && watch->kind == FMUX_WATCH_CHANNEL) {
+        //Same as fmux_pump_start does with epoll events
+        if ((res & ~POLLOUT) && attached && fmux_channel_sends_on(watch->channel, ready)) {
+            fmux_queue_out(ready, watch->channel, 0);
+            found |= FMUX_EV_OUT;
+        }
+        if (res & POLLOUT) found |= FMUX_EV_RESUME;
+    } else if (res > 0 && watch->kind == FMUX_WATCH_TIMER) {
+        found |= FMUX_EV_FLUSH;
+    } else if (res > 0) {
+        if (res & (POLLIN | POLLHUP | POLLERR)) found |= FMUX_EV_IN;
+        if (res & POLLOUT) found |= FMUX_EV_OUT;
     }
 
-    fmux_channel* chan = malloc(sizeof(fmux_channel));
-    chan->id = channel_id;
-    chan->handle = handle;
-    chan->type = FMUX_CHANTYPE_TEXT; //Does this matter?
-    socketpair(AF_LOCAL, SOCK_STREAM, 0, chan->sock);
-    handle->channels[channel_id] = chan;
+    if (!(flags & IORING_CQE_F_MORE)) {
+        //That was its last completion; re-arm it if it is still wanted
+        watch->uring_armed &= ~(1 << kind);
+        watch->uring_cancelling &= ~(1 << kind);
+        ring->nlive--;
+        fmux_uring_touch(pump, watch);
+        fmux_uring_unref(ready);
+    }
+    if (found && attached) fmux_runq_push(pump, ready, found);
+}
 
-    return chan;
+/* PRIVATE */ void
+fmux_uring_reap(fmux_pump* pump)
+{
+    //Pump thread, holding pump->lock
+    fmux_uring* ring = pump->uring;
+    unsigned head = *(ring->cq_head);
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe* cqe = &(ring->cqes[head & ring->cq_mask]);
+        fmux_uring_complete(pump, cqe->user_data, cqe->res, cqe->flags);
+        head++;
+        //Hand each slot back right away; buffers are already recycled
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        if (head == tail) tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    }
 }
 
-int
-fmux_close_channel(fmux_handle* handle, int index)
+/* PRIVATE */ int
+fmux_uring_wait(fmux_pump* pump)
 {
-    if (handle == NULL) return -1;
-    if (index >= handle->max_channels) return -1;
+    //What epoll_wait is to the epoll engine
+    fmux_uring* ring = pump->uring;
+    pthread_mutex_lock(&(pump->lock));
+    fmux_uring_reconcile(pump);
+    pthread_mutex_unlock(&(pump->lock));
 
-    fmux_channel* channel = handle->channels[index];
-    handle->channels[index] = NULL;
-    close(channel->sock[0]);
-    close(channel->sock[1]);
-    channel->handle = NULL;
-    free(channel);
+    __atomic_store_n(&(pump->idle), 1, __ATOMIC_RELEASE);
+    int n = fmux_uring_enter(ring, 1);
+    __atomic_store_n(&(pump->idle), 0, __ATOMIC_RELEASE);
+    //Like epoll_wait, waiting is where a cancelled pump thread should stop,
+    //rather than somewhere it holds pump->lock
+    pthread_testcancel();
+    //EBUSY/EAGAIN: completions have backed up; reaping makes room
+    if (n < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+        perror("Waiting on pump");
+        return -1;
+    }
+
+    pthread_mutex_lock(&(pump->lock));
+    fmux_uring_reap(pump);
+    int nqueued = pump->runq_len;
+    pthread_mutex_unlock(&(pump->lock));
+
+    if (ring->woken) {
+        uint64_t count;
+        while (read(pump->wakefd, &count, sizeof(count)) > 0);
+        ring->woken = 0;
+    }
+
+    if (pump->pool != NULL) fmux_pump_share(pump, nqueued);
     return 0;
 }
 
-int
-fmux_channel_is_good(fmux_channel* channel)
+/* PRIVATE */ void
+fmux_uring_run(fmux_pump* pump)
 {
-    if (channel == NULL) return 0;
-    if (channel->handle == NULL) return 0;
-    if (channel->id < 0 || channel->id > channel->handle->max_channels) return 0;
-
-    return 1;
+    fmux_uring* ring = pump->uring;
+    pthread_mutex_lock(&(ring->lock));
+    ring->running = 1;
+    ring->thread = pthread_self();
+    pthread_mutex_unlock(&(ring->lock));
 }
 
-int
-fmux_channel_read_fd(fmux_channel* channel)
+void
+fmux_uring_teardown(fmux_pump* pump)
 {
-    if (fmux_channel_is_good(channel)) return channel->sock[0];
-    return -1;
+    //Cancel everything and wait for the last completion of each request, so
+    //that no data a handle has been sent is left behind in the ring
+    fmux_uring* ring = pump->uring;
+    pthread_mutex_lock(&(pump->lock));
+    ring->stopping = 1;
+    for (fmux_handle_link* cur = pump->head; cur != NULL; cur = cur->next)
+        fmux_uring_touch_handle(pump, cur->data);
+    for (;;) {
+        fmux_uring_reconcile(pump);
+        if (ring->nlive == 0) break;
+        pthread_mutex_unlock(&(pump->lock));
+        if (fmux_uring_enter(ring, 1) < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+            perror("Stopping pump");
+            pthread_mutex_lock(&(pump->lock));
+            break;
+        }
+        pthread_mutex_lock(&(pump->lock));
+        fmux_uring_reap(pump);
+    }
+    //Nor in buffers the ring is about to take with it
+    for (fmux_handle_link* cur = pump->head; cur != NULL; cur = cur->next)
+        fmux_rx_spill(cur->data);
+    pthread_mutex_lock(&(ring->lock));
+    ring->running = 0;
+    pthread_mutex_unlock(&(ring->lock));
+    pthread_mutex_unlock(&(pump->lock));
 }
 
-int
-fmux_channel_write_fd(fmux_channel* channel)
+/* PRIVATE */ void
+fmux_uring_settle(fmux_pump* pump, fmux_handle* handle)
 {
-    if (fmux_channel_is_good(channel)) return channel->sock[1];
-    return -1;
+    //After handle has been taken off the pump: wait for the pump thread to
+    //cancel whatever it had armed for it. If that thread isn't running,
+    //nothing is armed and only the dirty list refers to handle.
+    fmux_uring* ring = pump->uring;
+    pthread_mutex_lock(&(ring->lock));
+    if (!ring->running) {
+        struct fmux_watch** link = &(ring->dirty);
+        ring->dirty_tail = NULL;
+        while (*link != NULL) {
+            struct fmux_watch* watch = *link;
+            if (watch->handle != handle) {
+                ring->dirty_tail = watch;
+                link = &(watch->uring_next);
+                continue;
+            }
+            *link = watch->uring_next;
+            watch->uring_dirty = 0;
+            __atomic_sub_fetch(&(handle->uring_live), 1, __ATOMIC_ACQ_REL);
+        }
+    }
+    pthread_mutex_unlock(&(ring->lock));
+    //The pump thread reaps the cancellations, so sleep until it's done
+    int live = __atomic_or_fetch(&(handle->uring_live), FMUX_URING_SETTLING, __ATOMIC_ACQ_REL);
+    while (live != FMUX_URING_SETTLING) {
+        syscall(SYS_futex, &(handle->uring_live), FUTEX_WAIT_PRIVATE, live, NULL, NULL, 0);
+        live = __atomic_load_n(&(handle->uring_live), __ATOMIC_ACQUIRE);
+    }
+    __atomic_and_fetch(&(handle->uring_live), ~FMUX_URING_SETTLING, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&(handle->rx_uring), 0, __ATOMIC_RELEASE);
+    //What it received and still holds goes back to this pump's ring
+    fmux_rx_spill(handle);
 }
 
-/* Reading */
+#else //FMUX_HAVE_URING
+
+//Without io_uring, pumps never get a ring and none of the rest is reached
+
+fmux_uring*
+fmux_uring_create(fmux_pump* pump) { (void)pump; return NULL; }
+
+void
+fmux_uring_destroy(fmux_uring* ring) { (void)ring; }
+
+void
+fmux_uring_touch(fmux_pump* pump, struct fmux_watch* watch) { (void)pump; (void)watch; }
+
+void
+fmux_uring_teardown(fmux_pump* pump) { (void)pump; }
+
+/* PRIVATE */ int
+fmux_is_socket(int fd) { (void)fd; return 0; }
+
+/* PRIVATE */ void
+fmux_uring_touch_handle(fmux_pump* pump, fmux_handle* handle) { (void)pump; (void)handle; }
 
 int
-fmux_pop(fmux_handle* handle, fmux_message** message)
+fmux_uring_quiet(fmux_pump* pump, struct fmux_watch* watch) { (void)pump; (void)watch; return 1; }
+
+/* PRIVATE */ int
+fmux_uring_wait(fmux_pump* pump) { (void)pump; return -1; }
+
+void
+fmux_uring_give_back(fmux_pump* pump, int bid) { (void)pump; (void)bid; }
+
+/* PRIVATE */ void
+fmux_uring_run(fmux_pump* pump) { (void)pump; }
+
+/* PRIVATE */ void
+fmux_uring_settle(fmux_pump* pump, fmux_handle* handle) { (void)pump; (void)handle; }
+
+#endif //FMUX_HAVE_URING
+
+/* Outbound draining. The pump watches every channel's sock[1]; channels with
+ * data waiting are queued on the handle and drained a chunk at a time, round
+ * robin, for as long as the underlying fd will take more. */
+
+void
+fmux_queue_out(fmux_handle* handle, fmux_channel* channel, int at_front)
 {
-    int channel_id, len, tmp[2];
-    read(handle->fd, tmp, 8);
-    channel_id = ntohl(tmp[0]);
-    len = ntohl(tmp[1]);
-    *message = realloc(*message, len + 2*sizeof(uint32_t));
-    memset(*message, 0, len + 2*sizeof(int));
-    (*message)->channel_id = channel_id;
-    (*message)->nbytes = len;
-    if (pthread_mutex_lock(&(handle->lock)) != 0) return -1;
-    read(handle->fd, (*message)->data, len);
-    pthread_mutex_unlock(&(handle->lock));
-    return 1;
+    pthread_mutex_lock(&(handle->out_lock));
+    if (!channel->out_queued && fmux_channel_sends_on(channel, handle)) {
+        int level = channel->priority;
+        channel->out_queued = 1;
+        channel->out_level = level;
+        channel->out_next = NULL;
+        if (handle->out_head[level] == NULL) {
+            handle->out_head[level] = handle->out_tail[level] = channel;
+        } else if (at_front) {
+            channel->out_next = handle->out_head[level];
+            handle->out_head[level] = channel;
+        } else {
+            handle->out_tail[level]->out_next = channel;
+            handle->out_tail[level] = channel;
+        }
+    }
+    pthread_mutex_unlock(&(handle->out_lock));
 }
 
-/* PRIVATE */ int
-fmux_flush_reads(fmux_handle* handle)
+void
+fmux_unqueue_out(fmux_handle* handle, fmux_channel* channel)
 {
-    int m_read = 0;
-    struct pollfd pfd = {.fd = handle->fd, .events = POLLIN };
-    while (poll(&pfd, 1, 0) == 1) {
-        fmux_message* mess = malloc(2 * sizeof(uint32_t));
-        fmux_pop(handle, &mess);
-        if (mess->channel_id < handle->max_channels && handle->channels[mess->channel_id] != NULL) {
-            write(handle->channels[mess->channel_id]->sock[1], mess->data, mess->nbytes);
-            m_read++;
+    pthread_mutex_lock(&(handle->out_lock));
+    if (channel->out_queued) {
+        int level = channel->out_level;
+        fmux_channel* prev = NULL;
+        for (fmux_channel* cur = handle->out_head[level]; cur != NULL; prev = cur, cur = cur->out_next) {
+            if (cur != channel) continue;
+            if (prev == NULL) handle->out_head[level] = cur->out_next;
+            else prev->out_next = cur->out_next;
+            if (handle->out_tail[level] == cur) handle->out_tail[level] = prev;
+            break;
         }
-        free(mess);
+    }
+    channel->out_queued = 0;
+    channel->out_next = NULL;
+    pthread_mutex_unlock(&(handle->out_lock));
+}
 
-        //Reset the struct
-        pfd.fd = handle->fd;
-        pfd.events = POLLIN;
+/* PRIVATE */ fmux_channel*
+fmux_dequeue_out(fmux_handle* handle)
+{
+    //From the most urgent level that has anything
+    pthread_mutex_lock(&(handle->out_lock));
+    fmux_channel* channel = NULL;
+    for (int level = FMUX_PRIORITY_LEVELS - 1; level >= 0 && channel == NULL; level--) {
+        channel = handle->out_head[level];
+        if (channel == NULL) continue;
+        handle->out_head[level] = channel->out_next;
+        if (handle->out_head[level] == NULL) handle->out_tail[level] = NULL;
+        //Cleared BEFORE draining so that new data re-queues the channel
+        channel->out_queued = 0;
+        channel->out_next = NULL;
     }
-    return m_read;
+    pthread_mutex_unlock(&(handle->out_lock));
+    return channel;
 }
 
 int
-fmux_select(fmux_handle* handle, fmux_channel** ready, struct timeval *restrict timeout)
+fmux_schedule_out_locked(fmux_handle* handle, int nonblocking)
 {
-    if (handle->sync_read)
-        fmux_flush_reads(handle);
-
-    fd_set fds;
-    int nfds = 0;
-    FD_ZERO(&fds);
-    for (int i = 0; i < handle->max_channels; i++) {
-        if (handle->channels[i] == NULL) continue;
-        FD_SET(handle->channels[i]->sock[0], &fds);
-        nfds = MAX(nfds, handle->channels[i]->sock[0]);
+    //Deficit round robin within each priority level, and strict priority
+    //between levels: a channel gets weight * FMUX_QUANTUM bytes per turn, but
+    //steps aside mid-turn for anything more urgent and then picks up where
+    //it left off. With nonblocking set (the pump), this stops when the fd
+    //won't take more and returns 1, and channels that used up their turn go
+    //to the back of the line. Otherwise each channel gets one turn.
+    //Frames are gathered into tx_buf and written out a batch at a time.
+    fmux_channel* channel;
+    size_t held = handle->tx_len; //By cork mode, from before
+    //In non-blocking mode, what's queued goes first, and past the high-water
+    //mark the rest waits in the channel fds until the fd is writable
+    size_t mark = __atomic_load_n(&(handle->high_water), __ATOMIC_RELAXED);
+    if (mark && fmux_txq_drain_locked(handle, 0) < 0 && errno != EAGAIN) return -1;
+    while ((channel = fmux_dequeue_out(handle)) != NULL) {
+        if (mark && handle->txq_len >= mark) {
+            fmux_queue_out(handle, channel, 1);
+            return 1;
+        }
+        if (nonblocking && handle->tx_len <= held) {
+            struct pollfd pfd = {.fd = handle->fd, .events = POLLOUT};
+            if (poll(&pfd, 1, 0) != 1 || !(pfd.revents & POLLOUT)) {
+                fmux_queue_out(handle, channel, 1);
+                return 1;
+            }
+        }
+        if (fmux_tx_outranked(handle, channel->priority)) {
+            if (fmux_tx_flush_locked(handle) < 0) return -1;
+            fmux_tx_yield(handle, channel->priority);
+        }
+        if (channel->deficit <= 0)
+            channel->deficit += (int64_t)FMUX_QUANTUM * channel->weight;
+        int n = fmux_gather_channel_locked(handle, channel, channel->deficit);
+        if (n < 0) return -1;
+        //A channel that came up empty (or out of credit) loses the rest of
+        //its turn; it will be queued again by its next edge.
+        if (n == 0) {
+            channel->deficit = 0;
+            continue;
+        }
+        channel->deficit -= n;
+        if (channel->deficit > 0) fmux_queue_out(handle, channel, 1);
+        else if (nonblocking) fmux_queue_out(handle, channel, 0);
     }
-    nfds = select(nfds + 1, &fds, NULL, NULL, timeout);
-    if (nfds == -1 || ready == NULL) return nfds;
+    int err = fmux_tx_release_locked(handle);
+    return (err == 0 && handle->txq_len > 0) ? 1 : err;
+}
 
-    for (int i = 0, j = 0; i < handle->max_channels && j < nfds; i++) {
-        if (handle->channels[i] == NULL) continue;
-        if (FD_ISSET(handle->channels[i]->sock[0], &fds)) {
-            ready[j] = handle->channels[i];
-            j++;
-        }
+/* PRIVATE */ void
+fmux_pump_watch_link(fmux_pump* pump, fmux_handle* handle, int op)
+{
+    if (pump->uring != NULL) {
+        fmux_uring_touch(pump, &(handle->watch));
+        return;
     }
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLET, .data.ptr = &(handle->watch)};
+    if (handle->out_blocked) ev.events |= EPOLLOUT;
+    epoll_ctl(pump->epfd, op, handle->fd, &ev);
+}
 
-    return nfds;
+void
+fmux_pump_watch_channel(fmux_pump* pump, fmux_channel* channel, int op)
+{
+    //Anything already sitting in sock[1] is reported right away. EPOLLOUT
+    //fires as the application reads from sock[0]; see fmux_rx_watch_credit.
+    if (pump->uring != NULL) {
+        fmux_uring_touch(pump, &(channel->watch));
+        return;
+    }
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLET, .data.ptr = &(channel->watch)};
+    if (__atomic_load_n(&(channel->credit_watch), __ATOMIC_RELAXED)) ev.events |= EPOLLOUT;
+    epoll_ctl(pump->epfd, op, channel->sock[1], &ev);
 }
 
-int
-fmux_read(fmux_channel* channel, void* buf, size_t nbyte)
+void
+fmux_pump_watch_cork(fmux_pump* pump, fmux_handle* handle)
 {
-    if (!fmux_channel_is_good(channel)) return 0;
+    //pump->lock must be held
+    if (pump->uring != NULL) {
+        fmux_uring_touch(pump, &(handle->cork_watch));
+        return;
+    }
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLET, .data.ptr = &(handle->cork_watch)};
+    epoll_ctl(pump->epfd, EPOLL_CTL_ADD, handle->cork_timerfd, &ev);
+}
 
-    if (channel->handle->sync_read)
-        fmux_flush_reads(channel->handle);
-    return read(channel->sock[0], buf, nbyte);
+void
+fmux_pump_watch_credit(fmux_handle* handle, fmux_channel* channel)
+{
+    fmux_pump* pump = handle->pump;
+    if (pump == NULL || channel->sock[1] < 0) return;
+    pthread_mutex_lock(&(pump->lock));
+    if (handle->pump == pump) fmux_pump_watch_channel(pump, channel, EPOLL_CTL_MOD);
+    pthread_mutex_unlock(&(pump->lock));
 }
 
-/* Writing */
+/* PRIVATE */ void
+fmux_drain_out(fmux_pump* owner, fmux_handle* handle)
+{
+    pthread_mutex_lock(&(handle->lock));
+    //Don't block the pump on a slow peer; come back on EPOLLOUT
+    int blocked = (fmux_schedule_out_locked(handle, 1) == 1);
+    if (blocked != handle->out_blocked) {
+        handle->out_blocked = blocked;
+        fmux_pump_watch_link(owner, handle, EPOLL_CTL_MOD);
+    }
+    fmux_tx_unlock(handle);
+}
 
-int
-fmux_push(fmux_handle* handle, fmux_message* message)
+/* PRIVATE */ void
+fmux_pump_kick(fmux_handle* handle, int events)
 {
-    int id = message->channel_id;
-    int bytes = message->nbytes;
-    message->nbytes = htonl(bytes);
-    message->channel_id = htonl(id);
-    if (pthread_mutex_lock(&(handle->lock)) != 0) return -1;
-    int err = write(handle->fd, message, bytes + 8);
-    pthread_mutex_unlock(&(handle->lock));
-    return err;
+    fmux_pump* pump = handle->pump;
+    if (pump == NULL) return;
+    pthread_mutex_lock(&(pump->lock));
+    if (handle->pump == pump) {
+        fmux_runq_push(pump, handle, events);
+        fmux_pump_wake(pump);
+    }
+    pthread_mutex_unlock(&(pump->lock));
 }
 
-/* PRIVATE */ int
-fmux_flush_writes(fmux_handle* handle)
+void
+fmux_kick_reads(fmux_handle* handle)
 {
-    fd_set fds;
-    int nfds = 0;
-    FD_ZERO(&fds);
-    for (int i = 0; i < handle->max_channels; i++) {
-        if (handle->channels[i] == NULL) continue;
-        FD_SET(handle->channels[i]->sock[1], &fds);
-        nfds = MAX(nfds, handle->channels[i]->sock[1]);
-    }
-    struct timeval timeout;
-    timeout.tv_sec = 0; timeout.tv_usec = 0;
-    int n = select(nfds + 1, &fds, NULL, NULL, &timeout);
-    int nwritten = 0;
-    for (int i = 0; i < handle->max_channels && nwritten >= 0; i++) {
-        if (handle->channels[i] == NULL) continue;
-        if (FD_ISSET(handle->channels[i]->sock[1], &fds)) {
-            char buf[1024];
-            int bytes = read(handle->channels[i]->sock[1], buf, 1024);
-            fmux_message* mess = malloc(bytes + 2*sizeof(uint32_t));
-            memset(mess, 0, bytes + 2*sizeof(uint32_t));
-            mess->channel_id = i;
-            mess->nbytes = bytes;
-            memcpy(mess->data, buf, bytes);
-            nwritten = fmux_push(handle, mess);
-            free(mess);
-        }
-    }
-    return (nwritten >= 0);
+    //Have whoever reads this handle (and its links) pick up where the
+    //demuxer left off. Without a pump, fmux_read calls fmux_flush_reads.
+    for (int i = 0; i < __atomic_load_n(&(handle->nlinks), __ATOMIC_ACQUIRE); i++)
+        fmux_pump_kick(handle->links[i], FMUX_EV_RESUME);
 }
 
-int
-fmux_write(fmux_channel* channel, const void* buf, size_t nbyte)
+void
+fmux_kick_writes(fmux_handle* handle, fmux_channel* channel)
 {
-    if (!fmux_channel_is_good(channel)) return 0;
+    //Have the pump drain a channel it stopped on for lack of credit.
+    //Without a pump, fmux_writev calls fmux_flush_writes itself.
+    if (handle->pump == NULL) return;
+    fmux_queue_out(handle, channel, 0);
+    fmux_pump_kick(handle, FMUX_EV_OUT);
+}
 
-    int nwritten = write(channel->sock[0], buf, nbyte);
-    if (!fmux_flush_writes(channel->handle)) return -1;
-    return nwritten;
+/* PRIVATE */ void
+fmux_pump_service(fmux_pump* owner, fmux_handle* handle, int events)
+{
+    if (events & FMUX_EV_IN)
+        fmux_service_reads(handle, 1);
+    else if (events & FMUX_EV_RESUME)
+        fmux_service_reads(handle, 0);
+    if (events & FMUX_EV_OUT)
+        fmux_drain_out(owner, handle);
+    if (events & FMUX_EV_FLUSH)
+        fmux_cork_expired(handle);
+    //The last one out wakes fmux_pump_remove_handle; handle may be gone
+    //right after
+    if (__atomic_sub_fetch(&(handle->busy), 1, __ATOMIC_ACQ_REL) == FMUX_BUSY_WAITING)
+        syscall(SYS_futex, &(handle->busy), FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
 }
 
-/* A background process (optional) for continuously flushing the socket.
- * This DOES NOT spawn its own thread; YOU should do that part.
- */
+/* PRIVATE */ fmux_handle*
+fmux_pump_next(fmux_pump* pump, fmux_pump** owner, int* events)
+{
+    pthread_mutex_lock(&(pump->lock));
+    fmux_handle* handle = fmux_runq_take(pump, 0, events);
+    pthread_mutex_unlock(&(pump->lock));
+    *owner = pump;
+    if (handle != NULL || pump->pool == NULL) return handle;
 
+    //Nothing of our own to do, so help out a busy sibling
+    fmux_pump_pool* pool = pump->pool;
+    for (int i = 0; i < pool->nthreads && handle == NULL; i++) {
+        fmux_pump* victim = &(pool->pumps[i]);
+        //Unlocked peek; it's only a hint
+        if (victim == pump || __atomic_load_n(&(victim->runq_len), __ATOMIC_RELAXED) == 0)
+            continue;
+        pthread_mutex_lock(&(victim->lock));
+        handle = fmux_runq_take(victim, 1, events);
+        pthread_mutex_unlock(&(victim->lock));
+        *owner = victim;
+    }
+    return handle;
+}
 
 void
-fmux_pump_init(fmux_pump* pump)
+fmux_pump_share(fmux_pump* pump, int nqueued)
 {
-    pump->run = 1;
-    pump->head = NULL;
-    pump->length = 0;
-    pthread_mutex_init(&(pump->lock), NULL);
+    //Wake idle siblings so they can steal whatever we won't get to right away
+    fmux_pump_pool* pool = pump->pool;
+    for (int i = 0; i < pool->nthreads && nqueued > 1; i++) {
+        fmux_pump* sibling = &(pool->pumps[i]);
+        if (sibling == pump) continue;
+        if (__atomic_exchange_n(&(sibling->idle), 0, __ATOMIC_ACQ_REL)) {
+            fmux_pump_wake(sibling);
+            nqueued--;
+        }
+    }
 }
 
 int
 fmux_pump_start(fmux_pump* pump)
 {
-    while (pump->run) {
-        if (pump->head == NULL) {
-            sleep(1); //Don't waste cycles busy-waiting
-            //TODO: Replace this with a semaphore; if the semaphore allows this
-            // code to execute and pump->head is still NULL, just continue because
-            // we can assume that (maybe?) pump->run has also been set to 0.
+    struct epoll_event events[FMUX_PUMP_EVENTS];
+    if (pump->uring != NULL) fmux_uring_run(pump);
+
+    while (fmux_pump_running(pump)) {
+        fmux_handle* handle;
+        fmux_pump* owner;
+        int work;
+        while (fmux_pump_running(pump) && (handle = fmux_pump_next(pump, &owner, &work)) != NULL)
+            fmux_pump_service(owner, handle, work);
+        if (!fmux_pump_running(pump)) break;
+
+        if (pump->uring != NULL) {
+            if (fmux_uring_wait(pump) < 0) break;
             continue;
         }
 
         pthread_mutex_lock(&(pump->lock));
-        struct pollfd* fds = calloc(pump->length, sizeof(struct pollfd));
-        fmux_handle_link* cur = pump->head;
-        int nfds = 0;
-        while (cur != NULL && nfds < pump->length) {
-            fds[nfds].fd = cur->data->fd;
-            fds[nfds].events = POLLIN;
-            nfds++;
-            cur = cur->next;
+        unsigned int generation = pump->generation;
+        pthread_mutex_unlock(&(pump->lock));
+
+        //Block until a handle has input or somebody pokes the eventfd
+        __atomic_store_n(&(pump->idle), 1, __ATOMIC_RELEASE);
+        int nready = epoll_wait(pump->epfd, events, FMUX_PUMP_EVENTS, -1);
+        __atomic_store_n(&(pump->idle), 0, __ATOMIC_RELEASE);
+        if (nready < 0) {
+            if (errno == EINTR) continue;
+            perror("Waiting on pump");
+            break;
         }
 
-        int nready = poll(fds, nfds, -1); //Block until we have input
+        pthread_mutex_lock(&(pump->lock));
+        for (int i = 0; i < nready; i++) {
+            struct fmux_watch* watch = events[i].data.ptr;
+            if (watch == NULL) {
+                uint64_t count;
+                while (read(pump->wakefd, &count, sizeof(count)) > 0);
+                continue;
+            }
+            //If a handle was removed while we were waiting, the events we
+            //got back may refer to it.
+            fmux_handle* ready = watch->handle;
+            if (generation != pump->generation && !fmux_pump_has_handle(pump, ready))
+                continue;
 
-        if (nready > 0) {
-            //Because of the lock, the number and position of the handles in the list
-            //should still be the same.
-            int idx = 0;
-            nfds = 0;
-            cur = pump->head;
-            while (cur != NULL && idx < pump->length && nfds < nready) {
-                if ((fds[idx].revents & POLLIN) > 0) {
-                    fmux_flush_reads(cur->data);
-                    nfds++;
+            int found = 0;
+            if (watch->kind == FMUX_WATCH_CHANNEL) {
+                if (events[i].events & ~EPOLLOUT) {
+                    fmux_queue_out(ready, watch->channel, 0);
+                    found |= FMUX_EV_OUT;
                 }
-                idx++;
-                cur = cur->next;
+                if (events[i].events & EPOLLOUT) found |= FMUX_EV_RESUME;
+            } else if (watch->kind == FMUX_WATCH_TIMER) {
+                found |= FMUX_EV_FLUSH;
+            } else {
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) found |= FMUX_EV_IN;
+                if (events[i].events & EPOLLOUT) found |= FMUX_EV_OUT;
             }
-        } else {
-            //TODO: So...what happened
-            sleep(1);
+            fmux_runq_push(pump, ready, found);
         }
+        pump->batches++;
+        int nqueued = pump->runq_len;
         pthread_mutex_unlock(&(pump->lock));
+
+        if (pump->pool != NULL) fmux_pump_share(pump, nqueued);
     }
     //Just in case we accidentally introduce a break somewhere...
     pump->run = 0;
 
-    fmux_handle_link* cur = pump->head;
-    while (cur != NULL) {
-        void* to_free = cur;
-        cur = cur->next;
-        free(to_free);
-    }
-
-    pthread_mutex_destroy(&(pump->lock));
+    //Pool workers may still try to steal from us; the pool cleans up once
+    //every worker has been joined.
+    if (pump->pool == NULL)
+        fmux_pump_cleanup(pump);
 
     return 0;
 }
@@ -359,6 +5441,10 @@ fmux_pump_add_handle(fmux_pump* pump, fmux_handle* handle)
 {
     if (!pump->run) return -1; //Can't add handles to a stopped pump!
     if (!handle->sync_read) return -1; //Can't add a handle to multiple pumps;
+    //Links go first, since the channels' watches point at them
+    for (int i = 1; i < __atomic_load_n(&(handle->nlinks), __ATOMIC_ACQUIRE); i++) {
+        if (fmux_pump_add_handle(pump, handle->links[i]) < 0) return -1;
+    }
 
     pthread_mutex_lock(&(pump->lock));
 
@@ -378,12 +5464,37 @@ fmux_pump_add_handle(fmux_pump* pump, fmux_handle* handle)
         }
     }
     if (should_add) {
+        //Edge-triggered: a handle is queued once per burst of input and
+        //fmux_flush_reads drains it completely. No need to wake the pump up;
+        //epoll_wait picks up new registrations while it is blocked.
+        handle->out_blocked = 0;
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLET, .data.ptr = &(handle->watch)};
+        if (pump->uring != NULL) {
+            //Requests are armed by the pump thread once it sees the handle
+            //(Not for shared memory, where the fd only has doorbells on it)
+            __atomic_store_n(&(handle->rx_uring), fmux_is_socket(handle->fd) && handle->shm_rx == NULL,
+                             __ATOMIC_RELEASE);
+        } else if (epoll_ctl(pump->epfd, EPOLL_CTL_ADD, handle->fd, &ev) < 0) {
+            pthread_mutex_unlock(&(pump->lock));
+            return -1;
+        }
+        pthread_mutex_lock(&(handle->chan_lock));
+        for (int i = 0; i < handle->nactive; i++) {
+            if (handle->active[i]->sock[1] >= 0)
+                fmux_pump_watch_channel(pump, handle->active[i], EPOLL_CTL_ADD);
+        }
+        pthread_mutex_unlock(&(handle->chan_lock));
+        if (__atomic_load_n(&(handle->cork_timerfd), __ATOMIC_ACQUIRE) >= 0)
+            fmux_pump_watch_cork(pump, handle);
+
         //cur points to the LAST item in the list because of the conditional at
         //the end of the while loop above
         fmux_handle_link* new_item = malloc(sizeof(fmux_handle_link));
         new_item->next = NULL;
         new_item->data = handle;
         handle->sync_read = 0;
+        handle->pump = pump;
+        if (pump->uring != NULL) fmux_uring_touch(pump, &(handle->watch));
         if (cur != NULL) { cur->next = new_item; } else { pump->head = new_item; }
         pump->length++;
     }
@@ -402,12 +5513,33 @@ fmux_pump_remove_handle(fmux_pump* pump, fmux_handle* handle)
 
     fmux_handle_link dummy = {.data = NULL, .next = pump->head};
     fmux_handle_link* cur = &dummy;
+    int found = 0;
     while (cur->next != NULL) {
         if (cur->next->data == handle) {
             //Found it! Now let's remove it.
             //We WON'T reset any of the members yet, though
             fmux_handle_link* to_remove = cur->next;
-            to_remove->data->sync_read = 1;
+            found = 1;
+            //With io_uring, reading synchronously has to wait until the pump
+            //has stopped receiving for the handle; see below
+            to_remove->data->sync_read = (pump->uring == NULL);
+            to_remove->data->pump = NULL;
+            if (pump->uring == NULL)
+                epoll_ctl(pump->epfd, EPOLL_CTL_DEL, handle->fd, NULL);
+            pthread_mutex_lock(&(handle->chan_lock));
+            for (int i = 0; i < handle->nactive; i++) {
+                fmux_channel* channel = handle->active[i];
+                if (pump->uring == NULL && channel->sock[1] >= 0)
+                    epoll_ctl(pump->epfd, EPOLL_CTL_DEL, channel->sock[1], NULL);
+                fmux_unqueue_out(channel->link, channel);
+            }
+            pthread_mutex_unlock(&(handle->chan_lock));
+            int timerfd = __atomic_load_n(&(handle->cork_timerfd), __ATOMIC_ACQUIRE);
+            if (pump->uring == NULL && timerfd >= 0)
+                epoll_ctl(pump->epfd, EPOLL_CTL_DEL, timerfd, NULL);
+            if (pump->uring != NULL) fmux_uring_touch_handle(pump, handle);
+            fmux_runq_purge(pump, handle);
+            pump->generation++;
             cur->next = cur->next->next;
             //The special case. If it's the head node, we need to reset pump->head
             if (cur == &dummy) {
@@ -416,6 +5548,7 @@ fmux_pump_remove_handle(fmux_pump* pump, fmux_handle* handle)
             //And free the memory
             free(to_remove);
             pump->length--;
+            fmux_pump_wake(pump);
             break;
         }
         //Finally, advance pointer
@@ -424,6 +5557,21 @@ fmux_pump_remove_handle(fmux_pump* pump, fmux_handle* handle)
 
     pthread_mutex_unlock(&(pump->lock));
 
+    //Some thread (possibly a sibling in a pool) may still be servicing the
+    //handle; don't let the caller free it out from under them.
+    int busy = __atomic_or_fetch(&(handle->busy), FMUX_BUSY_WAITING, __ATOMIC_ACQ_REL);
+    while (busy != FMUX_BUSY_WAITING) {
+        syscall(SYS_futex, &(handle->busy), FUTEX_WAIT_PRIVATE, busy, NULL, NULL, 0);
+        busy = __atomic_load_n(&(handle->busy), __ATOMIC_ACQUIRE);
+    }
+    __atomic_and_fetch(&(handle->busy), ~FMUX_BUSY_WAITING, __ATOMIC_ACQ_REL);
+    if (found && pump->uring != NULL) {
+        fmux_uring_settle(pump, handle);
+        handle->sync_read = 1;
+    }
+    for (int i = 1; found && i < __atomic_load_n(&(handle->nlinks), __ATOMIC_ACQUIRE); i++)
+        fmux_pump_remove_handle(pump, handle->links[i]);
+
     return 0;
 }
 
@@ -431,7 +5579,110 @@ int
 fmux_pump_stop(fmux_pump* pump)
 {
     if (!pump->run) return -1;
-    pump->run = 0;
+
+    pthread_mutex_lock(&(pump->lock));
+    __atomic_store_n(&(pump->run), 0, __ATOMIC_RELEASE);
+    fmux_pump_wake(pump);
+    pthread_mutex_unlock(&(pump->lock));
 
     return 0;
 }
+
+/* PRIVATE */ void*
+fmux_pump_pool_worker(void* arg)
+{
+    fmux_pump* pump = arg;
+    fmux_pump_pool* pool = pump->pool;
+    if (pool->cpus != NULL) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(pool->cpus[pump - pool->pumps], &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err != 0) fprintf(stderr, "Pinning pump worker: %s\n", strerror(err));
+    }
+    fmux_pump_start(pump);
+    return NULL;
+}
+
+/* PRIVATE */ void
+fmux_pump_pool_free(fmux_pump_pool* pool)
+{
+    free(pool->cpus);
+    free(pool->threads);
+    free(pool->pumps);
+    free(pool);
+}
+
+/* PRIVATE */ void
+fmux_pump_pool_shutdown(fmux_pump_pool* pool, int nstarted)
+{
+    //Stop every pump, wait for the first nstarted workers (the ones running),
+    //and free the lot
+    for (int i = 0; i < pool->nthreads; i++)
+        fmux_pump_stop(&(pool->pumps[i]));
+    for (int i = 0; i < nstarted; i++)
+        pthread_join(pool->threads[i], NULL);
+    for (int i = 0; i < pool->nthreads; i++)
+        fmux_pump_cleanup(&(pool->pumps[i]));
+    fmux_pump_pool_free(pool);
+}
+
+fmux_pump_pool*
+fmux_pump_pool_create(int nthreads, const int* cpus)
+{
+    if (nthreads <= 0) return NULL;
+
+    fmux_pump_pool* pool = calloc(1, sizeof(fmux_pump_pool));
+    if (pool == NULL) return NULL;
+    pool->nthreads = nthreads;
+    pool->pumps = calloc(nthreads, sizeof(fmux_pump));
+    pool->threads = calloc(nthreads, sizeof(pthread_t));
+    if (cpus != NULL) pool->cpus = malloc(nthreads * sizeof(int));
+    if (pool->pumps == NULL || pool->threads == NULL || (cpus != NULL && pool->cpus == NULL)) {
+        fmux_pump_pool_free(pool);
+        return NULL;
+    }
+    if (cpus != NULL) memcpy(pool->cpus, cpus, nthreads * sizeof(int));
+
+    //Every pump has to exist before any worker starts looking for work to steal
+    for (int i = 0; i < nthreads; i++) {
+        fmux_pump_init(&(pool->pumps[i]));
+        pool->pumps[i].pool = pool;
+    }
+    for (int i = 0; i < nthreads; i++) {
+        int err = pthread_create(&(pool->threads[i]), NULL, &fmux_pump_pool_worker, &(pool->pumps[i]));
+        if (err != 0) {
+            fmux_pump_pool_shutdown(pool, i);
+            errno = err;
+            return NULL;
+        }
+    }
+
+    return pool;
+}
+
+int
+fmux_pump_pool_add_handle(fmux_pump_pool* pool, fmux_handle* handle)
+{
+    //Shard onto whichever worker currently owns the fewest handles
+    fmux_pump* target = &(pool->pumps[0]);
+    for (int i = 1; i < pool->nthreads; i++) {
+        if (pool->pumps[i].length < target->length)
+            target = &(pool->pumps[i]);
+    }
+    return fmux_pump_add_handle(target, handle);
+}
+
+int
+fmux_pump_pool_remove_handle(fmux_pump_pool* pool, fmux_handle* handle)
+{
+    fmux_pump* owner = handle->pump;
+    if (owner == NULL || owner->pool != pool) return -1;
+    return fmux_pump_remove_handle(owner, handle);
+}
+
+void
+fmux_pump_pool_destroy(fmux_pump_pool* pool)
+{
+    fmux_pump_pool_shutdown(pool, pool->nthreads);
+}
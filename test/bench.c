@@ -0,0 +1,396 @@
+#include <fmux.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+
+/* Throughput and latency benchmark. One handle sends fixed-size messages
+ * over a link to another handle, from a number of writer threads spread over
+ * a number of channels, and one reader thread takes them apart again. Each
+ * message starts with the time it was written, so the reader can tell how
+ * long it took to arrive (under full load, so queueing included).
+ *
+ * Every combination of the parameters below is run, and each prints one line
+ * of JSON with its results. Each parameter takes a comma-separated list:
+ *   -t  link: socketpair, pipe, tcp (loopback)
+ *   -s  message sizes in bytes (at least 8)
+ *   -c  channel counts
+ *   -w  writer thread counts (runs with more writers than channels are
+ *       skipped, since writers never share a channel)
+ *   -m  sync (the reader drives the link itself) or pump (each end has a pump)
+ *   -a  ring (ring channels, fmux_read/fmux_write), socket (socket channels,
+ *       fmux_read/fmux_write) or fd (socket channels, read/write on their
+ *       fds); only ring channels run in sync mode
+ *   -e  what the pumps wait with in pump mode: epoll, uring (see
+ *       fmux_pump_init_engine; ignored in sync mode)
+ *   -b  bytes to send per run (default 16MiB, at most -n messages)
+ *   -n  most messages to send per run (default 100000)
+ *
+ * Each line also counts the syscalls the link cost per message, from
+ * fmux_get_stats: writes on the sender's link fd, reads on the receiver's
+ * (for uring, receives the ring completed, which need no syscall of their
+ * own) and the demuxer's writes into socket channels.
+ */
+
+#define BENCH_MAX_LIST 16
+
+typedef struct {
+    const char* names[BENCH_MAX_LIST];
+    long values[BENCH_MAX_LIST];
+    int n;
+} bench_list;
+
+typedef struct {
+    const char* link;
+    size_t size;
+    int channels;
+    int writers;
+    int pump;
+    const char* api;
+    const char* engine; //NULL in sync mode
+    long messages; //Per writer
+} bench_config;
+
+typedef struct {
+    bench_config* config;
+    fmux_channel** channels;
+    int first; //The writer's channels are first, first + writers, ...
+    char* msg;
+} bench_writer;
+
+static uint64_t
+bench_now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int
+bench_split(char* arg, bench_list* list, int numeric)
+{
+    list->n = 0;
+    for (char* tok = strtok(arg, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        if (list->n == BENCH_MAX_LIST) return -1;
+        list->names[list->n] = tok;
+        list->values[list->n] = numeric ? atol(tok) : 0;
+        if (numeric && list->values[list->n] <= 0) return -1;
+        list->n++;
+    }
+    return (list->n > 0) ? 0 : -1;
+}
+
+static int
+bench_link(const char* link, int fd[2])
+{
+    //fd[0] is the sending end and fd[1] the receiving end
+    if (strcmp(link, "socketpair") == 0) return socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+    if (strcmp(link, "pipe") == 0) {
+        int p[2];
+        if (pipe(p) < 0) return -1;
+        fd[0] = p[1];
+        fd[1] = p[0];
+        return 0;
+    }
+    if (strcmp(link, "tcp") != 0) return -1;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0) return -1;
+    if (bind(listener, (struct sockaddr*)&addr, len) < 0 || listen(listener, 1) < 0 ||
+        getsockname(listener, (struct sockaddr*)&addr, &len) < 0) {
+        close(listener);
+        return -1;
+    }
+    fd[0] = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd[0], (struct sockaddr*)&addr, len) < 0) {
+        close(listener);
+        return -1;
+    }
+    fd[1] = accept(listener, NULL, NULL);
+    close(listener);
+    int one = 1;
+    setsockopt(fd[0], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(fd[1], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return (fd[1] < 0) ? -1 : 0;
+}
+
+static int
+bench_write_fd(int fd, const char* buf, size_t nbyte)
+{
+    size_t off = 0;
+    while (off < nbyte) {
+        ssize_t n = write(fd, buf + off, nbyte - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        off += n;
+    }
+    return 0;
+}
+
+static void*
+bench_writer_func(void* arg)
+{
+    bench_writer* writer = arg;
+    bench_config* config = writer->config;
+    int fd_api = (strcmp(config->api, "fd") == 0);
+    int channel = writer->first;
+    for (long i = 0; i < config->messages; i++) {
+        uint64_t now = bench_now_ns();
+        memcpy(writer->msg, &now, sizeof(now));
+        fmux_channel* chan = writer->channels[channel];
+        int err = fd_api ? bench_write_fd(fmux_channel_write_fd(chan), writer->msg, config->size)
+                         : (fmux_write(chan, writer->msg, config->size) == (int)config->size) ? 0 : -1;
+        if (err < 0) {
+            perror("Writing");
+            break;
+        }
+        channel += config->writers;
+        if (channel >= config->channels) channel = writer->first;
+    }
+    return NULL;
+}
+
+static int
+bench_cmp(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static int
+bench_run(bench_config* config)
+{
+    int fd[2];
+    if (bench_link(config->link, fd) < 0) {
+        perror(config->link);
+        return -1;
+    }
+    int nchan = config->channels;
+    fmux_handle* sender = fmux_open(fd[0], nchan + 1);
+    fmux_handle* receiver = fmux_open(fd[1], nchan + 1);
+    fmux_channel** out = calloc(nchan, sizeof(fmux_channel*));
+    fmux_channel** in = calloc(nchan, sizeof(fmux_channel*));
+    fmux_channel** ready = calloc(nchan + 1, sizeof(fmux_channel*));
+    int ring = (strcmp(config->api, "ring") == 0);
+    int fd_api = (strcmp(config->api, "fd") == 0);
+    for (int i = 0; i < nchan; i++) {
+        out[i] = fmux_open_channel(sender, i + 1);
+        in[i] = ring ? fmux_open_ring_channel(receiver, i + 1, FMUX_RING_DEFAULT, 0)
+                     : fmux_open_channel(receiver, i + 1);
+    }
+    //A pump for each end, as if they were in different processes (a pump
+    //blocked writing to the link mustn't be the one that would read it)
+    fmux_pump_pool* pools[2] = { NULL, NULL };
+    if (config->pump) {
+        //fmux_pump_init picks this up for the pool's pumps
+        setenv("FMUX_ENGINE", config->engine, 1);
+        pools[0] = fmux_pump_pool_create(1, NULL);
+        pools[1] = fmux_pump_pool_create(1, NULL);
+        fmux_pump_pool_add_handle(pools[0], sender);
+        fmux_pump_pool_add_handle(pools[1], receiver);
+    }
+
+    //Where the reader is in each channel's current message
+    size_t* pos = calloc(nchan, sizeof(size_t));
+    uint64_t* stamps = calloc(nchan, sizeof(uint64_t));
+    long total = config->messages * config->writers;
+    uint64_t* latencies = malloc(total * sizeof(uint64_t));
+    size_t buflen = (config->size > 65536) ? config->size : 65536;
+    char* buf = malloc(buflen);
+
+    bench_writer* writers = calloc(config->writers, sizeof(bench_writer));
+    pthread_t* threads = calloc(config->writers, sizeof(pthread_t));
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < config->writers; i++) {
+        writers[i].config = config;
+        writers[i].channels = out;
+        writers[i].first = i;
+        writers[i].msg = calloc(1, config->size);
+        pthread_create(&threads[i], NULL, &bench_writer_func, &writers[i]);
+    }
+
+    long done = 0;
+    int stuck = 0;
+    while (done < total && stuck < 50) {
+        //Without a pump, fmux_select only looks at the link when asked, so
+        //wait for the link (or a channel) ourselves
+        struct timeval timeout = { .tv_sec = 0, .tv_usec = config->pump ? 100000 : 0 };
+        int n = fmux_select(receiver, ready, &timeout);
+        if (n == 0 && !config->pump) {
+            struct pollfd pfd = { .fd = fd[1], .events = POLLIN };
+            n = poll(&pfd, 1, 100);
+            if (n > 0) continue;
+        }
+        stuck = (n <= 0) ? stuck + 1 : 0;
+        for (int i = 0; i < n; i++) {
+            int c = 0;
+            while (c < nchan && in[c] != ready[i]) c++;
+            if (c == nchan) continue; //Channel 0
+            ssize_t got = fd_api ? read(fmux_channel_read_fd(in[c]), buf, buflen)
+                                 : fmux_read(in[c], buf, buflen);
+            uint64_t now = bench_now_ns();
+            for (ssize_t off = 0; off < got; ) {
+                //Pick the time stamp out of the front of each message
+                size_t take = config->size - pos[c];
+                if ((size_t)(got - off) < take) take = got - off;
+                if (pos[c] < sizeof(uint64_t)) {
+                    size_t stamp = sizeof(uint64_t) - pos[c];
+                    if (stamp > take) stamp = take;
+                    memcpy((char*)&stamps[c] + pos[c], buf + off, stamp);
+                }
+                pos[c] += take;
+                off += take;
+                if (pos[c] == config->size) {
+                    if (done < total) latencies[done] = now - stamps[c];
+                    done++;
+                    pos[c] = 0;
+                }
+            }
+        }
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+
+    for (int i = 0; i < config->writers; i++) {
+        pthread_join(threads[i], NULL);
+        free(writers[i].msg);
+    }
+    if (config->pump) {
+        fmux_pump_pool_remove_handle(pools[0], sender);
+        fmux_pump_pool_remove_handle(pools[1], receiver);
+        fmux_pump_pool_destroy(pools[0]);
+        fmux_pump_pool_destroy(pools[1]);
+    }
+
+    fmux_stats tx, rx;
+    fmux_get_stats(sender, &tx);
+    fmux_get_stats(receiver, &rx);
+
+    int ret = 0;
+    if (done < total) {
+        fprintf(stderr, "%s/%s/%s: stalled after %ld of %ld messages\n", config->link,
+                config->pump ? config->engine : "sync", config->api, done, total);
+        ret = -1;
+    } else {
+        qsort(latencies, total, sizeof(uint64_t), &bench_cmp);
+        double secs = elapsed / 1e9;
+        printf("{\"link\":\"%s\",\"size\":%zu,\"channels\":%d,\"writers\":%d,"
+               "\"mode\":\"%s\",\"engine\":\"%s\",\"api\":\"%s\",\"messages\":%ld,"
+               "\"msgs_per_sec\":%.0f,\"mb_per_sec\":%.2f,"
+               "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,"
+               "\"link_writes_per_msg\":%.4f,\"link_reads_per_msg\":%.4f,"
+               "\"deliveries_per_msg\":%.4f}\n",
+               config->link, config->size, config->channels, config->writers,
+               config->pump ? "pump" : "sync", config->pump ? config->engine : "none",
+               config->api, total,
+               total / secs, total * (double)config->size / secs / 1e6,
+               latencies[total / 2] / 1e3, latencies[total * 99 / 100] / 1e3,
+               latencies[total * 999 / 1000] / 1e3,
+               (double)tx.writes / total, (double)rx.reads / total,
+               (double)rx.deliveries / total);
+        fflush(stdout);
+    }
+
+    fmux_close(sender);
+    fmux_close(receiver);
+    free(threads);
+    free(writers);
+    free(buf);
+    free(latencies);
+    free(stamps);
+    free(pos);
+    free(ready);
+    free(in);
+    free(out);
+    return ret;
+}
+
+int
+main(int argc, char** argv)
+{
+    char links[] = "socketpair,pipe,tcp", sizes[] = "64,4096,65536", chans[] = "1,16,256";
+    char writers[] = "1,4", modes[] = "sync,pump", apis[] = "ring,socket,fd";
+    char engines[] = "epoll";
+    bench_list link, size, chan, writer, mode, api, engine;
+    bench_split(links, &link, 0);
+    bench_split(sizes, &size, 1);
+    bench_split(chans, &chan, 1);
+    bench_split(writers, &writer, 1);
+    bench_split(modes, &mode, 0);
+    bench_split(apis, &api, 0);
+    bench_split(engines, &engine, 0);
+    long budget = 16 * 1024 * 1024, max_messages = 100000;
+
+    int opt, err = 0;
+    while ((opt = getopt(argc, argv, "t:s:c:w:m:a:e:b:n:")) != -1) {
+        switch (opt) {
+        case 't': err |= bench_split(optarg, &link, 0); break;
+        case 's': err |= bench_split(optarg, &size, 1); break;
+        case 'c': err |= bench_split(optarg, &chan, 1); break;
+        case 'w': err |= bench_split(optarg, &writer, 1); break;
+        case 'm': err |= bench_split(optarg, &mode, 0); break;
+        case 'a': err |= bench_split(optarg, &api, 0); break;
+        case 'e': err |= bench_split(optarg, &engine, 0); break;
+        case 'b': budget = atol(optarg); break;
+        case 'n': max_messages = atol(optarg); break;
+        default: err = -1;
+        }
+    }
+    for (int i = 0; i < size.n; i++) {
+        if (size.values[i] < (long)sizeof(uint64_t)) err = -1;
+    }
+    for (int i = 0; i < engine.n; i++) {
+        if (strcmp(engine.names[i], "epoll") != 0 && strcmp(engine.names[i], "uring") != 0) err = -1;
+    }
+    if (err < 0 || budget <= 0 || max_messages <= 0) {
+        fprintf(stderr, "usage: %s [-t links] [-s sizes] [-c channels] [-w writers]"
+                " [-m sync,pump] [-a ring,socket,fd] [-e epoll,uring] [-b bytes]"
+                " [-n messages]\n", argv[0]);
+        return 2;
+    }
+
+    int failed = 0;
+    for (int t = 0; t < link.n; t++)
+    for (int s = 0; s < size.n; s++)
+    for (int c = 0; c < chan.n; c++)
+    for (int w = 0; w < writer.n; w++)
+    for (int m = 0; m < mode.n; m++)
+    for (int a = 0; a < api.n; a++)
+    for (int e = 0; e < engine.n; e++) {
+        bench_config config = {
+            .link = link.names[t],
+            .size = size.values[s],
+            .channels = chan.values[c],
+            .writers = writer.values[w],
+            .pump = (strcmp(mode.names[m], "pump") == 0),
+            .api = api.names[a],
+            .engine = engine.names[e],
+        };
+        if (config.writers > config.channels) continue;
+        //The engine only matters to pumps
+        if (!config.pump && e > 0) continue;
+        //Without a pump, channel fds are only drained when fmux_write is
+        //called, and the reader (which is also the demuxer) would block on
+        //a full channel socket; only ring channels never block it
+        if (!config.pump && strcmp(config.api, "ring") != 0) continue;
+        long messages = budget / (long)config.size;
+        if (messages > max_messages) messages = max_messages;
+        config.messages = (messages + config.writers - 1) / config.writers;
+        if (bench_run(&config) < 0) failed++;
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,347 @@
+#include <fmux.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+
+/* Replays a capture file (see fmux_set_capture) through a handle, to
+ * benchmark the demux and mux paths against recorded traffic. The file is
+ * mmapped and indexed up front, so reading it costs next to nothing.
+ *   -d  in (default): the frames that were received are written, with v1
+ *       headers, into one end of a socketpair from a separate thread, and a
+ *       handle on the other end demuxes them.
+ *       out: the frames that were sent are fmux_push()ed by a handle on one
+ *       end, and a thread drains the other.
+ *   -m  how the demuxer is driven, for -d in: pop (fmux_pop_pooled, default)
+ *       or select (ring channels, fmux_select and fmux_read, which drives
+ *       the demuxer through fmux_flush_reads; channel 0 is left out)
+ *   -p  keep the recorded gaps between frames (default: as fast as possible)
+ *   -l  times to play the file through (default 1)
+ * Prints one line of JSON with the results.
+ */
+
+typedef struct {
+    fmux_capture_record record; //Copied out, since records aren't aligned
+    const char* data;
+} replay_frame;
+
+typedef struct {
+    replay_frame* frames; //The frames being replayed, in order
+    long n;
+    uint64_t bytes;
+    int paced;
+    int loops;
+    uint64_t start; //When the run started
+} replay_config;
+
+typedef struct {
+    replay_config* config;
+    int fd;
+} replay_writer;
+
+static uint64_t
+replay_now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static uint32_t
+replay_len(const replay_frame* frame)
+{
+    return frame->record.nbytes & FMUX_CAPTURE_LEN;
+}
+
+static void
+replay_pace(replay_config* config, int loop, long i)
+{
+    //Sleep until frame i of the loop is due, the loops laid end to end
+    if (!config->paced) return;
+    uint64_t first = config->frames[0].record.ns;
+    uint64_t span = config->frames[config->n - 1].record.ns - first;
+    uint64_t due = config->start + loop * span + (config->frames[i].record.ns - first);
+    struct timespec ts = {.tv_sec = due / 1000000000, .tv_nsec = due % 1000000000};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static int
+replay_index(const char* file, size_t size, int out, int skip_control, replay_config* config)
+{
+    //Picks out the records to replay. Returns -1 if the file isn't a capture.
+    if (size < FMUX_CAPTURE_MAGIC_LEN || memcmp(file, FMUX_CAPTURE_MAGIC, FMUX_CAPTURE_MAGIC_LEN) != 0)
+        return -1;
+    long cap = 1024;
+    config->frames = malloc(cap * sizeof(replay_frame));
+    config->n = 0;
+    config->bytes = 0;
+    size_t off = FMUX_CAPTURE_MAGIC_LEN;
+    while (off + sizeof(fmux_capture_record) <= size) {
+        replay_frame frame;
+        memcpy(&frame.record, file + off, sizeof(frame.record));
+        frame.data = file + off + sizeof(frame.record);
+        off += sizeof(frame.record) + replay_len(&frame);
+        if (off > size) break; //Cut short while it was being written
+        if (!(frame.record.nbytes & FMUX_CAPTURE_OUT) != !out) continue;
+        if (skip_control && frame.record.channel_id == 0) continue;
+        if (frame.record.channel_id == FMUX_PROTO_CHANNEL) continue; //Negotiation, not traffic
+        if (config->n == cap) {
+            cap *= 2;
+            config->frames = realloc(config->frames, cap * sizeof(replay_frame));
+        }
+        config->frames[config->n++] = frame;
+        config->bytes += replay_len(&frame);
+    }
+    return 0;
+}
+
+static int
+replay_channels(replay_config* config, uint32_t** ids)
+{
+    //The distinct channel ids in the replay
+    int n = 0, cap = 16;
+    *ids = malloc(cap * sizeof(uint32_t));
+    for (long i = 0; i < config->n; i++) {
+        uint32_t id = config->frames[i].record.channel_id;
+        int seen = 0;
+        for (int k = 0; k < n && !seen; k++) seen = ((*ids)[k] == id);
+        if (seen) continue;
+        if (n == cap) {
+            cap *= 2;
+            *ids = realloc(*ids, cap * sizeof(uint32_t));
+        }
+        (*ids)[n++] = id;
+    }
+    return n;
+}
+
+static void*
+replay_writer_func(void* arg)
+{
+    //Feeds the frames into the link the way a v1 peer would
+    replay_writer* writer = arg;
+    replay_config* config = writer->config;
+    for (int loop = 0; loop < config->loops; loop++) {
+        for (long i = 0; i < config->n; i++) {
+            replay_pace(config, loop, i);
+            const replay_frame* frame = &(config->frames[i]);
+            uint32_t header[2] = { htonl(frame->record.channel_id), htonl(replay_len(frame)) };
+            struct iovec iov[2] = {
+                {.iov_base = header, .iov_len = sizeof(header)},
+                {.iov_base = (void*)frame->data, .iov_len = replay_len(frame)},
+            };
+            size_t left = sizeof(header) + replay_len(frame);
+            struct iovec* cur = iov;
+            while (left > 0) {
+                ssize_t n = writev(writer->fd, cur, (cur == iov) ? 2 : 1);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) {
+                    perror("Writing");
+                    close(writer->fd);
+                    return NULL;
+                }
+                left -= n;
+                if (cur == iov && (size_t)n >= iov[0].iov_len) {
+                    n -= iov[0].iov_len;
+                    cur++;
+                }
+                cur->iov_base = (char*)cur->iov_base + n;
+                cur->iov_len -= n;
+            }
+        }
+    }
+    close(writer->fd);
+    return NULL;
+}
+
+static void*
+replay_drain_func(void* arg)
+{
+    int fd = *(int*)arg;
+    char buf[65536];
+    while (read(fd, buf, sizeof(buf)) > 0);
+    return NULL;
+}
+
+static long
+replay_in(replay_config* config, int select_mode, uint64_t* bytes)
+{
+    //Demuxes everything. Returns the number of frames demuxed (in select
+    //mode, all of them once every byte has been read), or -1.
+    int fd[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) < 0) {
+        perror("socketpair");
+        return -1;
+    }
+    uint32_t* ids;
+    int nids = replay_channels(config, &ids);
+    fmux_handle* receiver = fmux_open(fd[1], nids + 1);
+    fmux_channel** in = calloc(nids + 1, sizeof(fmux_channel*));
+    fmux_channel** ready = calloc(nids + 1, sizeof(fmux_channel*));
+    for (int i = 0; select_mode && i < nids; i++)
+        in[i] = fmux_open_ring_channel(receiver, ids[i], FMUX_RING_DEFAULT, 0);
+
+    replay_writer writer = {.config = config, .fd = fd[0]};
+    pthread_t thread;
+    config->start = replay_now_ns();
+    pthread_create(&thread, NULL, &replay_writer_func, &writer);
+
+    long frames = 0;
+    uint64_t total = config->bytes * config->loops;
+    *bytes = 0;
+    if (!select_mode) {
+        fmux_message* message = NULL;
+        while (fmux_pop_pooled(receiver, &message) == 1) {
+            frames++;
+            *bytes += message->nbytes;
+        }
+        fmux_message_release(message);
+    } else {
+        char* buf = malloc(65536);
+        int stuck = 0;
+        while (*bytes < total && stuck < 50) {
+            struct timeval timeout = { .tv_sec = 0, .tv_usec = 0 };
+            int n = fmux_select(receiver, ready, &timeout);
+            //Without a pump, fmux_select only looks at the link when asked
+            stuck = (n <= 0) ? stuck + 1 : 0;
+            if (n == 0) {
+                struct pollfd pfd = { .fd = fd[1], .events = POLLIN };
+                poll(&pfd, 1, 100);
+                continue;
+            }
+            for (int i = 0; i < n; i++) {
+                ssize_t got = fmux_read(ready[i], buf, 65536);
+                if (got > 0) *bytes += got;
+            }
+        }
+        free(buf);
+        frames = config->n * config->loops;
+    }
+    pthread_join(thread, NULL);
+    fmux_close(receiver);
+    free(ready);
+    free(in);
+    free(ids);
+    return (*bytes == total) ? frames : -1;
+}
+
+static long
+replay_out(replay_config* config, uint64_t* bytes)
+{
+    //Pushes everything. Returns the number of frames pushed, or -1.
+    int fd[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) < 0) {
+        perror("socketpair");
+        return -1;
+    }
+    fmux_handle* sender = fmux_open(fd[0], 1);
+    //Messages are made before the clock starts; only pushing is timed
+    fmux_message** messages = malloc(config->n * sizeof(fmux_message*));
+    for (long i = 0; i < config->n; i++) {
+        const replay_frame* frame = &(config->frames[i]);
+        messages[i] = fmux_message_alloc(sender, replay_len(frame));
+        messages[i]->channel_id = frame->record.channel_id;
+        memcpy(messages[i]->data, frame->data, replay_len(frame));
+    }
+    pthread_t thread;
+    pthread_create(&thread, NULL, &replay_drain_func, &fd[1]);
+
+    long frames = 0;
+    *bytes = 0;
+    config->start = replay_now_ns();
+    for (int loop = 0; loop < config->loops; loop++) {
+        for (long i = 0; i < config->n; i++) {
+            replay_pace(config, loop, i);
+            if (fmux_push(sender, messages[i]) < 0) {
+                perror("Pushing");
+                loop = config->loops;
+                break;
+            }
+            frames++;
+            *bytes += messages[i]->nbytes;
+        }
+    }
+    for (long i = 0; i < config->n; i++) fmux_message_release(messages[i]);
+    free(messages);
+    fmux_close(sender); //Closes fd[0], so the drain sees EOF
+    pthread_join(thread, NULL);
+    close(fd[1]);
+    return (frames == config->n * config->loops) ? frames : -1;
+}
+
+int
+main(int argc, char** argv)
+{
+    const char* direction = "in";
+    const char* mode = "pop";
+    int paced = 0, loops = 1;
+
+    int opt, err = 0;
+    while ((opt = getopt(argc, argv, "d:m:pl:")) != -1) {
+        switch (opt) {
+        case 'd': direction = optarg; break;
+        case 'm': mode = optarg; break;
+        case 'p': paced = 1; break;
+        case 'l': loops = atoi(optarg); break;
+        default: err = -1;
+        }
+    }
+    int out = (strcmp(direction, "out") == 0);
+    int select_mode = (strcmp(mode, "select") == 0);
+    if (!out && strcmp(direction, "in") != 0) err = -1;
+    if (!select_mode && strcmp(mode, "pop") != 0) err = -1;
+    if (err < 0 || loops <= 0 || optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-d in|out] [-m pop|select] [-p] [-l loops] capture\n", argv[0]);
+        return 2;
+    }
+
+    const char* path = argv[optind];
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        return 1;
+    }
+    char* file = (st.st_size > 0) ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (file != MAP_FAILED) madvise(file, st.st_size, MADV_SEQUENTIAL);
+    replay_config config = {.paced = paced, .loops = loops};
+    if (file == MAP_FAILED || replay_index(file, st.st_size, out, select_mode && !out, &config) < 0) {
+        fprintf(stderr, "%s: not a capture file\n", path);
+        return 1;
+    }
+    if (config.n == 0) {
+        fprintf(stderr, "%s: no %s frames to replay\n", path, direction);
+        return 1;
+    }
+
+    uint64_t bytes;
+    long frames = out ? replay_out(&config, &bytes) : replay_in(&config, select_mode, &bytes);
+    uint64_t elapsed = replay_now_ns() - config.start;
+    int ret = 0;
+    if (frames < 0) {
+        fprintf(stderr, "%s: replay stopped short\n", path);
+        ret = 1;
+    } else {
+        double secs = elapsed / 1e9;
+        printf("{\"file\":\"%s\",\"direction\":\"%s\",\"mode\":\"%s\",\"paced\":%d,"
+               "\"loops\":%d,\"frames\":%ld,\"bytes\":%llu,\"secs\":%.6f,"
+               "\"frames_per_sec\":%.0f,\"mb_per_sec\":%.2f}\n",
+               path, direction, out ? "push" : mode, paced, loops, frames,
+               (unsigned long long)bytes, secs, frames / secs, bytes / secs / 1e6);
+    }
+    free(config.frames);
+    munmap(file, st.st_size);
+    return ret;
+}
@@ -7,8 +7,15 @@
 #include <string.h>
 #include <errno.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <arpa/inet.h>
 #include <signal.h>
 #include <pthread.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <malloc.h>
 
 int successes = 0, failures = 0, tests = 0;
 #define SUCCESS tests++; fprintf(stderr, "."); successes++;
@@ -18,7 +25,10 @@ int successes = 0, failures = 0, tests = 0;
 
 /* Private header stubs */
 int
-fmux_close_channel(fmux_handle* handle, int index);
+fmux_close_channel(fmux_handle* handle, uint32_t channel_id);
+
+void*
+fmux_pump_t_func(void* arg);
 
 void
 test_basic_plumbing()
@@ -78,6 +88,259 @@ test_reading()
     fmux_close(handle);
 }
 
+void
+test_writing_vectors()
+{
+    int fd[2];
+    int err = pipe(fd);
+    if (err < -1) { perror("Pipe creation"); FAILURE }
+    fmux_handle* handle = fmux_open(fd[1], FMUX_RECOMMENDED_CHANS);
+    fmux_channel* channel = fmux_open_channel(handle, 1);
+    ASSERT((channel != NULL))
+
+    struct iovec iov[3] = {
+        {.iov_base = "Hel", .iov_len = 3},
+        {.iov_base = "lo, ", .iov_len = 4},
+        {.iov_base = "world", .iov_len = 6},
+    };
+    //Nothing to send puts nothing on the wire
+    ASSERT((fmux_writev(channel, iov, 0) == 0 && fmux_write(channel, "", 0) == 0))
+    int nbytes = fmux_writev(channel, iov, 3);
+    ASSERT((nbytes == 13))
+
+    //One frame, one header
+    char buf[1024];
+    nbytes = read(fd[0], buf, 1024);
+    ASSERT((nbytes == 21))
+    ASSERT((memcmp(buf, "\0\0\0\1\0\0\0\xD" "Hello, world", 21) == 0))
+
+    fmux_close(handle);
+    close(fd[0]);
+}
+
+void
+test_max_frame_size()
+{
+    int fd[2];
+    int err = pipe(fd);
+    if (err < -1) { perror("Pipe creation"); FAILURE }
+    fmux_handle* handle = fmux_open(fd[1], FMUX_RECOMMENDED_CHANS);
+    fmux_channel* channel = fmux_open_channel(handle, 1);
+    ASSERT((fmux_get_max_frame(handle) == FMUX_DEFAULT_FRAME))
+    ASSERT((fmux_set_max_frame(handle, 0) == -1))
+    ASSERT((fmux_set_max_frame(handle, FMUX_MAX_FRAME + 1) == -1))
+    ASSERT((fmux_set_max_frame(handle, 5) == 0))
+
+    //Frames are cut across the caller's buffers without copying them
+    struct iovec iov[2] = {
+        {.iov_base = "Hello, ", .iov_len = 7},
+        {.iov_base = "world", .iov_len = 6},
+    };
+    ASSERT((fmux_writev(channel, iov, 2) == 13))
+
+    char buf[1024];
+    int nbytes = read(fd[0], buf, 1024);
+    ASSERT((nbytes == 37))
+    ASSERT((memcmp(buf, "\0\0\0\1\0\0\0\5Hello"
+                        "\0\0\0\1\0\0\0\5, wor"
+                        "\0\0\0\1\0\0\0\3ld", 37) == 0))
+
+    fmux_close(handle);
+    close(fd[0]);
+}
+
+void*
+bulk_writer_t_func(void* arg)
+{
+    fmux_channel* channel = arg;
+    static char data[300000];
+    for (int i = 0; i < (int)sizeof(data); i++) data[i] = (char)(i * 7);
+    fmux_write(channel, data, sizeof(data));
+    return NULL;
+}
+
+void
+test_large_writes()
+{
+    int fd[2];
+    int err = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+    if (err < -1) { perror("socketpair"); FAILURE }
+    fmux_handle* sender = fmux_open(fd[0], FMUX_RECOMMENDED_CHANS);
+    fmux_handle* receiver = fmux_open(fd[1], FMUX_RECOMMENDED_CHANS);
+    fmux_channel* out = fmux_open_channel(sender, 1);
+    fmux_channel* in = fmux_open_ring_channel(receiver, 1, 0, 0);
+    //Hundreds of frames, so several writev batches
+    fmux_set_max_frame(sender, 1000);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, &bulk_writer_t_func, out);
+    static char buf[300000];
+    int nread = 0, good = 1;
+    while (nread < (int)sizeof(buf)) {
+        int n = fmux_read(in, buf + nread, sizeof(buf) - nread);
+        if (n <= 0) break;
+        nread += n;
+    }
+    pthread_join(thread, NULL);
+    for (int i = 0; i < nread; i++) good = good && (buf[i] == (char)(i * 7));
+    ASSERT((nread == (int)sizeof(buf)))
+    ASSERT((good))
+
+    fmux_close(sender);
+    fmux_close(receiver);
+}
+
+char credited_data[65536];
+
+void*
+credited_writer_t_func(void* arg)
+{
+    fmux_channel* channel = arg;
+    fmux_write(channel, credited_data, sizeof(credited_data));
+    return NULL;
+}
+
+void
+test_flow_control()
+{
+    int fd[2];
+    int err = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+    if (err < -1) { perror("socketpair"); FAILURE }
+    fmux_handle* sender = fmux_open(fd[0], FMUX_RECOMMENDED_CHANS);
+    fmux_handle* receiver = fmux_open(fd[1], FMUX_RECOMMENDED_CHANS);
+    ASSERT((fmux_set_flow_control(sender, 0) == -1))
+    ASSERT((fmux_set_flow_control(sender, 4096) == 0))
+    ASSERT((fmux_set_flow_control(receiver, 4096) == 0))
+    ASSERT((fmux_get_flow_control(receiver) == 4096))
+    //Channel 0 carries the window updates now
+    ASSERT((fmux_write(fmux_open_channel(sender, 0), "x", 1) == -1))
+
+    fmux_channel* slow_out = fmux_open_channel(sender, 1);
+    fmux_channel* fast_out = fmux_open_channel(sender, 2);
+    fmux_channel* ring_out = fmux_open_channel(sender, 3);
+    fmux_channel* slow_in = fmux_open_channel(receiver, 1);
+    fmux_channel* fast_in = fmux_open_channel(receiver, 2);
+    fmux_channel* ring_in = fmux_open_ring_channel(receiver, 3, FMUX_RING_MIN, 0);
+    fmux_pump pump;
+    fmux_pump_init(&pump);
+    pthread_t pump_thread, slow_thread, ring_thread;
+    pthread_create(&pump_thread, NULL, &fmux_pump_t_func, &pump);
+    fmux_pump_add_handle(&pump, receiver);
+
+    //Nobody reads channel 1 (or 3) yet, and far more than a window is
+    //headed for both; channel 2 must get through regardless.
+    for (int i = 0; i < (int)sizeof(credited_data); i++) credited_data[i] = (char)(i * 3);
+    pthread_create(&slow_thread, NULL, &credited_writer_t_func, slow_out);
+    pthread_create(&ring_thread, NULL, &credited_writer_t_func, ring_out);
+    ASSERT((fmux_write(fast_out, "ping", 4) == 4))
+    char buf[4096];
+    ASSERT((fmux_read(fast_in, buf, 4) == 4))
+    ASSERT((memcmp(buf, "ping", 4) == 0))
+
+    //Reading straight from the fd still gives credit back
+    int slow_fd = fmux_channel_read_fd(slow_in);
+    int nread = 0, good = 1;
+    while (nread < 65536) {
+        struct pollfd pfd = {.fd = slow_fd, .events = POLLIN};
+        if (poll(&pfd, 1, 2000) != 1) break;
+        int n = read(slow_fd, buf, sizeof(buf));
+        if (n <= 0) break;
+        for (int i = 0; i < n; i++) good = good && (buf[i] == (char)((nread + i) * 3));
+        nread += n;
+    }
+    ASSERT((nread == 65536))
+    ASSERT((good))
+
+    nread = 0; good = 1;
+    while (nread < 65536) {
+        int n = fmux_read(ring_in, buf, sizeof(buf));
+        if (n <= 0) break;
+        for (int i = 0; i < n; i++) good = good && (buf[i] == (char)((nread + i) * 3));
+        nread += n;
+    }
+    ASSERT((nread == 65536))
+    ASSERT((good))
+
+    pthread_join(slow_thread, NULL);
+    pthread_join(ring_thread, NULL);
+    fmux_pump_stop(&pump);
+    pthread_join(pump_thread, NULL);
+    fmux_close(sender);
+    fmux_close(receiver);
+}
+
+struct link_capture {
+    int fd;
+    char* buf;
+    int nbytes;
+};
+
+void*
+link_capture_t_func(void* arg)
+{
+    //Collects everything written to the link until it goes quiet
+    struct link_capture* capture = arg;
+    for (;;) {
+        struct pollfd pfd = {.fd = capture->fd, .events = POLLIN};
+        if (poll(&pfd, 1, 300) != 1) break;
+        int n = read(capture->fd, capture->buf + capture->nbytes, 400000 - capture->nbytes);
+        if (n <= 0) break;
+        capture->nbytes += n;
+    }
+    return NULL;
+}
+
+void
+test_channel_priorities()
+{
+    int fd[2];
+    int err = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+    if (err < -1) { perror("socketpair"); FAILURE }
+    fmux_handle* handle = fmux_open(fd[0], FMUX_RECOMMENDED_CHANS);
+    fmux_channel* bulk = fmux_open_channel(handle, 1);
+    fmux_channel* heavy = fmux_open_channel(handle, 2);
+    fmux_channel* rpc = fmux_open_channel(handle, 3);
+    fmux_channel* direct = fmux_open_channel(handle, 4);
+    ASSERT((fmux_channel_set_priority(rpc, FMUX_PRIORITY_LEVELS, 1) == -1))
+    ASSERT((fmux_channel_set_priority(rpc, 5, 0) == -1))
+    ASSERT((fmux_channel_set_priority(heavy, 0, 2) == 0))
+    ASSERT((fmux_channel_set_priority(rpc, 5, 1) == 0))
+
+    //Low-numbered bulk channels are full when the RPC shows up
+    static char data[140000];
+    memset(data, 'b', sizeof(data));
+    ASSERT((write(fmux_channel_write_fd(bulk), data, sizeof(data)) == sizeof(data)))
+    ASSERT((write(fmux_channel_write_fd(heavy), data, sizeof(data)) == sizeof(data)))
+    ASSERT((write(fmux_channel_write_fd(rpc), "urgent", 6) == 6))
+
+    static char link[400000];
+    struct link_capture capture = {.fd = fd[1], .buf = link, .nbytes = 0};
+    pthread_t thread;
+    pthread_create(&thread, NULL, &link_capture_t_func, &capture);
+    ASSERT((fmux_write(direct, "go", 2) == 2))
+    pthread_join(thread, NULL);
+
+    //The RPC goes first; then each bulk channel gets one turn, the heavier
+    //one twice as much
+    ASSERT((capture.nbytes > 30))
+    ASSERT((memcmp(link, "\0\0\0\4\0\0\0\2go", 10) == 0))
+    ASSERT((memcmp(link + 10, "\0\0\0\3\0\0\0\6urgent", 14) == 0))
+    int sent[5] = {0};
+    for (int off = 24; off + 8 <= capture.nbytes; ) {
+        uint32_t channel_id = ((unsigned char)link[off + 3]) | ((unsigned char)link[off + 2] << 8);
+        uint32_t len = ((unsigned char)link[off + 7]) | ((unsigned char)link[off + 6] << 8) |
+                       ((unsigned char)link[off + 5] << 16);
+        if (channel_id < 5) sent[channel_id] += len;
+        off += 8 + len;
+    }
+    ASSERT((sent[1] == FMUX_QUANTUM))
+    ASSERT((sent[2] == 2 * FMUX_QUANTUM))
+    ASSERT((sent[3] == 0))
+
+    fmux_close(handle);
+    close(fd[1]);
+}
+
 void
 test_writing_to_nonexistent_channel()
 {
@@ -143,6 +406,239 @@ test_reading_from_nonexistent_channel()
     fmux_close(handle);
 }
 
+void
+test_sparse_channel_ids()
+{
+    int fd[2];
+    int err = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+    if (err < -1) { perror("socketpair"); FAILURE }
+
+    //Room for four channels (channel 0 is one of them), with any ids
+    fmux_handle* handle = fmux_open(fd[0], 4);
+    fmux_channel* session = fmux_open_channel(handle, 0xDEADBEEF);
+    fmux_channel* high = fmux_open_ring_channel(handle, 0x80000001, FMUX_RING_MIN, 0);
+    fmux_channel* low = fmux_open_channel(handle, 7);
+    ASSERT((session != NULL && high != NULL && low != NULL))
+    ASSERT((fmux_open_channel(handle, 8) == NULL))
+    ASSERT((fmux_open_channel(handle, 0xDEADBEEF) == session))
+
+    write(fd[1], "\xDE\xAD\xBE\xEF\0\0\0\4Sid", 12);
+    write(fd[1], "\0\0\0\x08\0\0\0\5Drop", 13);
+    write(fd[1], "\x80\0\0\x01\0\0\0\5High", 13);
+    char buf[16];
+    ASSERT((fmux_read(session, buf, sizeof(buf)) == 4))
+    ASSERT((strcmp(buf, "Sid") == 0))
+    ASSERT((fmux_read(high, buf, sizeof(buf)) == 5))
+    ASSERT((strcmp(buf, "High") == 0))
+
+    //Closing one makes room for another
+    ASSERT((fmux_close_channel(handle, 7) == 0))
+    ASSERT((fmux_open_channel(handle, 8) != NULL))
+    fmux_close(handle);
+    close(fd[1]);
+
+    //Lots of ids coming and going, through the table growing and entries
+    //being shifted back over the ones removed
+    #define SPARSE_CHANNELS 1000
+    err = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+    handle = fmux_open(fd[0], SPARSE_CHANNELS + 1);
+    static fmux_channel* opened[SPARSE_CHANNELS];
+    static uint32_t ids[SPARSE_CHANNELS];
+    uint32_t seed = 12345;
+    for (int i = 0; i < SPARSE_CHANNELS; i++) {
+        seed = seed * 1103515245 + 12345;
+        ids[i] = seed | 1;
+        opened[i] = fmux_open_ring_channel(handle, ids[i], FMUX_RING_MIN, 0);
+    }
+    for (int i = 0; i < SPARSE_CHANNELS; i += 2)
+        fmux_close_channel(handle, ids[i]);
+    int found = 0;
+    for (int i = 1; i < SPARSE_CHANNELS; i += 2)
+        found += (fmux_open_ring_channel(handle, ids[i], FMUX_RING_MIN, 0) == opened[i]);
+    ASSERT((found == SPARSE_CHANNELS / 2))
+    fmux_close(handle);
+    close(fd[1]);
+}
+
+void
+test_reading_split_frames()
+{
+    int fd[2];
+    int err = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+    if (err < -1) { perror("socketpair"); FAILURE }
+
+    fmux_handle* handle = fmux_open(fd[0], FMUX_RECOMMENDED_CHANS);
+    fmux_channel* channel = fmux_open_channel(handle, 1);
+    struct timeval timeout;
+    timeout.tv_sec = 0; timeout.tv_usec = 0;
+
+    //Half a header, then the rest of it and half the payload
+    write(fd[1], "\0\0\0\1\0\0", 6);
+    ASSERT((fmux_select(handle, NULL, &timeout) == 0))
+    write(fd[1], "\0\6Hel", 5);
+    //Then the end of the frame along with two whole frames in one go
+    write(fd[1], "lo\0" "\0\0\0\1\0\0\0\3" "abc" "\0\0\0\1\0\0\0\3" "def", 25);
+
+    char buf[1024];
+    int nread = 0;
+    while (nread < 12) {
+        int n = fmux_read(channel, buf + nread, 1024 - nread);
+        if (n <= 0) break;
+        nread += n;
+    }
+    ASSERT((nread == 12))
+    ASSERT((memcmp(buf, "Hello\0abcdef", 12) == 0))
+
+    //fmux_pop hands back whole frames, however they were split up
+    fmux_message* message = NULL;
+    write(fd[1], "\0\0\0\2\0\0", 6);
+    write(fd[1], "\0\4" "ab", 4);
+    write(fd[1], "cd", 2);
+    ASSERT((fmux_pop(handle, &message) == 1))
+    ASSERT((message->channel_id == 2))
+    ASSERT((message->nbytes == 4))
+    ASSERT((memcmp(message->data, "abcd", 4) == 0))
+
+    //And report EOF instead of spinning on it
+    close(fd[1]);
+    ASSERT((fmux_pop(handle, &message) == 0))
+    ASSERT((fmux_select(handle, NULL, &timeout) == 0))
+    free(message);
+
+    fmux_close(handle);
+}
+
+void
+test_pooled_messages()
+{
+    int fd[2];
+    int err = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+    if (err < -1) { perror("socketpair"); FAILURE }
+
+    fmux_handle* handle = fmux_open(fd[0], FMUX_RECOMMENDED_CHANS);
+    write(fd[1], "\0\0\0\1\0\0\0\6Hello", 14);
+    write(fd[1], "\0\0\0\2\0\0\0\x8Goodbye", 16);
+
+    fmux_message* message = NULL;
+    ASSERT((fmux_pop_pooled(handle, &message) == 1))
+    ASSERT((message->channel_id == 1))
+    ASSERT((strcmp(message->data, "Hello") == 0))
+    fmux_message* first = message;
+
+    //Small enough to reuse the same buffer
+    ASSERT((fmux_pop_pooled(handle, &message) == 1))
+    ASSERT((message == first))
+    ASSERT((message->channel_id == 2))
+    ASSERT((strcmp(message->data, "Goodbye") == 0))
+
+    //Released buffers get handed out again
+    fmux_message_release(message);
+    fmux_message* again = fmux_message_alloc(handle, 32);
+    ASSERT((again == first))
+    fmux_message* big = fmux_message_alloc(handle, 1 << 20);
+    ASSERT((big != NULL))
+    ASSERT((big->nbytes == 1 << 20))
+    fmux_message_release(big);
+
+    //Messages may outlive their handle
+    fmux_close(handle);
+    fmux_message_release(again);
+    close(fd[1]);
+}
+
+void
+test_ring_channels()
+{
+    int fd[2];
+    int err = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+    if (err < -1) { perror("socketpair"); FAILURE }
+
+    fmux_handle* handle = fmux_open(fd[0], FMUX_RECOMMENDED_CHANS);
+    fmux_channel* ring = fmux_open_ring_channel(handle, 1, 0, FMUX_RING_EVENTFD);
+    fmux_channel* sock = fmux_open_channel(handle, 2);
+    ASSERT((ring != NULL))
+    ASSERT((fmux_channel_write_fd(ring) == -1))
+    ASSERT((fmux_channel_read_fd(ring) >= 0))
+
+    write(fd[1], "\0\0\0\1\0\0\0\6Hello", 14);
+    write(fd[1], "\0\0\0\2\0\0\0\6Sock!", 14);
+
+    fmux_channel** ready = calloc(FMUX_RECOMMENDED_CHANS, sizeof(fmux_channel*));
+    struct timeval timeout;
+    timeout.tv_sec = 0; timeout.tv_usec = 0;
+    ASSERT((fmux_select(handle, ready, &timeout) == 2))
+    ASSERT((ready[0] == ring))
+    ASSERT((ready[1] == sock))
+    free(ready);
+
+    //The eventfd follows the ring's contents
+    struct pollfd pfd = {.fd = fmux_channel_read_fd(ring), .events = POLLIN};
+    ASSERT((poll(&pfd, 1, 0) == 1))
+    char buf[1024];
+    ASSERT((fmux_read(ring, buf, 1024) == 6))
+    ASSERT((strcmp(buf, "Hello") == 0))
+    ASSERT((poll(&pfd, 1, 0) == 0))
+    ASSERT((fmux_read(sock, buf, 1024) == 6))
+
+    //Writing needs no socketpair either
+    ASSERT((fmux_write(ring, "Ring", 5) == 5))
+    ASSERT((read(fd[1], buf, 1024) == 13))
+    ASSERT((memcmp(buf, "\0\0\0\1\0\0\0\5Ring", 13) == 0))
+
+    fmux_close(handle);
+    close(fd[1]);
+}
+
+void*
+ring_writer_t_func(void* arg)
+{
+    //One frame bigger than the ring, then a small one behind it
+    int fd = *(int*)arg;
+    static char big[8 + 20000];
+    memcpy(big, "\0\0\0\1\0\0\x4E\x20", 8);
+    for (int i = 0; i < 20000; i++) big[8 + i] = (char)i;
+    write(fd, big, sizeof(big));
+    write(fd, "\0\0\0\1\0\0\0\4Done", 12);
+    return NULL;
+}
+
+void
+test_ring_channel_backpressure()
+{
+    int fd[2];
+    int err = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+    if (err < -1) { perror("socketpair"); FAILURE }
+
+    fmux_handle* handle = fmux_open(fd[0], FMUX_RECOMMENDED_CHANS);
+    fmux_channel* ring = fmux_open_ring_channel(handle, 1, FMUX_RING_MIN, 0);
+    fmux_pump pump;
+    fmux_pump_init(&pump);
+    pthread_t pump_thread, writer_thread;
+    pthread_create(&pump_thread, NULL, &fmux_pump_t_func, &pump);
+    fmux_pump_add_handle(&pump, handle);
+    pthread_create(&writer_thread, NULL, &ring_writer_t_func, &fd[1]);
+
+    //The ring fills up long before the frame is done; reading must get the
+    //pump going again.
+    static char buf[20004];
+    int nread = 0, good = 1;
+    while (nread < 20004) {
+        int n = fmux_read(ring, buf + nread, 1000);
+        if (n <= 0) break;
+        nread += n;
+    }
+    for (int i = 0; i < 20000; i++) good = good && (buf[i] == (char)i);
+    ASSERT((nread == 20004))
+    ASSERT((good))
+    ASSERT((memcmp(buf + 20000, "Done", 4) == 0))
+
+    pthread_join(writer_thread, NULL);
+    fmux_pump_stop(&pump);
+    pthread_join(pump_thread, NULL);
+    fmux_close(handle);
+    close(fd[1]);
+}
+
 void
 test_writing_to_closed_socket()
 {
@@ -213,59 +709,374 @@ test_reading_with_fmux_select()
     fmux_close(handle);
 }
 
+void*
+delayed_frame_t_func(void* arg)
+{
+    usleep(50000);
+    write(*(int*)arg, "\0\0\0\3\0\0\0\5Ring", 13);
+    return NULL;
+}
+
 void
-test_management_of_handle_lists()
+test_select_with_many_channels()
 {
+    //Two fds per channel puts most of them past FD_SETSIZE
+    struct rlimit lim;
+    getrlimit(RLIMIT_NOFILE, &lim);
+    if (lim.rlim_cur < 4096 && lim.rlim_max >= 4096) {
+        lim.rlim_cur = 4096;
+        setrlimit(RLIMIT_NOFILE, &lim);
+    }
     int fd[2];
     int err = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
     if (err < -1) { perror("socketpair"); FAILURE }
 
-    fmux_handle* handle1 = fmux_open(fd[0], FMUX_RECOMMENDED_CHANS);
-    fmux_handle* handle2 = fmux_open(fd[1], FMUX_RECOMMENDED_CHANS);
-    fmux_pump pump;
-    fmux_pump_init(&pump);
+    #define MANY_CHANNELS 1024
+    fmux_handle* handle = fmux_open(fd[0], MANY_CHANNELS);
+    int opened = 0;
+    for (int i = 1; i < 700; i++)
+        opened += (fmux_open_channel(handle, i) != NULL);
+    ASSERT((opened == 699))
+    ASSERT((fmux_channel_read_fd(fmux_open_channel(handle, 699)) > FD_SETSIZE))
+    fmux_channel* ring = fmux_open_ring_channel(handle, 800, FMUX_RING_MIN, 0);
 
-    fmux_pump_add_handle(&pump, handle1);
-    ASSERT((pump.length == 1))
+    write(fd[1], "\0\0\x03\x20\0\0\0\4Ring", 12);
+    write(fd[1], "\0\0\x02\xB2\0\0\0\4High", 12);
+    write(fd[1], "\0\0\0\5\0\0\0\3Low", 11);
 
-    fmux_pump_add_handle(&pump, handle1);
-    ASSERT((pump.length == 1))
+    fmux_channel** ready = calloc(MANY_CHANNELS, sizeof(fmux_channel*));
+    struct timeval timeout = {0, 0};
+    err = fmux_select(handle, ready, &timeout);
+    ASSERT((err == 3))
+    ASSERT((ready[0] == fmux_open_channel(handle, 5)))
+    ASSERT((ready[1] == fmux_open_channel(handle, 690)))
+    ASSERT((ready[2] == ring))
 
-    fmux_pump_add_handle(&pump, handle2);
-    ASSERT((pump.length == 2))
+    char buf[16];
+    for (int i = 0; i < 3; i++) fmux_read(ready[i], buf, sizeof(buf));
+    ASSERT((fmux_select(handle, ready, &timeout) == 0))
 
-    fmux_pump_remove_handle(&pump, handle1);
-    ASSERT((pump.length == 1))
+    //More ready sockets than one epoll batch all come back, once each
+    for (int i = 1; i <= 3 * FMUX_PUMP_EVENTS; i++) {
+        uint32_t frame[3] = { htonl(i), htonl(4), 0 };
+        write(fd[1], frame, sizeof(frame));
+    }
+    int n = fmux_select(handle, ready, &timeout), ordered = 1;
+    for (int i = 0; i < n; i++) ordered &= (ready[i] == fmux_open_channel(handle, i + 1));
+    ASSERT((n == 3 * FMUX_PUMP_EVENTS && ordered))
+    for (int i = 0; i < n; i++) fmux_read(ready[i], buf, sizeof(buf));
 
-    fmux_pump_add_handle(&pump, handle1);
-    ASSERT((pump.length == 2))
+    //A ring filled by the pump wakes up a blocked select
+    fmux_channel* fast = fmux_open_ring_channel(handle, 3, FMUX_RING_MIN, 0);
+    fmux_pump pump;
+    fmux_pump_init(&pump);
+    pthread_t thread, writer;
+    pthread_create(&thread, NULL, &fmux_pump_t_func, &pump);
+    fmux_pump_add_handle(&pump, handle);
+    pthread_create(&writer, NULL, &delayed_frame_t_func, &fd[1]);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    timeout.tv_sec = 5;
+    err = fmux_select(handle, ready, &timeout);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ASSERT((err == 1))
+    ASSERT((ready[0] == fast))
+    ASSERT((end.tv_sec - start.tv_sec < 2))
+    pthread_join(writer, NULL);
 
-    fmux_pump_remove_handle(&pump, handle1);
-    ASSERT((pump.length == 1))
+    free(ready);
+    fmux_pump_remove_handle(&pump, handle);
+    fmux_pump_stop(&pump);
+    pthread_join(thread, NULL);
+    fmux_close(handle);
+    close(fd[1]);
 }
 
-void*
-fmux_pump_t_func(void* arg)
+void
+test_closed_channels_are_freed()
 {
-    fmux_pump_start(arg);
-    return NULL;
+    //Closing channels over and over on a pumped handle doesn't keep every
+    //one of them around until fmux_close
+    int fd[2];
+    int err = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+    if (err < -1) { perror("socketpair"); FAILURE }
+    fmux_handle* handle = fmux_open(fd[0], FMUX_RECOMMENDED_CHANS);
+    fmux_pump pump;
+    fmux_pump_init(&pump);
+    pthread_t pump_thread;
+    pthread_create(&pump_thread, NULL, &fmux_pump_t_func, &pump);
+    fmux_pump_add_handle(&pump, handle);
+
+    size_t before = 0;
+    int written = 0;
+    for (int i = 0; i < 4000; i++) {
+        if (i == 100) before = mallinfo2().uordblks;
+        fmux_channel* channel = (i % 2) ? fmux_open_channel(handle, 1) :
+                                fmux_open_ring_channel(handle, 1, FMUX_RING_MIN, 0);
+        //Not so often that the link fills up, with nobody reading it
+        if (i % 100 == 0) written += (fmux_write(channel, "x", 1) == 1);
+        fmux_close_channel(handle, 1);
+    }
+    //The last few go once the pump is done with them, at the next close
+    usleep(100000);
+    fmux_close_channel(handle, 1);
+    size_t after = mallinfo2().uordblks;
+    ASSERT((written == 40))
+    ASSERT((after < before + 256 * 1024))
+
+    fmux_pump_stop(&pump);
+    pthread_join(pump_thread, NULL);
+    fmux_close(handle);
+    close(fd[1]);
 }
 
 void
-test_using_pump()
+test_open_channel_without_fds()
 {
+    //With no fd numbers left, opening a channel fails instead of handing
+    //back one with no sockets
     int fd[2];
     int err = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
     if (err < -1) { perror("socketpair"); FAILURE }
+    fmux_handle* handle = fmux_open(fd[0], FMUX_RECOMMENDED_CHANS);
+    struct rlimit lim, none;
+    getrlimit(RLIMIT_NOFILE, &lim);
+    int lowest = dup(fd[1]);
+    close(lowest);
+    none = lim;
+    none.rlim_cur = lowest;
+    setrlimit(RLIMIT_NOFILE, &none);
+    fmux_channel* channel = fmux_open_channel(handle, 1);
+    int failed = (channel == NULL && errno == EMFILE);
+    setrlimit(RLIMIT_NOFILE, &lim);
+    ASSERT((failed && fmux_open_msg_channel(handle, 1) != NULL))
+    fmux_close(handle);
+    close(fd[1]);
+}
 
-    fmux_handle* handle1 = fmux_open(fd[0], FMUX_RECOMMENDED_CHANS);
-    fmux_handle* handle2 = fmux_open(fd[1], FMUX_RECOMMENDED_CHANS);
-    fmux_channel* channel1 = fmux_open_channel(handle1, 0);
-    fmux_channel* channel2 = fmux_open_channel(handle2, 0);
+void
+test_statistics()
+{
+    int fd[2];
+    int err = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+    if (err < -1) { perror("socketpair"); FAILURE }
 
-    char * hello = "\0\0\0\0\0\0\0\xA" "Channel 0";
-    write(fd[1], hello, 18);
-    write(fd[0], hello, 18);
+    fmux_handle* handle = fmux_open(fd[0], FMUX_RECOMMENDED_CHANS);
+    fmux_channel* sock = fmux_open_channel(handle, 1);
+    fmux_channel* ring = fmux_open_ring_channel(handle, 2, FMUX_RING_MIN, 0);
+    ASSERT((fmux_set_latency_tracking(handle, 1) == 0))
+
+    write(fd[1], "\0\0\0\1\0\0\0\6Hello", 14);
+    write(fd[1], "\0\0\0\x09\0\0\0\4Drop", 12);
+    write(fd[1], "\0\0\0\2\0\0\0\6World", 14);
+    char buf[16];
+    fmux_read(sock, buf, sizeof(buf));
+    fmux_read(ring, buf, sizeof(buf));
+    fmux_write(sock, "abc", 3);
+    //Left unread
+    write(fd[1], "\0\0\0\1\0\0\0\5More", 13);
+    write(fd[1], "\0\0\0\2\0\0\0\2!", 10);
+    fmux_read(ring, buf, sizeof(buf));
+
+    fmux_stats stats;
+    ASSERT((fmux_get_stats(handle, &stats) == 0))
+    ASSERT((stats.frames_in == 5 && stats.bytes_in == 23))
+    ASSERT((stats.frames_dropped == 1 && stats.bytes_dropped == 4))
+    ASSERT((stats.frames_out == 1 && stats.bytes_out == 3 && stats.writes == 1))
+    ASSERT((stats.reads >= 2 && stats.channels == 3)) //With channel 0
+
+    fmux_channel_stats chan;
+    ASSERT((fmux_channel_get_stats(sock, &chan) == 0))
+    ASSERT((chan.frames_in == 2 && chan.bytes_in == 11 && chan.bytes_read == 6))
+    ASSERT((chan.frames_out == 1 && chan.rx_queued == 5))
+    //Only the frames that were read get timed
+    uint64_t timed = 0, timed_ring = 0, timed_all = 0;
+    fmux_channel_stats ring_stats;
+    fmux_channel_get_stats(ring, &ring_stats);
+    for (int i = 0; i < FMUX_LATENCY_BUCKETS; i++) {
+        timed += chan.latency[i];
+        timed_ring += ring_stats.latency[i];
+        timed_all += stats.latency[i];
+    }
+    ASSERT((timed == 1 && timed_ring == 2 && timed_all == 3))
+
+    fmux_close_channel(handle, 2);
+    ASSERT((fmux_channel_get_stats(ring, &ring_stats) == -1))
+    fmux_close(handle);
+    close(fd[1]);
+}
+
+#define PUSHERS 4
+#define PUSHES 2000
+
+void*
+pusher_t_func(void* arg)
+{
+    fmux_handle* handle = ((void**)arg)[0];
+    uint32_t channel_id = (uint32_t)(uintptr_t)((void**)arg)[1];
+    fmux_message* message = fmux_message_alloc(handle, sizeof(uint32_t));
+    message->channel_id = channel_id;
+    for (uint32_t i = 0; i < PUSHES; i++) {
+        memcpy(message->data, &i, sizeof(i));
+        if (fmux_push(handle, message) != 12) break;
+    }
+    fmux_message_release(message);
+    return NULL;
+}
+
+void
+test_concurrent_pushes()
+{
+    int fd[2];
+    int err = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+    if (err < -1) { perror("socketpair"); FAILURE }
+    fmux_handle* sender = fmux_open(fd[0], FMUX_RECOMMENDED_CHANS);
+    fmux_handle* receiver = fmux_open(fd[1], FMUX_RECOMMENDED_CHANS);
+
+    pthread_t threads[PUSHERS];
+    void* args[PUSHERS][2];
+    for (int i = 0; i < PUSHERS; i++) {
+        args[i][0] = sender;
+        args[i][1] = (void*)(uintptr_t)(i + 1);
+        pthread_create(&threads[i], NULL, &pusher_t_func, args[i]);
+    }
+    //Every frame arrives whole, and each pusher's in order
+    uint32_t next[PUSHERS + 1] = {0};
+    int good = 1;
+    fmux_message* message = NULL;
+    for (int i = 0; i < PUSHERS * PUSHES && good; i++) {
+        uint32_t seq;
+        if (fmux_pop(receiver, &message) != 1 || message->channel_id < 1 ||
+            message->channel_id > PUSHERS || message->nbytes != sizeof(seq)) {
+            good = 0;
+            break;
+        }
+        memcpy(&seq, message->data, sizeof(seq));
+        if (seq != next[message->channel_id]++) good = 0;
+    }
+    for (int i = 0; i < PUSHERS; i++) pthread_join(threads[i], NULL);
+    ASSERT((good))
+
+    fmux_stats stats;
+    fmux_get_stats(sender, &stats);
+    ASSERT((stats.frames_out == PUSHERS * PUSHES && stats.writes <= stats.frames_out))
+
+    free(message);
+    fmux_close(sender);
+    fmux_close(receiver);
+}
+
+void
+test_corked_writes()
+{
+    int fd[2];
+    int err = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+    if (err < -1) { perror("socketpair"); FAILURE }
+
+    fmux_handle* handle = fmux_open(fd[0], FMUX_RECOMMENDED_CHANS);
+    fmux_channel* one = fmux_open_channel(handle, 1);
+    fmux_channel* two = fmux_open_channel(handle, 2);
+    ASSERT((fmux_set_cork(handle, 65536, 0) == 0))
+
+    fmux_write(one, "abc", 3);
+    fmux_write(two, "de", 2);
+    fmux_stats stats;
+    fmux_get_stats(handle, &stats);
+    ASSERT((stats.frames_out == 2 && stats.writes == 0))
+    ASSERT((fmux_flush(handle) == 0))
+    char buf[64];
+    ASSERT((read(fd[1], buf, sizeof(buf)) == 21))
+    ASSERT((memcmp(buf, "\0\0\0\1\0\0\0\3abc\0\0\0\2\0\0\0\2de", 21) == 0))
+
+    //Frames too big to hold go out straight away, behind the held ones
+    fmux_set_max_frame(handle, 4);
+    fmux_write(one, "f", 1);
+    fmux_write(two, "ghijk", 5);
+    ASSERT((read(fd[1], buf, sizeof(buf)) == 30))
+    ASSERT((memcmp(buf, "\0\0\0\1\0\0\0\1f\0\0\0\2\0\0\0\4ghij\0\0\0\2\0\0\0\1k", 30) == 0))
+
+    //Filling up to the limit sends them too
+    fmux_set_cork(handle, 16, 0);
+    fmux_write(one, "abc", 3);
+    fmux_get_stats(handle, &stats);
+    uint64_t writes = stats.writes;
+    fmux_write(two, "de", 2);
+    fmux_get_stats(handle, &stats);
+    ASSERT((stats.writes == writes + 1))
+    read(fd[1], buf, sizeof(buf));
+
+    //And the pump keeps the deadline
+    fmux_set_cork(handle, 65536, 1000);
+    fmux_pump pump;
+    fmux_pump_init(&pump);
+    pthread_t thread;
+    pthread_create(&thread, NULL, &fmux_pump_t_func, &pump);
+    fmux_pump_add_handle(&pump, handle);
+    fmux_write(one, "abc", 3);
+    struct pollfd pfd = {.fd = fd[1], .events = POLLIN};
+    ASSERT((poll(&pfd, 1, 2000) == 1))
+    ASSERT((read(fd[1], buf, sizeof(buf)) == 11))
+
+    fmux_pump_remove_handle(&pump, handle);
+    fmux_pump_stop(&pump);
+    pthread_join(thread, NULL);
+    fmux_close(handle);
+    close(fd[1]);
+}
+
+void
+test_management_of_handle_lists()
+{
+    int fd[2];
+    int err = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+    if (err < -1) { perror("socketpair"); FAILURE }
+
+    fmux_handle* handle1 = fmux_open(fd[0], FMUX_RECOMMENDED_CHANS);
+    fmux_handle* handle2 = fmux_open(fd[1], FMUX_RECOMMENDED_CHANS);
+    fmux_pump pump;
+    fmux_pump_init(&pump);
+
+    fmux_pump_add_handle(&pump, handle1);
+    ASSERT((pump.length == 1))
+
+    fmux_pump_add_handle(&pump, handle1);
+    ASSERT((pump.length == 1))
+
+    fmux_pump_add_handle(&pump, handle2);
+    ASSERT((pump.length == 2))
+
+    fmux_pump_remove_handle(&pump, handle1);
+    ASSERT((pump.length == 1))
+
+    fmux_pump_add_handle(&pump, handle1);
+    ASSERT((pump.length == 2))
+
+    fmux_pump_remove_handle(&pump, handle1);
+    ASSERT((pump.length == 1))
+}
+
+void*
+fmux_pump_t_func(void* arg)
+{
+    fmux_pump_start(arg);
+    return NULL;
+}
+
+void
+test_using_pump()
+{
+    int fd[2];
+    int err = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+    if (err < -1) { perror("socketpair"); FAILURE }
+
+    fmux_handle* handle1 = fmux_open(fd[0], FMUX_RECOMMENDED_CHANS);
+    fmux_handle* handle2 = fmux_open(fd[1], FMUX_RECOMMENDED_CHANS);
+    fmux_channel* channel1 = fmux_open_channel(handle1, 0);
+    fmux_channel* channel2 = fmux_open_channel(handle2, 0);
+
+    char * hello = "\0\0\0\0\0\0\0\xA" "Channel 0";
+    write(fd[1], hello, 18);
+    write(fd[0], hello, 18);
 
     fmux_pump pump;
     fmux_pump_init(&pump);
@@ -290,6 +1101,873 @@ test_using_pump()
     pthread_join(thread, NULL);
 }
 
+void
+test_pump_wakes_promptly()
+{
+    int fd[2];
+    int err = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+    if (err < -1) { perror("socketpair"); FAILURE }
+
+    //Start the pump with nothing in it; adding a handle afterwards should not
+    //have to wait for the pump to notice.
+    fmux_pump pump;
+    fmux_pump_init(&pump);
+    pthread_t thread;
+    pthread_create(&thread, NULL, &fmux_pump_t_func, &pump);
+
+    fmux_handle* handle = fmux_open(fd[0], FMUX_RECOMMENDED_CHANS);
+    fmux_channel* channel = fmux_open_channel(handle, 1);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ASSERT((fmux_pump_add_handle(&pump, handle) == 0))
+
+    char * hello = "\0\0\0\1\0\0\0\6Hello";
+    write(fd[1], hello, 14);
+
+    char buf[1024];
+    err = fmux_read(channel, buf, 1024);
+    ASSERT((err == 6))
+    ASSERT((strcmp(buf, "Hello") == 0))
+
+    //Stopping wakes the pump up, so the thread should exit on its own
+    ASSERT((fmux_pump_stop(&pump) == 0))
+    pthread_join(thread, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long elapsed_ms = (end.tv_sec - start.tv_sec) * 1000 +
+        (end.tv_nsec - start.tv_nsec) / 1000000;
+    ASSERT((elapsed_ms < 500))
+
+    fmux_close(handle);
+    close(fd[1]);
+}
+void
+test_using_pump_pool()
+{
+    #define POOL_HANDLES 8
+    int fds[POOL_HANDLES][2];
+    fmux_handle* handles[POOL_HANDLES];
+    fmux_channel* channels[POOL_HANDLES];
+
+    int cpus[3] = {0, 0, 0};
+    fmux_pump_pool* pool = fmux_pump_pool_create(3, cpus);
+    ASSERT((pool != NULL))
+
+    for (int i = 0; i < POOL_HANDLES; i++) {
+        int err = socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]);
+        if (err < -1) { perror("socketpair"); FAILURE }
+        handles[i] = fmux_open(fds[i][0], FMUX_RECOMMENDED_CHANS);
+        channels[i] = fmux_open_channel(handles[i], 3);
+        ASSERT((fmux_pump_pool_add_handle(pool, handles[i]) == 0))
+    }
+
+    //Several rounds so that plenty of handles are ready at the same time
+    for (int round = 0; round < 4; round++) {
+        for (int i = 0; i < POOL_HANDLES; i++) {
+            char * hello = "\0\0\0\3\0\0\0\x6" "Pool!";
+            write(fds[i][1], hello, 14);
+        }
+        for (int i = 0; i < POOL_HANDLES; i++) {
+            char buf[1024];
+            int nread = fmux_read(channels[i], buf, 6);
+            ASSERT((nread == 6))
+            ASSERT((strcmp(buf, "Pool!") == 0))
+        }
+    }
+
+    for (int i = 0; i < POOL_HANDLES; i++) {
+        ASSERT((fmux_pump_pool_remove_handle(pool, handles[i]) == 0))
+        fmux_close(handles[i]);
+        close(fds[i][1]);
+    }
+    fmux_pump_pool_destroy(pool);
+}
+void
+test_pump_drains_channel_fds()
+{
+    int fd[2];
+    int err = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+    if (err < -1) { perror("socketpair"); FAILURE }
+
+    fmux_handle* handle = fmux_open(fd[0], FMUX_RECOMMENDED_CHANS);
+    fmux_channel* channel = fmux_open_channel(handle, 1);
+    fmux_pump pump;
+    fmux_pump_init(&pump);
+    pthread_t thread;
+    pthread_create(&thread, NULL, &fmux_pump_t_func, &pump);
+    fmux_pump_add_handle(&pump, handle);
+
+    //A channel opened after the handle joined the pump is watched as well
+    fmux_channel* late = fmux_open_channel(handle, 2);
+
+    //Write straight into the channel fds; nobody calls fmux_write, so only
+    //the pump can get this onto the wire.
+    ASSERT((write(fmux_channel_write_fd(channel), "Hello", 6) == 6))
+    ASSERT((write(fmux_channel_write_fd(late), "Later", 6) == 6))
+
+    char buf[1024];
+    int nread = 0;
+    while (nread < 28) {
+        struct pollfd pfd = {.fd = fd[1], .events = POLLIN};
+        if (poll(&pfd, 1, 1000) != 1) break;
+        int n = read(fd[1], buf + nread, sizeof(buf) - nread);
+        if (n <= 0) break;
+        nread += n;
+    }
+    ASSERT((nread == 28))
+    ASSERT((memcmp(buf, "\0\0\0\1\0\0\0\6Hello", 14) == 0))
+    ASSERT((memcmp(buf + 14, "\0\0\0\2\0\0\0\6Later", 14) == 0))
+
+    fmux_pump_stop(&pump);
+    pthread_join(thread, NULL);
+    fmux_close(handle);
+    close(fd[1]);
+}
+
+#define SPLICED (256 * 1024)
+
+void*
+fd_writer_t_func(void* arg)
+{
+    //Straight into the channel fd, as a process piping its output would
+    int fd = *(int*)arg;
+    static char data[SPLICED];
+    for (int i = 0; i < SPLICED; i++) data[i] = (char)(i * 5);
+    for (int off = 0; off < SPLICED;) {
+        int n = write(fd, data + off, SPLICED - off);
+        if (n <= 0) break;
+        off += n;
+    }
+    return NULL;
+}
+
+void
+test_splice_forwarding()
+{
+    int fd[2];
+    int err = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+    if (err < -1) { perror("socketpair"); FAILURE }
+    fmux_handle* sender = fmux_open(fd[0], FMUX_RECOMMENDED_CHANS);
+    fmux_handle* receiver = fmux_open(fd[1], FMUX_RECOMMENDED_CHANS);
+    fmux_channel* out = fmux_open_channel(sender, 1);
+    fmux_channel* in = fmux_open_channel(receiver, 1);
+    ASSERT((fmux_set_splice(sender, 1) == 0 && fmux_set_splice(receiver, 1) == 0))
+    int devnull = open("/dev/null", O_WRONLY);
+    fmux_handle* unspliceable = fmux_open(devnull, FMUX_RECOMMENDED_CHANS);
+    ASSERT((fmux_set_splice(unspliceable, 1) == -1))
+    fmux_close(unspliceable);
+
+    //A pump each, so neither end's writes hold up the other's reads
+    fmux_pump sending, receiving;
+    fmux_pump_init(&sending);
+    fmux_pump_init(&receiving);
+    pthread_t threads[3];
+    pthread_create(&threads[0], NULL, &fmux_pump_t_func, &sending);
+    pthread_create(&threads[1], NULL, &fmux_pump_t_func, &receiving);
+    fmux_pump_add_handle(&sending, sender);
+    fmux_pump_add_handle(&receiving, receiver);
+    int write_fd = fmux_channel_write_fd(out);
+    pthread_create(&threads[2], NULL, &fd_writer_t_func, &write_fd);
+
+    static char buf[SPLICED];
+    int nread = 0, read_fd = fmux_channel_read_fd(in);
+    while (nread < SPLICED) {
+        struct pollfd pfd = {.fd = read_fd, .events = POLLIN};
+        if (poll(&pfd, 1, 2000) != 1) break;
+        int n = read(read_fd, buf + nread, SPLICED - nread);
+        if (n <= 0) break;
+        nread += n;
+    }
+    pthread_join(threads[2], NULL);
+    int intact = 1;
+    for (int i = 0; i < nread; i++) intact &= (buf[i] == (char)(i * 5));
+    ASSERT((nread == SPLICED && intact))
+
+    fmux_pump_remove_handle(&sending, sender);
+    fmux_pump_remove_handle(&receiving, receiver);
+    fmux_pump_stop(&sending);
+    fmux_pump_stop(&receiving);
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+    fmux_stats stats;
+    fmux_get_stats(receiver, &stats);
+    ASSERT((stats.bytes_in == SPLICED))
+    fmux_close(sender);
+    fmux_close(receiver);
+}
+
+void
+test_message_channels()
+{
+    int fd[2];
+    int err = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+    if (err < -1) { perror("socketpair"); FAILURE }
+    fmux_handle* sender = fmux_open(fd[0], FMUX_RECOMMENDED_CHANS);
+    fmux_handle* receiver = fmux_open(fd[1], FMUX_RECOMMENDED_CHANS);
+    fmux_channel* out = fmux_open_msg_channel(sender, 1);
+    fmux_channel* in = fmux_open_msg_channel(receiver, 1);
+    fmux_channel* stream = fmux_open_channel(sender, 2);
+    static char big[FMUX_MSG_MAX + 1], got[FMUX_MSG_MAX + 1];
+    for (int i = 0; i < FMUX_MSG_MAX; i++) big[i] = (char)(i * 3);
+    ASSERT((fmux_send_msg(out, big, FMUX_MSG_MAX + 1) == -1 && errno == EMSGSIZE))
+    ASSERT((fmux_send_msg(stream, "x", 1) == -1 && errno == EINVAL))
+    ASSERT((fmux_open_msg_channel(sender, 2) == NULL && errno == EEXIST))
+
+    //Each message comes out whole, however the link split it up
+    ASSERT((fmux_send_msg(out, "a", 1) == 1 && fmux_send_msg(out, big, FMUX_MSG_MAX) == FMUX_MSG_MAX))
+    int n1 = fmux_recv_msg(in, got, sizeof(got));
+    int ok1 = (n1 == 1 && got[0] == 'a');
+    int n2 = fmux_recv_msg(in, got, sizeof(got));
+    ASSERT((ok1 && n2 == FMUX_MSG_MAX && memcmp(got, big, FMUX_MSG_MAX) == 0))
+
+    //Records written to the fd become frames of their own, and a short
+    //buffer gets told how much it missed
+    int write_fd = fmux_channel_write_fd(out);
+    write(write_fd, "bcd", 3);
+    write(write_fd, "ef", 2);
+    fmux_send_msg(out, "ghij", 4);
+    char small[2];
+    int n3 = fmux_recv_msg(in, small, sizeof(small));
+    int read_fd = fmux_channel_read_fd(in);
+    int n4 = read(read_fd, got, sizeof(got));
+    int n5 = read(read_fd, got + n4, sizeof(got) - n4);
+    ASSERT((n3 == 3 && small[1] == 'c' && n4 == 2 && n5 == 4 && memcmp(got, "efghij", 6) == 0))
+    fmux_close(sender);
+    fmux_close(receiver);
+}
+
+#define BACKLOGGED_MSGS 400
+
+void*
+msg_writer_t_func(void* arg)
+{
+    char msg[1000];
+    for (int i = 0; i < BACKLOGGED_MSGS; i++) {
+        memset(msg, i, sizeof(msg));
+        if (fmux_send_msg(arg, msg, sizeof(msg)) != sizeof(msg)) break;
+    }
+    return NULL;
+}
+
+void
+test_message_channel_backlog()
+{
+    int fd[2];
+    int err = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+    if (err < -1) { perror("socketpair"); FAILURE }
+    fmux_handle* sender = fmux_open(fd[0], FMUX_RECOMMENDED_CHANS);
+    fmux_handle* receiver = fmux_open(fd[1], FMUX_RECOMMENDED_CHANS);
+    fmux_set_flow_control(sender, 1 << 20);
+    fmux_set_flow_control(receiver, 1 << 20);
+    fmux_channel* slow_out = fmux_open_msg_channel(sender, 1);
+    fmux_channel* fast_out = fmux_open_msg_channel(sender, 2);
+    fmux_channel* slow_in = fmux_open_msg_channel(receiver, 1);
+    fmux_channel* fast_in = fmux_open_msg_channel(receiver, 2);
+    fmux_pump pump;
+    fmux_pump_init(&pump);
+    pthread_t pump_thread, writer;
+    pthread_create(&pump_thread, NULL, &fmux_pump_t_func, &pump);
+    fmux_pump_add_handle(&pump, receiver);
+
+    //More messages than channel 1's socket holds, and nobody reading them
+    //yet; channel 2 still gets through
+    pthread_create(&writer, NULL, &msg_writer_t_func, slow_out);
+    fmux_channel_stats stats = {0};
+    for (int i = 0; i < 2000 && stats.frames_in < BACKLOGGED_MSGS / 2; i++) {
+        usleep(1000);
+        fmux_channel_get_stats(slow_in, &stats);
+    }
+    fmux_send_msg(fast_out, "ping", 4);
+    char buf[1000];
+    struct pollfd pfd = {.fd = fmux_channel_read_fd(fast_in), .events = POLLIN};
+    ASSERT((poll(&pfd, 1, 2000) == 1 && fmux_recv_msg(fast_in, buf, sizeof(buf)) == 4))
+
+    //...and channel 1's come out whole, in order, as it's read
+    int nread = 0, good = 1;
+    pfd.fd = fmux_channel_read_fd(slow_in);
+    while (nread < BACKLOGGED_MSGS && poll(&pfd, 1, 2000) == 1) {
+        int n = fmux_recv_msg(slow_in, buf, sizeof(buf));
+        good &= (n == sizeof(buf) && buf[0] == (char)nread && buf[999] == (char)nread);
+        nread++;
+    }
+    pthread_join(writer, NULL);
+    ASSERT((nread == BACKLOGGED_MSGS && good))
+
+    fmux_pump_remove_handle(&pump, receiver);
+    fmux_pump_stop(&pump);
+    pthread_join(pump_thread, NULL);
+    fmux_close(sender);
+    fmux_close(receiver);
+}
+
+void*
+open_v2_t_func(void* arg)
+{
+    //Both ends wait for each other's hello
+    return fmux_open_v2(*(int*)arg, FMUX_RECOMMENDED_CHANS, 5000);
+}
+
+void
+test_compact_headers()
+{
+    int fd[2];
+    int err = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+    if (err < -1) { perror("socketpair"); FAILURE }
+    pthread_t thread;
+    void* ret;
+    pthread_create(&thread, NULL, &open_v2_t_func, &fd[1]);
+    fmux_handle* sender = fmux_open_v2(fd[0], FMUX_RECOMMENDED_CHANS, 5000);
+    pthread_join(thread, &ret);
+    fmux_handle* receiver = ret;
+    ASSERT((fmux_get_protocol(sender) == FMUX_PROTO_V2 && fmux_get_protocol(receiver) == FMUX_PROTO_V2))
+
+    //A small frame on a low channel has a 2 byte header; bigger ones grow it
+    fmux_message* message = fmux_message_alloc(sender, 5);
+    message->channel_id = 3;
+    memcpy(message->data, "hello", 5);
+    int pushed = fmux_push(sender, message);
+    fmux_channel* big = fmux_open_channel(sender, 300);
+    static char buf[20000];
+    for (size_t i = 0; i < sizeof(buf); i++) buf[i] = (char)i;
+    int written = fmux_write(big, buf, sizeof(buf));
+    fmux_message* got = NULL;
+    int ok = (fmux_pop(receiver, &got) == 1 && got->channel_id == 3 && got->nbytes == 5 &&
+              memcmp(got->data, "hello", 5) == 0);
+    free(got);
+    got = NULL;
+    ASSERT((pushed == 7 && written == sizeof(buf) && ok))
+    ASSERT((fmux_pop(receiver, &got) == 1 && got->channel_id == 300 && got->nbytes == sizeof(buf) &&
+            memcmp(got->data, buf, sizeof(buf)) == 0))
+    free(got);
+    got = NULL;
+    fmux_close(sender);
+    fmux_close(receiver);
+
+    //Against a peer that never offers, both ends stay v1
+    err = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+    if (err < -1) { perror("socketpair"); FAILURE }
+    pthread_create(&thread, NULL, &open_v2_t_func, &fd[1]);
+    fmux_handle* old = fmux_open(fd[0], FMUX_RECOMMENDED_CHANS);
+    pushed = fmux_push(old, message);
+    pthread_join(thread, &ret);
+    fmux_handle* offered = ret;
+    ASSERT((pushed == 13 && fmux_get_protocol(offered) == FMUX_PROTO_V1))
+    ok = (fmux_pop(offered, &got) == 1 && got->channel_id == 3 && got->nbytes == 5);
+    free(got);
+    got = NULL;
+    fmux_push(offered, message);
+    //The old peer never sees the offer
+    ASSERT((ok && fmux_pop(old, &got) == 1 && got->channel_id == 3))
+    free(got);
+    fmux_message_release(message);
+    fmux_close(old);
+    fmux_close(offered);
+}
+
+void
+test_v2_against_v1_peer()
+{
+    //The offer goes out on FMUX_PROTO_CHANNEL, which a v1 peer drops like any
+    //channel it hasn't opened; nothing shows up on its channels or in fmux_pop.
+    //With a timeout of 0, fmux_open_v2 doesn't wait for an answer.
+    int fd[2];
+    int err = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+    if (err < -1) { perror("socketpair"); FAILURE }
+    fmux_handle* old = fmux_open(fd[1], FMUX_RECOMMENDED_CHANS);
+    fmux_handle* offered = fmux_open_v2(fd[0], FMUX_RECOMMENDED_CHANS, 0);
+    ASSERT((offered != NULL && fmux_get_protocol(offered) == FMUX_PROTO_V1))
+    ASSERT((fmux_open_channel(offered, FMUX_PROTO_CHANNEL) == NULL && errno == EINVAL))
+
+    fmux_message* message = fmux_message_alloc(offered, 3);
+    message->channel_id = 5;
+    memcpy(message->data, "abc", 3);
+    int pushed = fmux_push(offered, message);
+    fmux_message* got = NULL;
+    ASSERT((pushed == 11 && fmux_pop(old, &got) == 1 && got->channel_id == 5 && got->nbytes == 3 &&
+            memcmp(got->data, "abc", 3) == 0))
+    fmux_close(old);
+    fmux_close(offered);
+
+    //Same through the old peer's channels
+    err = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+    if (err < -1) { perror("socketpair"); FAILURE }
+    old = fmux_open(fd[1], FMUX_RECOMMENDED_CHANS);
+    fmux_channel* zero = fmux_open_channel(old, 0);
+    offered = fmux_open_v2(fd[0], FMUX_RECOMMENDED_CHANS, 0);
+    message->channel_id = 0;
+    fmux_push(offered, message);
+    fmux_message_release(message);
+    char buf[16];
+    int nread = fmux_read(zero, buf, sizeof(buf));
+    fmux_stats stats;
+    fmux_get_stats(old, &stats);
+    ASSERT((nread == 3 && memcmp(buf, "abc", 3) == 0 && stats.frames_dropped == 0))
+    free(got);
+    fmux_close(old);
+    fmux_close(offered);
+}
+
+#define BONDED (512 * 1024)
+
+void*
+bonded_writer_t_func(void* arg)
+{
+    int fd = ((int*)arg)[0], step = ((int*)arg)[1];
+    char* data = malloc(BONDED);
+    for (int i = 0; i < BONDED; i++) data[i] = (char)(i * step);
+    for (int off = 0; off < BONDED;) {
+        int n = write(fd, data + off, BONDED - off);
+        if (n <= 0) break;
+        off += n;
+    }
+    free(data);
+    return NULL;
+}
+
+void
+test_bonded_links()
+{
+    int fd[3][2];
+    for (int i = 0; i < 3; i++) {
+        int err = socketpair(AF_UNIX, SOCK_STREAM, 0, fd[i]);
+        if (err < -1) { perror("socketpair"); FAILURE }
+    }
+    fmux_handle* sender = fmux_open(fd[0][0], FMUX_RECOMMENDED_CHANS);
+    fmux_handle* receiver = fmux_open(fd[0][1], FMUX_RECOMMENDED_CHANS);
+    int a1 = fmux_add_link(sender, fd[1][0]);
+    int a2 = fmux_add_link(sender, fd[2][0]);
+    //The peer may bond its ends in any order
+    int b1 = fmux_add_link(receiver, fd[2][1]);
+    int b2 = fmux_add_link(receiver, fd[1][1]);
+    ASSERT((a1 == 1 && a2 == 2 && b1 == 1 && b2 == 2))
+    ASSERT((fmux_set_flow_control(sender, FMUX_MIN_WINDOW) == -1 && fmux_get_link(sender, 3) == NULL))
+
+    //Channels 1, 2 and 3 go out over links 1, 2 and 0
+    fmux_channel* out[3];
+    fmux_channel* in[3];
+    for (int i = 0; i < 3; i++) {
+        out[i] = fmux_open_channel(sender, i + 1);
+        in[i] = fmux_open_channel(receiver, i + 1);
+    }
+    int written = 0, got = 0;
+    for (int i = 0; i < 3; i++) written += fmux_write(out[i], "abc", 3);
+    char buf[16];
+    for (int i = 0; i < 3; i++) got += fmux_read(in[i], buf + 3 * i, 3);
+    uint64_t fewest = UINT64_MAX;
+    for (int i = 0; i < 3; i++) {
+        fmux_stats stats;
+        fmux_get_stats(fmux_get_link(sender, i), &stats);
+        if (stats.frames_out < fewest) fewest = stats.frames_out;
+    }
+    ASSERT((written == 9 && got == 9 && memcmp(buf, "abcabcabc", 9) == 0 && fewest == 1))
+
+    //Through pumps, two channel fds at once, each over a link of its own
+    fmux_pump sending, receiving;
+    fmux_pump_init(&sending);
+    fmux_pump_init(&receiving);
+    pthread_t threads[4];
+    pthread_create(&threads[0], NULL, &fmux_pump_t_func, &sending);
+    pthread_create(&threads[1], NULL, &fmux_pump_t_func, &receiving);
+    fmux_pump_add_handle(&sending, sender);
+    fmux_pump_add_handle(&receiving, receiver);
+    int args[2][2];
+    for (int i = 0; i < 2; i++) {
+        args[i][0] = fmux_channel_write_fd(out[i]);
+        args[i][1] = i + 3;
+        pthread_create(&threads[2 + i], NULL, &bonded_writer_t_func, args[i]);
+    }
+    char* data = malloc(BONDED);
+    int nread[2] = {0, 0}, intact = 1;
+    struct pollfd pfds[2];
+    for (int i = 0; i < 2; i++) {
+        pfds[i].fd = fmux_channel_read_fd(in[i]);
+        pfds[i].events = POLLIN;
+    }
+    while ((nread[0] < BONDED || nread[1] < BONDED) && poll(pfds, 2, 2000) > 0) {
+        for (int i = 0; i < 2; i++) {
+            if (!(pfds[i].revents & POLLIN)) continue;
+            int n = read(pfds[i].fd, data, BONDED);
+            for (int k = 0; k < n; k++) intact &= (data[k] == (char)((nread[i] + k) * (i + 3)));
+            if (n > 0) nread[i] += n;
+        }
+    }
+    free(data);
+    pthread_join(threads[2], NULL);
+    pthread_join(threads[3], NULL);
+    ASSERT((nread[0] == BONDED && nread[1] == BONDED && intact))
+
+    fmux_pump_remove_handle(&sending, sender);
+    fmux_pump_remove_handle(&receiving, receiver);
+    fmux_pump_stop(&sending);
+    fmux_pump_stop(&receiving);
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+    fmux_stats one, two;
+    fmux_get_stats(fmux_get_link(receiver, b1), &one);
+    fmux_get_stats(fmux_get_link(receiver, b2), &two);
+    ASSERT((one.bytes_in == BONDED + 3 && two.bytes_in == BONDED + 3))
+    fmux_close(sender);
+    fmux_close(receiver);
+}
+
+#define NB_CHUNK 16384
+
+void
+test_nonblocking_link()
+{
+    int fd[2];
+    int err = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+    if (err < -1) { perror("socketpair"); FAILURE }
+    fmux_handle* sender = fmux_open(fd[0], FMUX_RECOMMENDED_CHANS);
+    fmux_handle* receiver = fmux_open(fd[1], FMUX_RECOMMENDED_CHANS);
+    fmux_channel* out = fmux_open_channel(sender, 1);
+    int devnull = open("/dev/null", O_WRONLY);
+    fmux_handle* unsocketed = fmux_open(devnull, FMUX_RECOMMENDED_CHANS);
+    ASSERT((fmux_set_nonblocking(unsocketed, 65536) == -1))
+    fmux_close(unsocketed);
+    ASSERT((fmux_set_nonblocking(sender, 65536) == 0))
+
+    //Nobody is reading, so writes pile up until they're turned away
+    static char chunk[NB_CHUNK];
+    int sent = 0, n;
+    do {
+        memset(chunk, sent, NB_CHUNK);
+        n = fmux_write(out, chunk, NB_CHUNK);
+    } while (n == NB_CHUNK && ++sent < 1000);
+    ASSERT((n == -1 && errno == EAGAIN && sent > 4))
+
+    //Then everything arrives in order, split up wherever writes came up short
+    int got = 0, intact = 1;
+    fmux_message* message = NULL;
+    while (got < sent) {
+        fmux_flush(sender);
+        if (fmux_pop(receiver, &message) != 1 || message->nbytes != NB_CHUNK) break;
+        for (int i = 0; i < NB_CHUNK; i++) intact &= (message->data[i] == (char)got);
+        got++;
+    }
+    ASSERT((got == sent && intact && fmux_flush(sender) == 0))
+
+    //With a pump, it's the one that sends the queue as the fd frees up
+    fmux_pump pump;
+    fmux_pump_init(&pump);
+    pthread_t pump_thread;
+    pthread_create(&pump_thread, NULL, &fmux_pump_t_func, &pump);
+    fmux_pump_add_handle(&pump, sender);
+    sent = 0;
+    while (fmux_write(out, chunk, NB_CHUNK) == NB_CHUNK && ++sent < 1000);
+    int turned_away = (errno == EAGAIN);
+    got = 0;
+    while (got < sent && fmux_pop(receiver, &message) == 1) got++;
+    free(message);
+    ASSERT((got == sent && turned_away))
+    fmux_pump_remove_handle(&pump, sender);
+    fmux_pump_stop(&pump);
+    pthread_join(pump_thread, NULL);
+    fmux_close(sender);
+    fmux_close(receiver);
+}
+
+void*
+shm_t_func(void* arg)
+{
+    //The handshake waits for the other end, so one end at a time won't do
+    static int err;
+    err = fmux_set_shm(arg, 0);
+    return &err;
+}
+
+void
+test_shm_transport()
+{
+    int fd[2];
+    int err = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+    if (err < -1) { perror("socketpair"); FAILURE }
+    fmux_handle* sender = fmux_open(fd[0], FMUX_RECOMMENDED_CHANS);
+    fmux_handle* receiver = fmux_open(fd[1], FMUX_RECOMMENDED_CHANS);
+    fmux_channel* out = fmux_open_channel(sender, 1);
+    fmux_channel* in = fmux_open_channel(receiver, 1);
+    pthread_t threads[3];
+    void* ret;
+    pthread_create(&threads[0], NULL, &shm_t_func, receiver);
+    err = fmux_set_shm(sender, FMUX_SHM_MIN);
+    pthread_join(threads[0], &ret);
+    ASSERT((err == 0 && *(int*)ret == 0))
+    int pipefd[2];
+    pipe(pipefd);
+    fmux_handle* piped = fmux_open(pipefd[0], FMUX_RECOMMENDED_CHANS);
+    ASSERT((fmux_set_shm(piped, 0) == -1 && fmux_set_splice(sender, 1) == -1))
+    fmux_close(piped);
+    close(pipefd[1]);
+
+    //Raw frames, with the reader blocking on the doorbell
+    void* args[2] = {sender, (void*)(uintptr_t)1};
+    pthread_create(&threads[0], NULL, &pusher_t_func, args);
+    uint32_t next = 0;
+    fmux_message* message = NULL;
+    while (next < PUSHES && fmux_pop(receiver, &message) == 1 &&
+           memcmp(message->data, &next, sizeof(next)) == 0)
+        next++;
+    free(message);
+    pthread_join(threads[0], NULL);
+    ASSERT((next == PUSHES))
+
+    //Through pumps, with several times the sender's ring in flight
+    fmux_pump sending, receiving;
+    fmux_pump_init(&sending);
+    fmux_pump_init(&receiving);
+    pthread_create(&threads[0], NULL, &fmux_pump_t_func, &sending);
+    pthread_create(&threads[1], NULL, &fmux_pump_t_func, &receiving);
+    fmux_pump_add_handle(&sending, sender);
+    fmux_pump_add_handle(&receiving, receiver);
+    int write_fd = fmux_channel_write_fd(out);
+    pthread_create(&threads[2], NULL, &fd_writer_t_func, &write_fd);
+
+    static char buf[SPLICED];
+    int nread = 0, read_fd = fmux_channel_read_fd(in);
+    while (nread < SPLICED) {
+        struct pollfd pfd = {.fd = read_fd, .events = POLLIN};
+        if (poll(&pfd, 1, 2000) != 1) break;
+        int n = read(read_fd, buf + nread, SPLICED - nread);
+        if (n <= 0) break;
+        nread += n;
+    }
+    pthread_join(threads[2], NULL);
+    int intact = 1;
+    for (int i = 0; i < nread; i++) intact &= (buf[i] == (char)(i * 5));
+    ASSERT((nread == SPLICED && intact))
+
+    fmux_pump_remove_handle(&sending, sender);
+    fmux_pump_remove_handle(&receiving, receiver);
+    fmux_pump_stop(&sending);
+    fmux_pump_stop(&receiving);
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+    //Nothing but doorbells went through the socket
+    int queued = -1;
+    ioctl(fd[1], FIONREAD, &queued);
+    ASSERT((queued >= 0 && queued < 64))
+    fmux_close(sender);
+    fmux_close(receiver);
+}
+
+void*
+uring_writer_t_func(void* arg)
+{
+    //1MiB in 64KiB frames, to get well ahead of the reader
+    int fd = *(int*)arg;
+    uint32_t header[2] = {htonl(1), htonl(sizeof(credited_data))};
+    for (int i = 0; i < 16; i++) {
+        write(fd, header, sizeof(header));
+        for (size_t off = 0; off < sizeof(credited_data);) {
+            ssize_t n = write(fd, credited_data + off, sizeof(credited_data) - off);
+            if (n <= 0) return NULL;
+            off += n;
+        }
+    }
+    return NULL;
+}
+
+void
+test_using_uring_pump()
+{
+    int fd[2];
+    int err = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+    if (err < -1) { perror("socketpair"); FAILURE }
+
+    //Falls back to epoll if the kernel won't give us io_uring; the rest
+    //should work the same either way
+    fmux_pump pump;
+    int engine = fmux_pump_init_engine(&pump, FMUX_ENGINE_URING);
+    ASSERT((engine == FMUX_ENGINE_URING || engine == FMUX_ENGINE_EPOLL))
+    ASSERT((pump.engine == engine))
+    pthread_t thread;
+    pthread_create(&thread, NULL, &fmux_pump_t_func, &pump);
+
+    fmux_handle* handle = fmux_open(fd[0], FMUX_RECOMMENDED_CHANS);
+    fmux_channel* channel = fmux_open_channel(handle, 1);
+    ASSERT((fmux_pump_add_handle(&pump, handle) == 0))
+
+    pthread_t writer;
+    pthread_create(&writer, NULL, &uring_writer_t_func, &fd[1]);
+    static char buf[65536];
+    size_t total = 0;
+    int intact = 1;
+    while (total < 16 * sizeof(credited_data)) {
+        int n = fmux_read(channel, buf, sizeof(buf));
+        if (n <= 0) break;
+        for (int i = 0; i < n; i++)
+            intact &= (buf[i] == credited_data[(total + i) % sizeof(credited_data)]);
+        total += n;
+    }
+    pthread_join(writer, NULL);
+    ASSERT((total == 16 * sizeof(credited_data)))
+    ASSERT((intact))
+
+    //Outbound still goes through the pump
+    ASSERT((write(fmux_channel_write_fd(channel), "Hello", 6) == 6))
+    int nread = 0;
+    while (nread < 14) {
+        struct pollfd pfd = {.fd = fd[1], .events = POLLIN};
+        if (poll(&pfd, 1, 1000) != 1) break;
+        int n = read(fd[1], buf + nread, sizeof(buf) - nread);
+        if (n <= 0) break;
+        nread += n;
+    }
+    ASSERT((nread == 14))
+    ASSERT((memcmp(buf, "\0\0\0\1\0\0\0\6Hello", 14) == 0))
+
+    //Once it's off the pump, the handle reads for itself again
+    ASSERT((fmux_pump_remove_handle(&pump, handle) == 0))
+    write(fd[1], "\0\0\0\1\0\0\0\6Again", 14);
+    ASSERT((fmux_read(channel, buf, sizeof(buf)) == 6))
+    ASSERT((strcmp(buf, "Again") == 0))
+
+    fmux_pump_stop(&pump);
+    pthread_join(thread, NULL);
+    fmux_close(handle);
+    close(fd[1]);
+}
+
+#define SMALL_FRAMES 20000
+
+void*
+small_frames_t_func(void* arg)
+{
+    //Frames of 7 bytes each, written in pieces that split their headers
+    int fd = *(int*)arg;
+    static char stream[SMALL_FRAMES * 15];
+    for (int i = 0; i < SMALL_FRAMES; i++) {
+        uint32_t header[2] = {htonl(1), htonl(7)};
+        memcpy(stream + i * 15, header, sizeof(header));
+        for (int j = 0; j < 7; j++) stream[i * 15 + 8 + j] = (char)(i * 7 + j);
+    }
+    for (size_t off = 0; off < sizeof(stream);) {
+        size_t len = (sizeof(stream) - off < 999) ? sizeof(stream) - off : 999;
+        ssize_t n = write(fd, stream + off, len);
+        if (n <= 0) return NULL;
+        off += n;
+    }
+    return NULL;
+}
+
+void
+test_uring_small_frames_into_full_ring()
+{
+    //Frames straddling the pump's receive buffers, for a ring channel that
+    //fills up and stalls the demuxer before anybody reads it
+    int fd[2];
+    int err = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+    if (err < -1) { perror("socketpair"); FAILURE }
+    fmux_pump pump;
+    fmux_pump_init_engine(&pump, FMUX_ENGINE_URING);
+    pthread_t thread, writer;
+    pthread_create(&thread, NULL, &fmux_pump_t_func, &pump);
+    fmux_handle* handle = fmux_open(fd[0], FMUX_RECOMMENDED_CHANS);
+    fmux_channel* channel = fmux_open_ring_channel(handle, 1, FMUX_RING_MIN, 0);
+    fmux_pump_add_handle(&pump, handle);
+    pthread_create(&writer, NULL, &small_frames_t_func, &fd[1]);
+    usleep(50000);
+
+    static char buf[4096];
+    size_t total = 0;
+    int intact = 1;
+    while (total < SMALL_FRAMES * 7) {
+        int n = fmux_read(channel, buf, sizeof(buf));
+        if (n <= 0) break;
+        for (int i = 0; i < n; i++) intact &= (buf[i] == (char)(total + i));
+        total += n;
+    }
+    pthread_join(writer, NULL);
+    ASSERT((total == SMALL_FRAMES * 7))
+    ASSERT((intact))
+
+    fmux_pump_remove_handle(&pump, handle);
+    fmux_pump_stop(&pump);
+    pthread_join(thread, NULL);
+    fmux_close(handle);
+    close(fd[1]);
+}
+
+#define CAPTURED 80000
+
+int
+capture_load(int fd, char** file, fmux_capture_record* records, const char** payloads, int max)
+{
+    //Reads a capture file back. Returns the number of records, or -1.
+    off_t size = lseek(fd, 0, SEEK_END);
+    *file = malloc(size);
+    if (size < FMUX_CAPTURE_MAGIC_LEN || pread(fd, *file, size, 0) != size ||
+        memcmp(*file, FMUX_CAPTURE_MAGIC, FMUX_CAPTURE_MAGIC_LEN) != 0)
+        return -1;
+    int n = 0;
+    for (off_t off = FMUX_CAPTURE_MAGIC_LEN; off < size && n < max; n++) {
+        memcpy(&records[n], *file + off, sizeof(records[n]));
+        payloads[n] = *file + off + sizeof(records[n]);
+        off += sizeof(records[n]) + (records[n].nbytes & FMUX_CAPTURE_LEN);
+    }
+    return n;
+}
+
+void
+test_frame_capture()
+{
+    int fd[2];
+    int err = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+    if (err < -1) { perror("socketpair"); FAILURE }
+    fmux_handle* sender = fmux_open(fd[0], FMUX_RECOMMENDED_CHANS);
+    fmux_handle* receiver = fmux_open(fd[1], FMUX_RECOMMENDED_CHANS);
+    FILE* files[2] = { tmpfile(), tmpfile() };
+    ASSERT((fmux_set_capture(sender, fileno(files[0])) == 0 && fmux_set_capture(receiver, fileno(files[1])) == 0))
+
+    //A pushed frame, then a write split into two frames, one bigger than
+    //the capture buffer
+    fmux_message* message = fmux_message_alloc(sender, 5);
+    message->channel_id = 3;
+    memcpy(message->data, "hello", 5);
+    fmux_push(sender, message);
+    fmux_message_release(message);
+    fmux_channel* out = fmux_open_channel(sender, 5);
+    fmux_channel* in = fmux_open_ring_channel(receiver, 5, 0, 0);
+    static char buf[CAPTURED];
+    for (int i = 0; i < CAPTURED; i++) buf[i] = (char)(i * 5);
+    int written = fmux_write(out, buf, CAPTURED);
+    fmux_message* got = NULL;
+    int popped = fmux_pop(receiver, &got);
+    free(got);
+    static char data[CAPTURED];
+    int nread = 0;
+    while (nread < CAPTURED) {
+        int n = fmux_read(in, data + nread, CAPTURED - nread);
+        if (n <= 0) break;
+        nread += n;
+    }
+    ASSERT((written == CAPTURED && popped == 1 && nread == CAPTURED))
+    //Turning it off writes out what's buffered
+    fmux_set_capture(sender, -1);
+    fmux_set_capture(receiver, -1);
+
+    uint32_t lengths[3] = { 5, FMUX_DEFAULT_FRAME, CAPTURED - FMUX_DEFAULT_FRAME };
+    int matched = 0;
+    for (int side = 0; side < 2; side++) {
+        char* file;
+        fmux_capture_record records[4];
+        const char* payloads[4];
+        int n = capture_load(fileno(files[side]), &file, records, payloads, 4);
+        for (int i = 0; i < n && n == 3; i++) {
+            uint32_t flags = records[i].nbytes & FMUX_CAPTURE_OUT;
+            const char* expect = (i == 0) ? "hello" : buf + (i - 1) * FMUX_DEFAULT_FRAME;
+            matched += (records[i].channel_id == ((i == 0) ? 3u : 5u) &&
+                        (records[i].nbytes & FMUX_CAPTURE_LEN) == lengths[i] &&
+                        flags == ((side == 0) ? FMUX_CAPTURE_OUT : 0) &&
+                        (i == 0 || records[i].ns >= records[i - 1].ns) &&
+                        memcmp(payloads[i], expect, lengths[i]) == 0);
+        }
+        free(file);
+        fclose(files[side]);
+    }
+    ASSERT((matched == 6))
+    fmux_close(sender);
+    fmux_close(receiver);
+}
 
 int
 main (int argc, char ** argv)
@@ -297,12 +1975,42 @@ main (int argc, char ** argv)
     test_basic_plumbing();
     test_writing();
     test_reading();
+    test_writing_vectors();
+    test_max_frame_size();
+    test_large_writes();
+    test_flow_control();
+    test_channel_priorities();
     test_writing_to_nonexistent_channel();
     test_reading_from_nonexistent_channel();
+    test_reading_split_frames();
+    test_sparse_channel_ids();
+    test_closed_channels_are_freed();
+    test_pooled_messages();
+    test_ring_channels();
+    test_ring_channel_backpressure();
     test_writing_to_closed_socket();
     test_reading_with_fmux_select();
+    test_select_with_many_channels();
+    test_open_channel_without_fds();
+    test_statistics();
+    test_corked_writes();
+    test_concurrent_pushes();
     //test_management_of_handle_lists();
     test_using_pump();
+    test_pump_wakes_promptly();
+    test_using_pump_pool();
+    test_pump_drains_channel_fds();
+    test_splice_forwarding();
+    test_shm_transport();
+    test_nonblocking_link();
+    test_message_channels();
+    test_message_channel_backlog();
+    test_compact_headers();
+    test_v2_against_v1_peer();
+    test_bonded_links();
+    test_frame_capture();
+    test_using_uring_pump();
+    test_uring_small_frames_into_full_ring();
 
     printf("\n\nTests: %6d; Passed: %6d; Failed: %6d\n\n", tests, successes, failures);
 
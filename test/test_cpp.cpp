@@ -0,0 +1,119 @@
+#include <fmux.hpp>
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+int successes = 0, failures = 0, tests = 0;
+#define SUCCESS tests++; fprintf(stderr, "."); successes++;
+#define FAILURE tests++; fprintf(stderr, "F"); failures++;
+#define ASSERT(x) \
+    if (x) { SUCCESS } else { FAILURE ;; fprintf(stderr, "%s\n", #x); return; }
+
+void
+test_handles_and_messages()
+{
+    int fd[2];
+    int err = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+    if (err < -1) { perror("socketpair"); FAILURE }
+
+    fmux::Handle sender(fd[0]);
+    fmux::Handle receiver(fd[1]);
+    fmux::Message message = sender.alloc(5, 7);
+    memcpy(message.data().data(), "Hello", 5);
+    sender.push(message);
+
+    fmux::Message got = receiver.pop();
+    ASSERT((got && got.channel_id() == 7 && got.data().size() == 5))
+    ASSERT((memcmp(got.data().data(), "Hello", 5) == 0))
+
+    //Moving a handle hands over the fd; the old one closes nothing
+    fmux::Handle moved(std::move(sender));
+    fmux::Channel channel = moved.channel(1);
+    ASSERT((channel.write_blocking(std::as_bytes(std::span("abc", 3))) == 3))
+    ASSERT((moved.stats().frames_out == 2))
+}
+
+#define CHANNELS 64
+#define PAYLOAD 10000
+
+fmux::Task
+writer(fmux::Channel& channel)
+{
+    std::byte data[PAYLOAD];
+    for (int i = 0; i < PAYLOAD; i++) data[i] = std::byte(i * channel.id());
+    co_await channel.write(data);
+}
+
+fmux::Task
+reader(fmux::Channel& channel, int* good)
+{
+    std::byte buf[PAYLOAD];
+    std::size_t got = 0;
+    while (got < PAYLOAD) {
+        std::size_t n = co_await channel.read(std::span(buf).subspan(got));
+        if (n == 0) co_return;
+        got += n;
+    }
+    for (int i = 0; i < PAYLOAD; i++) {
+        if (buf[i] != std::byte(i * channel.id())) co_return;
+    }
+    (*good)++;
+}
+
+fmux::Task
+failing()
+{
+    throw std::runtime_error("failing");
+    co_return;
+}
+
+void
+test_coroutines()
+{
+    int fd[2];
+    int err = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+    if (err < -1) { perror("socketpair"); FAILURE }
+
+    //A pump each, so neither end's writes hold up the other's reads
+    fmux::PumpPool sending(1), receiving(1);
+    fmux::Handle sender(fd[0], CHANNELS + 1);
+    fmux::Handle receiver(fd[1], CHANNELS + 1);
+    sending.add(sender);
+    receiving.add(receiver);
+
+    //Every conversation on one thread; half of them over ring channels
+    std::vector<fmux::Channel> out, in;
+    for (uint32_t i = 1; i <= CHANNELS; i++) {
+        out.push_back(sender.channel(i));
+        in.push_back((i % 2) ? receiver.ring_channel(i, FMUX_RING_MIN) : receiver.channel(i));
+    }
+    fmux::Loop loop;
+    int good = 0;
+    for (int i = 0; i < CHANNELS; i++) {
+        loop.spawn(reader(in[i], &good));
+        loop.spawn(writer(out[i]));
+    }
+    loop.run();
+    ASSERT((good == CHANNELS))
+
+    loop.spawn(failing());
+    bool thrown = false;
+    try {
+        loop.run();
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    ASSERT((thrown))
+}
+
+int
+main(int argc, char** argv)
+{
+    test_handles_and_messages();
+    test_coroutines();
+
+    printf("\n\nC++ tests: %6d; Passed: %6d; Failed: %6d\n\n", tests, successes, failures);
+
+    return (tests == successes) ? 0 : 1;
+}